@@ -8,6 +8,7 @@ URL:        https://github.com/mer-tools/sp-smaps
 Source0:    %{name}-%{version}.tar.gz
 BuildRequires:  python
 BuildRequires:  libsysperf-devel
+BuildRequires:  zlib-devel
 
 %description
 Utilities for collecting whole system SMAPS data and post-processing the information in it to cross-linked HTML tables
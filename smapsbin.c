@@ -0,0 +1,123 @@
+/*
+ * This file is part of sp-smaps
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* ========================================================================= *
+ * File: smapsbin.c
+ *
+ * Encoding helpers for the binary capture file format, see smapsbin.h
+ * ========================================================================= */
+
+#include "smapsbin.h"
+
+/* ------------------------------------------------------------------------- *
+ * smapsbin_put_varint  --  encode unsigned value, returns bytes used
+ * ------------------------------------------------------------------------- */
+
+size_t
+smapsbin_put_varint(unsigned char *dst, uint64_t val)
+{
+  size_t n = 0;
+
+  while( val >= 0x80 )
+  {
+    dst[n++] = (unsigned char)(val | 0x80);
+    val >>= 7;
+  }
+  dst[n++] = (unsigned char)val;
+  return n;
+}
+
+/* ------------------------------------------------------------------------- *
+ * smapsbin_get_varint  --  decode unsigned value, returns -1 on error
+ * ------------------------------------------------------------------------- */
+
+int
+smapsbin_get_varint(const unsigned char **ppos, const unsigned char *end,
+                    uint64_t *pval)
+{
+  const unsigned char *pos = *ppos;
+  uint64_t val = 0;
+  int      sft = 0;
+
+  for( ;; )
+  {
+    if( pos >= end || sft > 63 )
+    {
+      return -1;
+    }
+    val |= (uint64_t)(*pos & 0x7f) << sft;
+    if( !(*pos++ & 0x80) )
+    {
+      break;
+    }
+    sft += 7;
+  }
+
+  *ppos = pos, *pval = val;
+  return 0;
+}
+
+/* ------------------------------------------------------------------------- *
+ * smapsbin_get_bytes  --  skip over len bytes, returns NULL on error
+ * ------------------------------------------------------------------------- */
+
+const char *
+smapsbin_get_bytes(const unsigned char **ppos, const unsigned char *end,
+                   size_t len)
+{
+  const unsigned char *pos = *ppos;
+
+  if( len > (size_t)(end - pos) )
+  {
+    return 0;
+  }
+  *ppos = pos + len;
+  return (const char *)pos;
+}
+
+/* ------------------------------------------------------------------------- *
+ * smapsbin_prot_bits  --  "rw-p" -> SMAPSBIN_PROT_xxx bits
+ * ------------------------------------------------------------------------- */
+
+unsigned
+smapsbin_prot_bits(const char *prot)
+{
+  unsigned bits = 0;
+
+  if( prot[0] == 'r' ) bits |= SMAPSBIN_PROT_READ;
+  if( prot[0] && prot[1] == 'w' ) bits |= SMAPSBIN_PROT_WRITE;
+  if( prot[0] && prot[1] && prot[2] == 'x' ) bits |= SMAPSBIN_PROT_EXEC;
+  if( prot[0] && prot[1] && prot[2] && prot[3] == 's' ) bits |= SMAPSBIN_PROT_SHARED;
+  return bits;
+}
+
+/* ------------------------------------------------------------------------- *
+ * smapsbin_prot_text  --  SMAPSBIN_PROT_xxx bits -> "rw-p"
+ * ------------------------------------------------------------------------- */
+
+char *
+smapsbin_prot_text(char *dst, unsigned bits)
+{
+  dst[0] = (bits & SMAPSBIN_PROT_READ)   ? 'r' : '-';
+  dst[1] = (bits & SMAPSBIN_PROT_WRITE)  ? 'w' : '-';
+  dst[2] = (bits & SMAPSBIN_PROT_EXEC)   ? 'x' : '-';
+  dst[3] = (bits & SMAPSBIN_PROT_SHARED) ? 's' : 'p';
+  dst[4] = 0;
+  return dst;
+}
@@ -0,0 +1,126 @@
+/*
+ * This file is part of sp-smaps
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* ========================================================================= *
+ * File: smapsbin.h
+ *
+ * Binary capture file format shared by sp_smaps_snapshot (writer) and
+ * sp_smaps_filter (reader).
+ *
+ * The file starts with SMAPSBIN_MAGIC followed by format version as a
+ * varint. The rest of the file is a sequence of records, each starting
+ * with a record type byte. All integers are stored as LEB128 style
+ * unsigned varints, signed values are zigzag encoded first.
+ *
+ *   'S' string    : id, length, bytes
+ *   'F' fields    : field set, count, string id for each field name
+ *   'I' info      : key string id, value string id
+ *   'P' process   : pid, name string id, presence mask, value for each
+ *                   status field set in the presence mask, mapping
+ *                   field mask
+ *   'M' mapping   : zigzag(head - previous tail), tail - head,
+ *                   protection bits, offset, device major, device minor,
+ *                   inode, path string id, zigzag(value - previous value)
+ *                   for each field set in the mapping field mask of the
+ *                   preceding process record
+ *   'U' unchanged : pid of process that has not changed since the
+ *                   capture named in the "Base" info record
+ *   'T' time      : microseconds since the "Started" info record when
+ *                   reading data for the next process record began
+ *   'E' end       : end of capture
+ *
+ * String id zero is reserved for "no string". Strings are defined before
+ * the first record that refers to them. The field sets define the layout
+ * of process and mapping records that follow; the previous values used
+ * in delta encoding are reset to zero at every process record.
+ * ========================================================================= */
+
+#ifndef SMAPSBIN_H_
+#define SMAPSBIN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#elif 0
+} /* fool JED indentation ... */
+#endif
+
+#define SMAPSBIN_MAGIC       "\177SMAPSB\n"
+#define SMAPSBIN_MAGIC_SIZE  8
+#define SMAPSBIN_VERSION     3 // 2: added 'U' records, 3: 'T' records
+
+/* Longest possible encoded varint */
+#define SMAPSBIN_VARINT_MAX  10
+
+enum
+{
+  SMAPSBIN_STRING    = 'S',
+  SMAPSBIN_FIELDS    = 'F',
+  SMAPSBIN_INFO      = 'I',
+  SMAPSBIN_PROCESS   = 'P',
+  SMAPSBIN_MAPPING   = 'M',
+  SMAPSBIN_UNCHANGED = 'U',
+  SMAPSBIN_TIME      = 'T',
+  SMAPSBIN_END       = 'E',
+};
+
+enum
+{
+  SMAPSBIN_FIELDS_STATUS,  // numeric /proc/pid/status values
+  SMAPSBIN_FIELDS_MAPPING, // smaps values for each mapping
+};
+
+enum
+{
+  SMAPSBIN_PROT_READ   = 1<<0,
+  SMAPSBIN_PROT_WRITE  = 1<<1,
+  SMAPSBIN_PROT_EXEC   = 1<<2,
+  SMAPSBIN_PROT_SHARED = 1<<3,
+};
+
+/* ------------------------------------------------------------------------- *
+ * zigzag encoding for signed values
+ * ------------------------------------------------------------------------- */
+
+static inline uint64_t smapsbin_zigzag(int64_t val)
+{
+  return ((uint64_t)val << 1) ^ (uint64_t)(val >> 63);
+}
+
+static inline int64_t smapsbin_unzigzag(uint64_t val)
+{
+  return (int64_t)(val >> 1) ^ -(int64_t)(val & 1);
+}
+
+size_t      smapsbin_put_varint(unsigned char *dst, uint64_t val);
+int         smapsbin_get_varint(const unsigned char **ppos,
+                                const unsigned char *end, uint64_t *pval);
+const char *smapsbin_get_bytes (const unsigned char **ppos,
+                                const unsigned char *end, size_t len);
+
+unsigned    smapsbin_prot_bits (const char *prot);
+char       *smapsbin_prot_text (char *dst, unsigned bits);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* SMAPSBIN_H_ */
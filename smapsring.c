@@ -0,0 +1,487 @@
+/*
+ * This file is part of sp-smaps
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* ========================================================================= *
+ * File: smapsring.c
+ *
+ * Reader side of the shared memory capture ring, see smapsring.h
+ *
+ * Typical use:
+ *
+ *   smapsring_t         ring;
+ *   smapsring_capture_t cap;
+ *   smapsring_iter_t    it;
+ *
+ *   smapsring_open(&ring, "sp_smaps");
+ *   if( smapsring_latest(&ring, &cap) == 0 &&
+ *       smapsring_iter_init(&it, &cap) == 0 )
+ *   {
+ *     int pss = smapsring_iter_field(&it, SMAPSBIN_FIELDS_MAPPING, "Pss");
+ *     for( int t; (t = smapsring_iter_next(&it)) > SMAPSRING_DONE; )
+ *     {
+ *       if( t == SMAPSRING_MAPPING && pss >= 0 )
+ *         total[it.proc.pid] += it.vma.value[pss];
+ *     }
+ *     smapsring_iter_dtor(&it);
+ *     if( !smapsring_valid(&cap) ) ... overwritten while reading, retry
+ *   }
+ *   smapsring_close(&ring);
+ *
+ * The field sets defined at the start of the capture are available
+ * when smapsring_iter_init() returns. Mapping values are delta decoded
+ * while iterating, so records can't be skipped over.
+ * ========================================================================= */
+
+#include "smapsring.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* ------------------------------------------------------------------------- *
+ * smapsring_open  --  map existing ring for reading
+ * ------------------------------------------------------------------------- */
+
+int
+smapsring_open(smapsring_t *self, const char *name)
+{
+  struct stat st;
+  void       *base;
+  char        path[256];
+
+  self->fd   = -1;
+  self->size = 0;
+  self->head = 0;
+
+  /* shm_open() wants the name to start with a slash */
+  snprintf(path, sizeof path, "%s%s", *name == '/' ? "" : "/", name);
+
+  if( (self->fd = shm_open(path, O_RDONLY|O_CLOEXEC, 0)) == -1 )
+  {
+    return -1;
+  }
+
+  if( fstat(self->fd, &st) == -1 ||
+      (size_t)st.st_size < sizeof *self->head )
+  {
+    goto failed;
+  }
+
+  base = mmap(0, st.st_size, PROT_READ, MAP_SHARED, self->fd, 0);
+  if( base == MAP_FAILED )
+  {
+    goto failed;
+  }
+  self->head = base;
+  self->size = st.st_size;
+
+  if( memcmp(self->head->magic, SMAPSRING_MAGIC, SMAPSRING_MAGIC_SIZE) ||
+      self->head->version != SMAPSRING_VERSION ||
+      sizeof *self->head + self->head->slots * sizeof *self->head->slot
+      > self->size )
+  {
+    errno = EPROTO;
+    goto failed;
+  }
+
+  return 0;
+
+  failed:
+  {
+    int err = errno;
+    smapsring_close(self);
+    errno = err;
+  }
+  return -1;
+}
+
+/* ------------------------------------------------------------------------- *
+ * smapsring_close  --  unmap ring
+ * ------------------------------------------------------------------------- */
+
+void
+smapsring_close(smapsring_t *self)
+{
+  if( self->head != 0 )
+  {
+    munmap((void *)self->head, self->size), self->head = 0;
+  }
+  if( self->fd != -1 )
+  {
+    close(self->fd), self->fd = -1;
+  }
+  self->size = 0;
+}
+
+/* ------------------------------------------------------------------------- *
+ * smapsring_latest  --  get most recently published capture
+ *
+ * Returns -1 with errno set to EAGAIN if nothing has been published
+ * yet, or if the slot was just being rewritten.
+ * ------------------------------------------------------------------------- */
+
+int
+smapsring_latest(const smapsring_t *self, smapsring_capture_t *cap)
+{
+  const smapsring_header_t *head = self->head;
+  uint64_t                  published;
+
+  published = __atomic_load_n(&head->published, __ATOMIC_ACQUIRE);
+
+  if( published == 0 || head->slots == 0 )
+  {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  cap->slot = &head->slot[(published - 1) % head->slots];
+  cap->seq  = __atomic_load_n(&cap->slot->seq, __ATOMIC_ACQUIRE);
+
+  if( cap->seq & 1 )
+  {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  cap->size = cap->slot->size;
+  cap->data = (const unsigned char *)head + cap->slot->offset;
+
+  if( cap->slot->offset > self->size ||
+      cap->size > self->size - cap->slot->offset )
+  {
+    errno = EPROTO;
+    return -1;
+  }
+  return 0;
+}
+
+/* ------------------------------------------------------------------------- *
+ * smapsring_valid  --  check that capture was not overwritten meanwhile
+ * ------------------------------------------------------------------------- */
+
+int
+smapsring_valid(const smapsring_capture_t *cap)
+{
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&cap->slot->seq, __ATOMIC_RELAXED) == cap->seq;
+}
+
+/* ------------------------------------------------------------------------- *
+ * smapsring_iter_define  --  decode string or field set definition
+ * ------------------------------------------------------------------------- */
+
+static int
+smapsring_iter_define(smapsring_iter_t *self, int type,
+                      const unsigned char **ppos)
+{
+  const unsigned char *pos = *ppos;
+  const unsigned char *end = self->end;
+
+#define GET(v) if( smapsbin_get_varint(&pos, end, &(v)) ) return -1
+
+  if( type == SMAPSBIN_STRING )
+  {
+    uint64_t    id, len;
+    const char *str;
+
+    GET(id); GET(len);
+
+    /* the snapshot resets its string table for every capture, so ids
+     * are dense and assigned in order -> anything far off is garbage */
+    if( (str = smapsbin_get_bytes(&pos, end, len)) == 0 ||
+        id == 0 || id > self->strs_alloc + 0x10000 )
+    {
+      return -1;
+    }
+    if( id >= self->strs_alloc )
+    {
+      size_t alloc = self->strs_alloc ? self->strs_alloc : 256;
+      void  *temp;
+
+      while( alloc <= id ) alloc *= 2;
+      if( (temp = realloc(self->strs, alloc * sizeof *self->strs)) == 0 )
+      {
+        return -1;
+      }
+      self->strs = temp;
+      memset(self->strs + self->strs_alloc, 0,
+             (alloc - self->strs_alloc) * sizeof *self->strs);
+      self->strs_alloc = alloc;
+    }
+    self->strs[id].str = str;
+    self->strs[id].len = len;
+  }
+  else
+  {
+    uint64_t set, cnt, id;
+
+    GET(set); GET(cnt);
+    if( set > SMAPSBIN_FIELDS_MAPPING || cnt > SMAPSRING_FIELDS_MAX )
+    {
+      return -1;
+    }
+    self->nfld[set] = (unsigned)cnt;
+    for( uint64_t i = 0; i < cnt; ++i )
+    {
+      GET(id);
+      self->fld[set][i] = (unsigned)id;
+    }
+  }
+#undef GET
+
+  *ppos = pos;
+  return 0;
+}
+
+/* ------------------------------------------------------------------------- *
+ * smapsring_iter_init  --  start iterating over capture records
+ * ------------------------------------------------------------------------- */
+
+int
+smapsring_iter_init(smapsring_iter_t *self, const smapsring_capture_t *cap)
+{
+  uint64_t version;
+
+  memset(self, 0, sizeof *self);
+
+  self->pos = cap->data;
+  self->end = cap->data + cap->size;
+
+  if( cap->size < SMAPSBIN_MAGIC_SIZE ||
+      memcmp(cap->data, SMAPSBIN_MAGIC, SMAPSBIN_MAGIC_SIZE) )
+  {
+    return -1;
+  }
+  self->pos += SMAPSBIN_MAGIC_SIZE;
+
+  if( smapsbin_get_varint(&self->pos, self->end, &version) ||
+      version < 1 || version > SMAPSBIN_VERSION )
+  {
+    return -1;
+  }
+
+  /* field sets are defined at the start, make them available
+   * for smapsring_iter_field() right away */
+  while( self->pos < self->end &&
+         (*self->pos == SMAPSBIN_STRING || *self->pos == SMAPSBIN_FIELDS) )
+  {
+    int type = *self->pos++;
+
+    if( smapsring_iter_define(self, type, &self->pos) == -1 )
+    {
+      smapsring_iter_dtor(self);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* ------------------------------------------------------------------------- *
+ * smapsring_iter_dtor  --  release iterator resources
+ * ------------------------------------------------------------------------- */
+
+void
+smapsring_iter_dtor(smapsring_iter_t *self)
+{
+  free(self->strs), self->strs = 0;
+  self->strs_alloc = 0;
+}
+
+/* ------------------------------------------------------------------------- *
+ * smapsring_iter_str  --  string by id, empty if not defined
+ * ------------------------------------------------------------------------- */
+
+static smapsring_str_t
+smapsring_iter_str(const smapsring_iter_t *self, uint64_t id)
+{
+  static const smapsring_str_t none = { "", 0 };
+
+  if( id == 0 || id >= self->strs_alloc || self->strs[id].str == 0 )
+  {
+    return none;
+  }
+  return self->strs[id];
+}
+
+/* ------------------------------------------------------------------------- *
+ * smapsring_iter_field  --  index of named field in field set, or -1
+ * ------------------------------------------------------------------------- */
+
+int
+smapsring_iter_field(const smapsring_iter_t *self, int set, const char *name)
+{
+  size_t len = strlen(name);
+
+  if( set != SMAPSBIN_FIELDS_STATUS && set != SMAPSBIN_FIELDS_MAPPING )
+  {
+    return -1;
+  }
+
+  for( unsigned i = 0; i < self->nfld[set]; ++i )
+  {
+    smapsring_str_t str = smapsring_iter_str(self, self->fld[set][i]);
+
+    if( str.len == len && !memcmp(str.str, name, len) )
+    {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+/* ------------------------------------------------------------------------- *
+ * smapsring_iter_next  --  decode records until one for the caller
+ *
+ * Returns SMAPSRING_xxx record type. String, field set and time records
+ * are consumed internally.
+ * ------------------------------------------------------------------------- */
+
+int
+smapsring_iter_next(smapsring_iter_t *self)
+{
+  const unsigned char *pos = self->pos;
+  const unsigned char *end = self->end;
+  uint64_t             val;
+  int                  res = SMAPSRING_ERROR;
+
+#define GET(v) if( smapsbin_get_varint(&pos, end, &(v)) ) goto cleanup
+
+  while( pos < end )
+  {
+    int type = *pos++;
+
+    switch( type )
+    {
+    case SMAPSBIN_END:
+      pos = end;
+      res = SMAPSRING_DONE;
+      goto cleanup;
+
+    case SMAPSBIN_STRING:
+    case SMAPSBIN_FIELDS:
+      if( smapsring_iter_define(self, type, &pos) == -1 )
+      {
+        goto cleanup;
+      }
+      break;
+
+    case SMAPSBIN_INFO:
+      {
+        uint64_t key;
+
+        GET(key); GET(val);
+        self->key = smapsring_iter_str(self, key);
+        self->val = smapsring_iter_str(self, val);
+        res = SMAPSRING_INFO;
+        goto cleanup;
+      }
+
+    case SMAPSBIN_TIME:
+      GET(val);
+      self->proc.time = val * 1e-6;
+      break;
+
+    case SMAPSBIN_UNCHANGED:
+      {
+        uint64_t pid;
+
+        GET(pid);
+        self->unchanged = (int)pid;
+        res = SMAPSRING_UNCHANGED;
+        goto cleanup;
+      }
+
+    case SMAPSBIN_PROCESS:
+      {
+        uint64_t pid, name;
+        double   time = self->proc.time;
+
+        GET(pid); GET(name);
+
+        memset(&self->proc, 0, sizeof self->proc);
+        memset(&self->vma, 0, sizeof self->vma);
+
+        self->proc.pid  = (int)pid;
+        self->proc.name = smapsring_iter_str(self, name);
+        self->proc.time = time;
+
+        GET(self->proc.present);
+        for( unsigned i = 0; i < self->nfld[SMAPSBIN_FIELDS_STATUS]; ++i )
+        {
+          if( self->proc.present & (1ull << i) )
+          {
+            GET(self->proc.status[i]);
+          }
+        }
+        GET(self->mask);
+        res = SMAPSRING_PROCESS;
+        goto cleanup;
+      }
+
+    case SMAPSBIN_MAPPING:
+      {
+        smapsring_vma_t *vma = &self->vma;
+        uint64_t         head, len, prot, major, minor, path;
+
+        if( self->proc.pid == 0 )
+        {
+          goto cleanup;
+        }
+
+        GET(head); GET(len); GET(prot); GET(vma->offs);
+        GET(major); GET(minor); GET(vma->inode); GET(path);
+
+        vma->head  = vma->tail + smapsbin_unzigzag(head);
+        vma->tail  = vma->head + len;
+        vma->prot  = (unsigned)prot;
+        vma->major = (unsigned)major;
+        vma->minor = (unsigned)minor;
+        vma->path  = smapsring_iter_str(self, path);
+
+        /* values are deltas against previous mapping */
+        for( unsigned i = 0; i < self->nfld[SMAPSBIN_FIELDS_MAPPING]; ++i )
+        {
+          if( self->mask & (1ull << i) )
+          {
+            GET(val);
+            vma->value[i] += smapsbin_unzigzag(val);
+          }
+        }
+        res = SMAPSRING_MAPPING;
+        goto cleanup;
+      }
+
+    default:
+      goto cleanup;
+    }
+  }
+
+  /* ran out of data without end record */
+
+  cleanup:
+#undef GET
+
+  self->pos = (res == SMAPSRING_ERROR) ? end : pos;
+  return res;
+}
@@ -0,0 +1,162 @@
+/*
+ * This file is part of sp-smaps
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* ========================================================================= *
+ * File: smapsring.h
+ *
+ * Shared memory ring of binary captures written by sp_smaps_snapshot
+ * (see --shm) and the reader side library for local consumers.
+ *
+ * The POSIX shared memory object starts with smapsring_header_t, which
+ * is followed by fixed size slots, each holding one capture in the
+ * binary format described in smapsbin.h.
+ *
+ * There is a single writer. Each slot has a sequence counter that is
+ * odd while the slot is being written and even when it holds complete
+ * data. Readers look up the most recently published slot, remember its
+ * sequence, parse the data in place and then check that the sequence
+ * has not changed, i.e. that the writer did not reuse the slot while
+ * it was being read. No locks are taken on either side.
+ * ========================================================================= */
+
+#ifndef SMAPSRING_H_
+#define SMAPSRING_H_
+
+#include "smapsbin.h"
+
+#ifdef __cplusplus
+extern "C" {
+#elif 0
+} /* fool JED indentation ... */
+#endif
+
+#define SMAPSRING_MAGIC       "\177SMAPSR\n"
+#define SMAPSRING_MAGIC_SIZE  8
+#define SMAPSRING_VERSION     1
+
+/* Most fields a binary capture field set can have */
+#define SMAPSRING_FIELDS_MAX  64
+
+/* ------------------------------------------------------------------------- *
+ * shared memory layout
+ * ------------------------------------------------------------------------- */
+
+typedef struct smapsring_slot_t
+{
+  uint64_t seq;    // 2n+1 while capture n is written, 2n+2 when done
+  uint64_t size;   // bytes of capture data in the slot
+  uint64_t offset; // slot data position from start of shared memory
+  uint64_t spare;
+} smapsring_slot_t;
+
+typedef struct smapsring_header_t
+{
+  char             magic[SMAPSRING_MAGIC_SIZE];
+  uint32_t         version;
+  uint32_t         slots;     // number of slots
+  uint64_t         slot_size; // bytes available in each slot
+  uint64_t         published; // captures published so far
+  smapsring_slot_t slot[];
+} smapsring_header_t;
+
+/* ------------------------------------------------------------------------- *
+ * reader side
+ * ------------------------------------------------------------------------- */
+
+typedef struct smapsring_t
+{
+  int                       fd;
+  size_t                    size;
+  const smapsring_header_t *head;
+} smapsring_t;
+
+typedef struct smapsring_capture_t
+{
+  const smapsring_slot_t *slot;
+  uint64_t                seq;  // slot sequence when capture was taken
+  const unsigned char    *data;
+  size_t                  size;
+} smapsring_capture_t;
+
+typedef struct smapsring_str_t
+{
+  const char *str;  // not zero terminated
+  size_t      len;
+} smapsring_str_t;
+
+enum
+{
+  SMAPSRING_ERROR = -1, // corrupted or overwritten data
+  SMAPSRING_DONE,       // end of capture
+  SMAPSRING_INFO,       // key & val are valid
+  SMAPSRING_PROCESS,    // proc is valid
+  SMAPSRING_MAPPING,    // proc & vma are valid
+  SMAPSRING_UNCHANGED,  // pid of process unchanged since base capture
+};
+
+typedef struct smapsring_proc_t
+{
+  int              pid;
+  smapsring_str_t  name;
+  double           time;    // seconds since "Started", or zero
+  uint64_t         present; // bit mask of status values present
+  uint64_t         status[SMAPSRING_FIELDS_MAX];
+} smapsring_proc_t;
+
+typedef struct smapsring_vma_t
+{
+  uint64_t         head, tail, offs, inode;
+  unsigned         prot, major, minor;
+  smapsring_str_t  path;
+  uint64_t         value[SMAPSRING_FIELDS_MAX];
+} smapsring_vma_t;
+
+typedef struct smapsring_iter_t
+{
+  const unsigned char *pos;
+  const unsigned char *end;
+
+  smapsring_str_t     *strs;      // string table, index = string id
+  size_t               strs_alloc;
+
+  unsigned             nfld[2];   // SMAPSBIN_FIELDS_xxx set sizes
+  unsigned             fld[2][SMAPSRING_FIELDS_MAX]; // field name ids
+  uint64_t             mask;      // mapping fields present in process
+
+  smapsring_str_t      key, val;  // SMAPSRING_INFO
+  smapsring_proc_t     proc;      // SMAPSRING_PROCESS / _MAPPING
+  smapsring_vma_t      vma;       // SMAPSRING_MAPPING
+  int                  unchanged; // SMAPSRING_UNCHANGED
+} smapsring_iter_t;
+
+int  smapsring_open      (smapsring_t *self, const char *name);
+void smapsring_close     (smapsring_t *self);
+int  smapsring_latest    (const smapsring_t *self, smapsring_capture_t *cap);
+int  smapsring_valid     (const smapsring_capture_t *cap);
+
+int  smapsring_iter_init (smapsring_iter_t *self, const smapsring_capture_t *cap);
+int  smapsring_iter_next (smapsring_iter_t *self);
+int  smapsring_iter_field(const smapsring_iter_t *self, int set, const char *name);
+void smapsring_iter_dtor (smapsring_iter_t *self);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* SMAPSRING_H_ */
@@ -0,0 +1,1091 @@
+/*
+ * This file is part of sp-smaps
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* ========================================================================= *
+ * File: sp_smaps_fakeproc.c
+ *
+ * Builds a synthetic /proc tree that sp_smaps_snapshot can read with
+ * --proc-root, so that capture throughput can be measured repeatably
+ * and with more processes than the development host has.
+ * ========================================================================= */
+
+/* ========================================================================= *
+ * Include files
+ * ========================================================================= */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include <libsysperf/msg.h>
+#include <libsysperf/argvec.h>
+
+/* ========================================================================= *
+ * Configuration
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * Tool Version
+ * ------------------------------------------------------------------------- */
+
+#define TOOL_NAME "sp_smaps_fakeproc"
+#include "release.h"
+
+/* ------------------------------------------------------------------------- *
+ * Runtime Manual
+ * ------------------------------------------------------------------------- */
+
+static const manual_t app_man[]=
+{
+  MAN_ADD("NAME",
+          TOOL_NAME"  --  generate synthetic /proc tree for benchmarking\n"
+          )
+  MAN_ADD("SYNOPSIS",
+          ""TOOL_NAME" [options] -o <directory>\n"
+          )
+  MAN_ADD("DESCRIPTION",
+          "This tool writes a directory tree that looks like /proc to\n"
+          "sp_smaps_snapshot (see its --proc-root option). Every process\n"
+          "directory gets status, stat, cmdline, comm, maps, smaps and\n"
+          "smaps_rollup files; the tree also gets meminfo and a 'self'\n"
+          "link.\n"
+          "\n"
+          "By default the processes are synthetic: an init process,\n"
+          "kthreadd with a number of kernel threads, and user processes\n"
+          "with the given average number of mappings, drawn from a shared\n"
+          "pool of libraries plus private executable, heap, anonymous and\n"
+          "stack mappings. The values come from a seeded pseudo random\n"
+          "sequence, so the same options always give the same tree.\n"
+          "\n"
+          "With --replay the processes are taken from a text capture\n"
+          "instead (binary captures can be converted with\n"
+          "sp_smaps_flatten). If more processes are requested than the\n"
+          "capture has, its processes are repeated under new pids.\n"
+          "\n"
+          "Use an empty directory: process directories left over from\n"
+          "earlier runs are not removed.\n"
+          )
+  MAN_ADD("OPTIONS", 0)
+
+  MAN_ADD("EXAMPLES",
+          "% "TOOL_NAME" -n 10000 -m 60 -o /tmp/fakeproc\n"
+          "% time sp_smaps_snapshot --proc-root /tmp/fakeproc -o /dev/null\n"
+          "\n"
+          "  Measures how long capturing 10000 processes takes.\n"
+          "\n"
+          "% "TOOL_NAME" --replay device.cap -n 5000 -o /tmp/fakeproc\n"
+          "\n"
+          "  Builds a tree from an earlier capture, repeated to 5000\n"
+          "  processes.\n"
+          )
+  MAN_ADD("SEE ALSO",
+          "sp_smaps_snapshot (1)\n"
+          "\n"
+          )
+  MAN_END
+};
+
+/* ------------------------------------------------------------------------- *
+ * Commandline Arguments
+ * ------------------------------------------------------------------------- */
+
+enum
+{
+  opt_noswitch = -1,
+  opt_help,
+  opt_vers,
+
+  opt_verbose,
+  opt_quiet,
+  opt_silent,
+
+  opt_output,
+  opt_processes,
+  opt_mappings,
+  opt_kthreads,
+  opt_seed,
+  opt_replay,
+};
+
+static const option_t app_opt[] =
+{
+  /* - - - - - - - - - - - - - - - - - - - *
+   * usage, version & verbosity
+   * - - - - - - - - - - - - - - - - - - - */
+
+  OPT_ADD(opt_help,
+          "h", "help", 0,
+          "This help text\n"),
+
+  OPT_ADD(opt_vers,
+          "V", "version", 0,
+          "Tool version\n"),
+
+  OPT_ADD(opt_verbose,
+          "v", "verbose", 0,
+          "Enable diagnostic messages\n"),
+
+  OPT_ADD(opt_quiet,
+          "q", "quiet", 0,
+          "Disable warning messages\n"),
+
+  OPT_ADD(opt_silent,
+          "s", "silent", 0,
+          "Disable all messages\n"),
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * application options
+   * - - - - - - - - - - - - - - - - - - - */
+
+  OPT_ADD(opt_output,
+          "o", "output", "<directory>",
+          "Directory to create the tree in.\n" ),
+
+  OPT_ADD(opt_processes,
+          "n", "processes", "<count>",
+          "Number of processes, including kernel threads.\n"
+          "Default is 1000, or all processes when replaying.\n" ),
+
+  OPT_ADD(opt_mappings,
+          "m", "mappings", "<count>",
+          "Average number of mappings per user process.\n"
+          "Default is 50.\n" ),
+
+  OPT_ADD(opt_kthreads,
+          "k", "kthreads", "<count>",
+          "Number of kernel threads besides kthreadd.\n"
+          "Default is 100.\n" ),
+
+  OPT_ADD(opt_seed,
+          "S", "seed", "<number>",
+          "Seed for the pseudo random values. Default is 1.\n" ),
+
+  OPT_ADD(opt_replay,
+          "r", "replay", "<capture>",
+          "Take processes from given text capture.\n" ),
+
+  OPT_END
+};
+
+static const char *outdir    = 0;
+static unsigned    processes = 0;   // 0 = default
+static unsigned    mappings  = 50;
+static unsigned    kthreads  = 100;
+static uint64_t    seed      = 1;
+static const char *replay    = 0;
+
+/* ========================================================================= *
+ * Utility functions
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * rnd  --  xorshift64* pseudo random numbers, reproducible by seed
+ * ------------------------------------------------------------------------- */
+
+static uint64_t rnd_state = 1;
+
+static uint64_t rnd(void)
+{
+  rnd_state ^= rnd_state >> 12;
+  rnd_state ^= rnd_state << 25;
+  rnd_state ^= rnd_state >> 27;
+  return rnd_state * 2685821657736338717ull;
+}
+
+static unsigned rnd_below(unsigned limit)
+{
+  return limit ? (unsigned)(rnd() % limit) : 0;
+}
+
+/* ------------------------------------------------------------------------- *
+ * strbuf_t  --  growing text buffer for file contents
+ * ------------------------------------------------------------------------- */
+
+typedef struct strbuf_t
+{
+  char   *data;
+  size_t  used;
+  size_t  alloc;
+} strbuf_t;
+
+static void strbuf_dtor(strbuf_t *self)
+{
+  free(self->data);
+  self->data  = 0;
+  self->used  = 0;
+  self->alloc = 0;
+}
+
+static void strbuf_reserve(strbuf_t *self, size_t need)
+{
+  if( self->used + need + 1 > self->alloc )
+  {
+    size_t alloc = self->alloc ? self->alloc : 4096;
+
+    while( self->used + need + 1 > alloc ) alloc *= 2;
+    if( (self->data = realloc(self->data, alloc)) == 0 )
+    {
+      msg_fatal("buffer: %s\n", strerror(errno));
+    }
+    self->alloc = alloc;
+  }
+}
+
+static void strbuf_add(strbuf_t *self, const char *data, size_t size)
+{
+  strbuf_reserve(self, size);
+  memcpy(self->data + self->used, data, size);
+  self->used += size;
+  self->data[self->used] = 0;
+}
+
+static void strbuf_fmt(strbuf_t *self, const char *fmt, ...)
+{
+  va_list va;
+  int     len;
+
+  va_start(va, fmt);
+  len = vsnprintf(0, 0, fmt, va);
+  va_end(va);
+
+  strbuf_reserve(self, len);
+
+  va_start(va, fmt);
+  vsnprintf(self->data + self->used, len + 1, fmt, va);
+  va_end(va);
+
+  self->used += len;
+}
+
+/* ------------------------------------------------------------------------- *
+ * strbuf_value  --  add "Key:   value kB" line aligned as the kernel does
+ * ------------------------------------------------------------------------- */
+
+static void strbuf_value(strbuf_t *self, const char *key, uint64_t val)
+{
+  int pad = 15 - (int)strlen(key);
+
+  strbuf_fmt(self, "%s:%*s%8" PRIu64 " kB\n", key, pad > 0 ? pad : 0, "", val);
+}
+
+/* ------------------------------------------------------------------------- *
+ * write_file  --  write buffer to file relative to directory
+ * ------------------------------------------------------------------------- */
+
+static void write_file(int dir, const char *name, const void *data, size_t size)
+{
+  const char *pos  = data;
+  const char *end  = pos + size;
+  int         file = openat(dir, name, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0444);
+
+  if( file == -1 )
+  {
+    msg_fatal("%s: %s\n", name, strerror(errno));
+  }
+  while( pos < end )
+  {
+    ssize_t put = write(file, pos, end - pos);
+
+    if( put == -1 )
+    {
+      if( errno == EINTR ) continue;
+      msg_fatal("%s: write: %s\n", name, strerror(errno));
+    }
+    pos += put;
+  }
+  close(file);
+}
+
+/* ========================================================================= *
+ * Fake Process Data
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * smaps value fields, in the order the kernel lists them
+ * ------------------------------------------------------------------------- */
+
+#define SMAPS_FIELDS(X) \
+  X(Size) X(KernelPageSize) X(MMUPageSize) X(Rss) X(Pss) X(Shared_Clean) \
+  X(Shared_Dirty) X(Private_Clean) X(Private_Dirty) X(Referenced) \
+  X(Anonymous) X(LazyFree) X(AnonHugePages) X(ShmemPmdMapped) \
+  X(FilePmdMapped) X(Shared_Hugetlb) X(Private_Hugetlb) X(Swap) X(SwapPss) \
+  X(Locked)
+
+enum
+{
+#define X(v) FLD_##v,
+  SMAPS_FIELDS(X)
+#undef X
+  FLD_COUNT
+};
+
+static const char * const fld_name[FLD_COUNT] =
+{
+#define X(v) #v,
+  SMAPS_FIELDS(X)
+#undef X
+};
+
+/* ------------------------------------------------------------------------- *
+ * fakeproc_t  --  contents of one /proc/pid directory
+ * ------------------------------------------------------------------------- */
+
+typedef struct fakeproc_t
+{
+  int       pid;
+  int       ppid;
+  int       threads;
+  char     *cmdline;           // argv[0] only
+  char     *comm;
+  int       kernel;            // no mappings
+
+  strbuf_t  status;            // status lines other than Name/Pid/PPid
+  strbuf_t  smaps;
+  strbuf_t  maps;
+
+  uint64_t  total[FLD_COUNT];  // kB summed over mappings
+  uint64_t  vm_exe, vm_lib;    // kB of executable & library mappings
+  uint64_t  vm_stk;
+} fakeproc_t;
+
+static void fakeproc_ctor(fakeproc_t *self)
+{
+  memset(self, 0, sizeof *self);
+}
+
+static void fakeproc_dtor(fakeproc_t *self)
+{
+  free(self->cmdline);
+  free(self->comm);
+  strbuf_dtor(&self->status);
+  strbuf_dtor(&self->smaps);
+  strbuf_dtor(&self->maps);
+}
+
+/* ------------------------------------------------------------------------- *
+ * fakeproc_set_names  --  cmdline & comm, the latter truncated as kernel does
+ *
+ * Kernel threads have no cmdline and their full name is shown as is.
+ * ------------------------------------------------------------------------- */
+
+static void fakeproc_set_names(fakeproc_t *self, const char *cmdline)
+{
+  const char *base = self->kernel ? 0 : strrchr(cmdline, '/');
+
+  free(self->cmdline);
+  free(self->comm);
+  self->cmdline = strdup(cmdline);
+  self->comm    = self->kernel ? strdup(cmdline) :
+    strndup(base ? base + 1 : cmdline, 15);
+  if( !self->cmdline || !self->comm )
+  {
+    msg_fatal("names: %s\n", strerror(errno));
+  }
+  self->comm[strcspn(self->comm, " ")] = 0;
+}
+
+/* ------------------------------------------------------------------------- *
+ * fakeproc_add_vma  --  append one mapping to smaps & maps
+ * ------------------------------------------------------------------------- */
+
+static void fakeproc_add_vma(fakeproc_t *self, uint64_t head, uint64_t size_kb,
+                             const char *prot, uint64_t offs, unsigned dev,
+                             uint64_t inode, const char *path,
+                             const uint64_t *val)
+{
+  char line[256];
+  int  len;
+
+  len = snprintf(line, sizeof line, "%08" PRIx64 "-%08" PRIx64 " %s %08" PRIx64
+                 " %02x:%02x %" PRIu64 " ", head, head + size_kb * 1024, prot,
+                 offs, dev >> 8, dev & 0xff, inode);
+  if( *path )
+  {
+    /* the kernel pads the path to a fixed column */
+    len += snprintf(line + len, sizeof line - len, "%*s%s",
+                    len < 73 ? 73 - len : 0, "", path);
+  }
+  line[len++] = '\n';
+
+  strbuf_add(&self->maps,  line, len);
+  strbuf_add(&self->smaps, line, len);
+
+  for( int i = 0; i < FLD_COUNT; ++i )
+  {
+    strbuf_value(&self->smaps, fld_name[i], val[i]);
+    self->total[i] += val[i];
+  }
+  strbuf_fmt(&self->smaps, "THPeligible:    0\n");
+  strbuf_fmt(&self->smaps, "VmFlags: rd%s%s mr mw me\n",
+             prot[1] == 'w' ? " wr" : "", prot[2] == 'x' ? " ex" : "");
+}
+
+/* ------------------------------------------------------------------------- *
+ * fakeproc_write  --  create /proc/pid directory for process
+ * ------------------------------------------------------------------------- */
+
+static void fakeproc_write(const fakeproc_t *self, int root)
+{
+  char     name[32];
+  int      dir;
+  strbuf_t buf = { 0, 0, 0 };
+  uint64_t rss = self->total[FLD_Rss];
+  uint64_t vsz = self->total[FLD_Size];
+
+  snprintf(name, sizeof name, "%d", self->pid);
+  if( mkdirat(root, name, 0755) == -1 && errno != EEXIST )
+  {
+    msg_fatal("%s/%s: %s\n", outdir, name, strerror(errno));
+  }
+  if( (dir = openat(root, name, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1 )
+  {
+    msg_fatal("%s/%s: %s\n", outdir, name, strerror(errno));
+  }
+
+  /* kernel threads have empty cmdline */
+  write_file(dir, "cmdline", self->cmdline,
+             self->kernel ? 0 : strlen(self->cmdline) + 1);
+
+  strbuf_fmt(&buf, "%s\n", self->comm);
+  write_file(dir, "comm", buf.data, buf.used);
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * status: replayed lines are kept as is,
+   * others derived from the mappings
+   * - - - - - - - - - - - - - - - - - - - */
+
+  buf.used = 0;
+  strbuf_fmt(&buf,
+             "Name:\t%s\n"
+             "Umask:\t0022\n"
+             "State:\tS (sleeping)\n"
+             "Tgid:\t%d\n"
+             "Pid:\t%d\n"
+             "PPid:\t%d\n"
+             "TracerPid:\t0\n"
+             "NSpid:\t%d\n",
+             self->comm, self->pid, self->pid, self->ppid, self->pid);
+
+  if( self->status.used )
+  {
+    strbuf_add(&buf, self->status.data, self->status.used);
+  }
+  else
+  {
+    strbuf_fmt(&buf,
+               "Uid:\t1000\t1000\t1000\t1000\n"
+               "Gid:\t1000\t1000\t1000\t1000\n"
+               "FDSize:\t64\n");
+    if( !self->kernel )
+    {
+      strbuf_fmt(&buf,
+                 "VmPeak:\t%8" PRIu64 " kB\n"
+                 "VmSize:\t%8" PRIu64 " kB\n"
+                 "VmLck:\t%8d kB\n"
+                 "VmHWM:\t%8" PRIu64 " kB\n"
+                 "VmRSS:\t%8" PRIu64 " kB\n"
+                 "RssAnon:\t%8" PRIu64 " kB\n"
+                 "RssFile:\t%8" PRIu64 " kB\n"
+                 "VmData:\t%8" PRIu64 " kB\n"
+                 "VmStk:\t%8" PRIu64 " kB\n"
+                 "VmExe:\t%8" PRIu64 " kB\n"
+                 "VmLib:\t%8" PRIu64 " kB\n"
+                 "VmPTE:\t%8" PRIu64 " kB\n"
+                 "VmSwap:\t%8" PRIu64 " kB\n",
+                 vsz + vsz / 8, vsz, 0, rss + rss / 8, rss,
+                 self->total[FLD_Anonymous],
+                 rss - self->total[FLD_Anonymous],
+                 vsz - self->vm_exe - self->vm_lib - self->vm_stk,
+                 self->vm_stk, self->vm_exe, self->vm_lib,
+                 4 + vsz / 512, self->total[FLD_Swap]);
+    }
+    strbuf_fmt(&buf, "Threads:\t%d\n", self->threads);
+  }
+  write_file(dir, "status", buf.data, buf.used);
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * stat: enough fields for start time,
+   * size and fault based change detection
+   * - - - - - - - - - - - - - - - - - - - */
+
+  buf.used = 0;
+  strbuf_fmt(&buf, "%d (%s) S %d %d %d 0 -1 4194560 %" PRIu64 " 0 %u 0 "
+             "%u %u 0 0 20 0 %d 0 %d %" PRIu64 " %" PRIu64
+             " 18446744073709551615",
+             self->pid, self->comm, self->ppid, self->pid, self->pid,
+             rss / 4 + 100, (unsigned)(rss / 1024), self->pid % 97,
+             self->pid % 13, self->threads, 100 + self->pid,
+             vsz * 1024, rss / 4);
+  for( int i = 26; i <= 52; ++i )
+  {
+    strbuf_fmt(&buf, " 0");
+  }
+  strbuf_fmt(&buf, "\n");
+  write_file(dir, "stat", buf.data, buf.used);
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * mappings
+   * - - - - - - - - - - - - - - - - - - - */
+
+  write_file(dir, "maps",  self->maps.data,  self->maps.used);
+  write_file(dir, "smaps", self->smaps.data, self->smaps.used);
+
+  buf.used = 0;
+  if( !self->kernel )
+  {
+    strbuf_fmt(&buf, "%08x-%08x ---p 00000000 00:00 0%*s[rollup]\n",
+               0x400000, 0xfffff000, 39, "");
+    for( int i = FLD_Rss; i < FLD_COUNT; ++i )
+    {
+      strbuf_value(&buf, fld_name[i], self->total[i]);
+    }
+  }
+  write_file(dir, "smaps_rollup", buf.data, buf.used);
+
+  strbuf_dtor(&buf);
+  close(dir);
+}
+
+/* ========================================================================= *
+ * Synthetic Processes
+ * ========================================================================= */
+
+#define LIB_POOL      64  // distinct shared libraries
+#define LIB_SEGMENTS  4   // mappings per library
+
+/* ------------------------------------------------------------------------- *
+ * synth_values  --  fill in smaps values for mapping of given size
+ * ------------------------------------------------------------------------- */
+
+static void synth_values(uint64_t *val, uint64_t size_kb, int anon,
+                         unsigned sharers)
+{
+  uint64_t rss = size_kb * rnd_below(101) / 100 / 4 * 4;
+
+  memset(val, 0, FLD_COUNT * sizeof *val);
+  val[FLD_Size]           = size_kb;
+  val[FLD_KernelPageSize] = 4;
+  val[FLD_MMUPageSize]    = 4;
+  val[FLD_Rss]            = rss;
+  val[FLD_Referenced]     = rss;
+
+  if( anon )
+  {
+    val[FLD_Pss]           = rss;
+    val[FLD_Private_Dirty] = rss;
+    val[FLD_Anonymous]     = rss;
+    if( rnd_below(8) == 0 )
+    {
+      val[FLD_Swap] = val[FLD_SwapPss] = (size_kb - rss) / 2 / 4 * 4;
+    }
+  }
+  else if( sharers > 1 )
+  {
+    val[FLD_Pss]          = rss / sharers;
+    val[FLD_Shared_Clean] = rss;
+  }
+  else
+  {
+    val[FLD_Pss]           = rss;
+    val[FLD_Private_Clean] = rss;
+  }
+}
+
+/* ------------------------------------------------------------------------- *
+ * synth_user  --  user process with executable, libraries, heap etc
+ * ------------------------------------------------------------------------- */
+
+static void synth_user(fakeproc_t *proc, int pid, int ppid, unsigned app)
+{
+  static const char * const lib_prot[LIB_SEGMENTS] =
+  {
+    "r--p", "r-xp", "r--p", "rw-p"
+  };
+
+  char     path[64];
+  uint64_t val[FLD_COUNT];
+  uint64_t addr;
+  uint64_t size;
+  unsigned count = mappings / 2 + rnd_below(mappings + 1);
+
+  proc->pid     = pid;
+  proc->ppid    = ppid;
+  proc->threads = 1 + (rnd_below(4) ? 0 : rnd_below(16));
+
+  snprintf(path, sizeof path, "/usr/bin/fakeapp%03u", app);
+  fakeproc_set_names(proc, path);
+
+  /* executable text, rodata & data */
+  addr = 0x555500000000ull + ((uint64_t)rnd_below(1 << 20) << 12);
+  for( int i = 0; i < 3; ++i )
+  {
+    size = 4 * (1 + rnd_below(i ? 32 : 256));
+    synth_values(val, size, i == 2, 1 + rnd_below(3));
+    fakeproc_add_vma(proc, addr, size, i == 0 ? "r-xp" : i == 1 ? "r--p" :
+                     "rw-p", 0, 0x0801, 100000 + app, path, val);
+    proc->vm_exe += i == 0 ? size : 0;
+    addr += size * 1024;
+  }
+
+  /* heap */
+  addr += (uint64_t)rnd_below(1 << 16) << 12;
+  size  = 4 * (16 + rnd_below(16384));
+  synth_values(val, size, 1, 1);
+  fakeproc_add_vma(proc, addr, size, "rw-p", 0, 0, 0, "[heap]", val);
+
+  /* libraries & anonymous mappings in the mmap area */
+  addr = 0x7f0000000000ull + ((uint64_t)rnd_below(1 << 24) << 12);
+  for( unsigned n = 6; n < count; )
+  {
+    if( rnd_below(10) < 7 && n + LIB_SEGMENTS <= count )
+    {
+      unsigned lib = rnd_below(LIB_POOL);
+      uint64_t offs = 0;
+
+      /* low numbered libraries are used by nearly everyone */
+      lib = lib * lib / LIB_POOL;
+      snprintf(path, sizeof path, "/usr/lib/libfake%02u.so.1", lib);
+      for( int i = 0; i < LIB_SEGMENTS; ++i )
+      {
+        size = 4 * (1 + rnd_below(i == 1 ? 512 : 64));
+        synth_values(val, size, i == 3, i == 3 ? 1 : 1 + rnd_below(50));
+        fakeproc_add_vma(proc, addr, size, lib_prot[i], offs, 0x0801,
+                         200000 + lib, path, val);
+        proc->vm_lib += lib_prot[i][2] == 'x' ? size : 0;
+        addr += size * 1024, offs += size * 1024;
+      }
+      n += LIB_SEGMENTS;
+    }
+    else
+    {
+      size = 4 * (1 + rnd_below(2048));
+      synth_values(val, size, 1, 1);
+      fakeproc_add_vma(proc, addr, size, "rw-p", 0, 0, 0, "", val);
+      addr += size * 1024;
+      n += 1;
+    }
+    addr += (uint64_t)rnd_below(16) << 12;
+  }
+
+  /* stack & kernel provided mappings */
+  addr = 0x7ffc00000000ull + ((uint64_t)rnd_below(1 << 20) << 12);
+  size = 132;
+  synth_values(val, size, 1, 1);
+  fakeproc_add_vma(proc, addr, size, "rw-p", 0, 0, 0, "[stack]", val);
+  proc->vm_stk = size;
+
+  addr += 0x200000;
+  synth_values(val, 16, 0, 1);
+  val[FLD_Rss] = val[FLD_Pss] = val[FLD_Private_Clean] = val[FLD_Referenced] = 0;
+  fakeproc_add_vma(proc, addr, 16, "r--p", 0, 0, 0, "[vvar]", val);
+
+  addr += 16 * 1024;
+  synth_values(val, 8, 0, 1);
+  fakeproc_add_vma(proc, addr, 8, "r-xp", 0, 0, 0, "[vdso]", val);
+}
+
+/* ------------------------------------------------------------------------- *
+ * synth_tree  --  write synthetic processes
+ * ------------------------------------------------------------------------- */
+
+static uint64_t synth_tree(int root)
+{
+  unsigned count = processes ? processes : 1000;
+  uint64_t pss   = 0;
+  int      pid   = 1;
+
+  rnd_state = seed * 0x9e3779b97f4a7c15ull + 1;
+
+  for( unsigned i = 0; i < count; ++i, ++pid )
+  {
+    fakeproc_t proc;
+
+    fakeproc_ctor(&proc);
+
+    if( pid == 2 || (pid > 2 && pid <= 2 + (int)kthreads) )
+    {
+      char name[32];
+
+      if( pid == 2 )
+      {
+        snprintf(name, sizeof name, "kthreadd");
+      }
+      else
+      {
+        snprintf(name, sizeof name, "kworker/%d:%d", pid % 8, pid / 8);
+      }
+      proc.pid     = pid;
+      proc.ppid    = (pid == 2) ? 0 : 2;
+      proc.threads = 1;
+      proc.kernel  = 1;
+      fakeproc_set_names(&proc, name);
+    }
+    else
+    {
+      /* mostly children of init, some of earlier user processes */
+      int ppid = (pid == 1) ? 0 : 1;
+
+      if( pid > 3 + (int)kthreads && rnd_below(4) == 0 )
+      {
+        ppid = 3 + kthreads + rnd_below(pid - 3 - kthreads);
+      }
+      synth_user(&proc, pid, ppid, pid == 1 ? 0 : 1 + rnd_below(500));
+      if( pid == 1 )
+      {
+        fakeproc_set_names(&proc, "/sbin/init");
+      }
+    }
+
+    fakeproc_write(&proc, root);
+    pss += proc.total[FLD_Pss];
+    fakeproc_dtor(&proc);
+  }
+  return pss;
+}
+
+/* ========================================================================= *
+ * Replayed Processes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * replay_is_mapping  --  check for "hhhh-hhhh perm ..." smaps header line
+ * ------------------------------------------------------------------------- */
+
+static int replay_is_mapping(const char *line)
+{
+  const char *pos = line;
+
+  while( isxdigit((unsigned char)*pos) ) ++pos;
+  return pos != line && *pos == '-';
+}
+
+/* ------------------------------------------------------------------------- *
+ * replay_load  --  read processes from text capture
+ * ------------------------------------------------------------------------- */
+
+static fakeproc_t *replay_load(const char *path, size_t *pcount,
+                               strbuf_t *meminfo)
+{
+  FILE       *file  = fopen(path, "r");
+  char       *line  = 0;
+  size_t      size  = 0;
+  fakeproc_t *procs = 0;
+  size_t      count = 0;
+  size_t      alloc = 0;
+  fakeproc_t *proc  = 0;
+  ssize_t     len;
+
+  if( file == 0 )
+  {
+    msg_fatal("%s: %s\n", path, strerror(errno));
+  }
+
+  while( (len = getline(&line, &size, file)) != -1 )
+  {
+    int pid;
+
+    if( sscanf(line, "==> /proc/%d/", &pid) == 1 )
+    {
+      if( count == alloc )
+      {
+        alloc = alloc ? alloc * 2 : 256;
+        if( (procs = realloc(procs, alloc * sizeof *procs)) == 0 )
+        {
+          msg_fatal("%s: %s\n", path, strerror(errno));
+        }
+      }
+      proc = &procs[count++];
+      fakeproc_ctor(proc);
+      proc->pid     = pid;
+      proc->threads = 1;
+      proc->kernel  = 1;
+      fakeproc_set_names(proc, "unknown");
+      continue;
+    }
+
+    if( !strncmp(line, "##meminfo: ", 11) )
+    {
+      strbuf_add(meminfo, line + 11, len - 11);
+      continue;
+    }
+
+    if( proc == 0 || *line == '\n' || (*line == '#' && line[1] == '#') )
+    {
+      continue;
+    }
+
+    if( *line == '#' )
+    {
+      char *key = line + 1;
+      char *val = strchr(key, ':');
+
+      if( val == 0 )
+      {
+        continue;
+      }
+      *val++ = 0;
+      val += strspn(val, " \t");
+      val[strcspn(val, "\n")] = 0;
+
+      if( !strcmp(key, "Name") )
+      {
+        fakeproc_set_names(proc, val);
+      }
+      else if( !strcmp(key, "PPid") )
+      {
+        proc->ppid = atoi(val);
+      }
+      else if( !strcmp(key, "Threads") )
+      {
+        proc->threads = atoi(val);
+      }
+      else if( !strcmp(key, "Unchanged") )
+      {
+        /* refers to another capture, nothing to replay */
+        fakeproc_dtor(proc);
+        proc = 0, --count;
+        continue;
+      }
+      if( strcmp(key, "Name") && strcmp(key, "Pid") && strcmp(key, "PPid") &&
+          strcmp(key, "Tgid") && strcmp(key, "NSpid") &&
+          strcmp(key, "Time") && strcmp(key, "Brief") )
+      {
+        strbuf_fmt(&proc->status, "%s:\t%s\n", key, val);
+      }
+      if( !strncmp(key, "Vm", 2) )
+      {
+        proc->kernel = 0;
+      }
+      continue;
+    }
+
+    strbuf_add(&proc->smaps, line, len);
+    if( replay_is_mapping(line) )
+    {
+      strbuf_add(&proc->maps, line, len);
+      proc->kernel = 0;
+    }
+    else
+    {
+      char     key[64];
+      uint64_t val;
+
+      if( sscanf(line, "%63[^:]: %" SCNu64, key, &val) == 2 )
+      {
+        for( int i = 0; i < FLD_COUNT; ++i )
+        {
+          if( !strcmp(key, fld_name[i]) )
+          {
+            proc->total[i] += val;
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  free(line);
+  fclose(file);
+
+  /* kernel threads are recognized only after their status values */
+  for( size_t i = 0; i < count; ++i )
+  {
+    char *name = procs[i].cmdline;
+
+    procs[i].cmdline = 0;
+    fakeproc_set_names(&procs[i], name);
+    free(name);
+  }
+
+  if( count == 0 )
+  {
+    msg_fatal("%s: no processes found\n", path);
+  }
+  *pcount = count;
+  return procs;
+}
+
+/* ------------------------------------------------------------------------- *
+ * replay_tree  --  write replayed processes, repeating if needed
+ * ------------------------------------------------------------------------- */
+
+static uint64_t replay_tree(int root, strbuf_t *meminfo)
+{
+  size_t      count = 0;
+  fakeproc_t *procs = replay_load(replay, &count, meminfo);
+  unsigned    total = processes ? processes : count;
+  uint64_t    pss   = 0;
+  int         next  = 0;
+
+  for( size_t i = 0; i < count; ++i )
+  {
+    if( next <= procs[i].pid ) next = procs[i].pid + 1;
+  }
+
+  for( unsigned i = 0; i < total; ++i )
+  {
+    fakeproc_t *proc = &procs[i % count];
+    int         pid  = proc->pid;
+
+    /* copies get fresh pids after the captured ones */
+    if( i >= count )
+    {
+      proc->pid = next++;
+    }
+    fakeproc_write(proc, root);
+    pss += proc->total[FLD_Pss];
+    proc->pid = pid;
+  }
+
+  for( size_t i = 0; i < count; ++i )
+  {
+    fakeproc_dtor(&procs[i]);
+  }
+  free(procs);
+  return pss;
+}
+
+/* ========================================================================= *
+ * Main Entry Point
+ * ========================================================================= */
+
+int main(int ac, char **av)
+{
+  argvec_t *args    = argvec_create(ac, av, app_opt, app_man);
+  strbuf_t  meminfo = { 0, 0, 0 };
+  uint64_t  pss     = 0;
+  int       root    = -1;
+
+  while( !argvec_done(args) )
+  {
+    int       tag  = 0;
+    char     *par  = 0;
+
+    if( !argvec_next(args, &tag, &par) )
+    {
+      msg_error("(use --help for usage)\n");
+      exit(1);
+    }
+
+    switch( tag )
+    {
+    case opt_help:
+      argvec_usage(args);
+      exit(EXIT_SUCCESS);
+
+    case opt_vers:
+      printf("%s\n", TOOL_VERS);
+      exit(EXIT_SUCCESS);
+
+    case opt_verbose:
+      msg_incverbosity();
+      break;
+    case opt_quiet:
+      msg_decverbosity();
+      break;
+    case opt_silent:
+      msg_setsilent();
+      break;
+
+    case opt_output:
+      outdir = par;
+      break;
+    case opt_processes:
+      processes = strtoul(par, 0, 0);
+      break;
+    case opt_mappings:
+      mappings = strtoul(par, 0, 0);
+      break;
+    case opt_kthreads:
+      kthreads = strtoul(par, 0, 0);
+      break;
+    case opt_seed:
+      seed = strtoull(par, 0, 0);
+      break;
+    case opt_replay:
+      replay = par;
+      break;
+    }
+  }
+
+  argvec_delete(args);
+
+  if( outdir == 0 )
+  {
+    msg_fatal("output directory must be specified\n");
+  }
+  if( mkdir(outdir, 0755) == -1 && errno != EEXIST )
+  {
+    msg_fatal("%s: %s\n", outdir, strerror(errno));
+  }
+  if( (root = open(outdir, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1 )
+  {
+    msg_fatal("%s: %s\n", outdir, strerror(errno));
+  }
+
+  pss = replay ? replay_tree(root, &meminfo) : synth_tree(root);
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * system wide files
+   * - - - - - - - - - - - - - - - - - - - */
+
+  if( meminfo.used == 0 )
+  {
+    uint64_t total = 4 << 20;
+
+    while( total < pss * 2 ) total *= 2;
+    strbuf_fmt(&meminfo,
+               "MemTotal:       %8" PRIu64 " kB\n"
+               "MemFree:        %8" PRIu64 " kB\n"
+               "Buffers:        %8" PRIu64 " kB\n"
+               "Cached:         %8" PRIu64 " kB\n"
+               "Mapped:         %8" PRIu64 " kB\n"
+               "Shmem:          %8" PRIu64 " kB\n"
+               "Slab:           %8" PRIu64 " kB\n"
+               "SReclaimable:   %8" PRIu64 " kB\n"
+               "SUnreclaim:     %8" PRIu64 " kB\n"
+               "KernelStack:    %8" PRIu64 " kB\n",
+               total, total - pss - total / 8, total / 64, total / 16,
+               total / 32, total / 128, total / 64, total / 128,
+               total / 128, (uint64_t)16 * (processes ? processes : 1000));
+  }
+  write_file(root, "meminfo", meminfo.data, meminfo.used);
+  strbuf_dtor(&meminfo);
+
+  unlinkat(root, "self", 0);
+  if( symlinkat("1", root, "self") == -1 )
+  {
+    msg_warning("%s/self: %s\n", outdir, strerror(errno));
+  }
+
+  close(root);
+
+  msg_progress("%s: total Pss %" PRIu64 " kB\n", outdir, pss);
+  return EXIT_SUCCESS;
+}
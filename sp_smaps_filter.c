@@ -55,10 +55,18 @@
 #include <assert.h>
 #include <math.h>
 #include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
+
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+# include <zstd.h>
+#endif
 
 #include <libsysperf/csv_table.h>
 #include <libsysperf/array.h>
@@ -68,6 +76,7 @@
 #include <libsysperf/str_array.h>
 
 #include "symtab.h"
+#include "smapsbin.h"
 
 #if 0
 # define INLINE static inline
@@ -123,6 +132,12 @@ static const manual_t app_man[]=
           "  thread removal and comparison of memory usage values\n"
           "  input  - capture files\n"
           "  output - csv or html file\n"
+          "\n"
+          "Capture files can be either in text or in binary format\n"
+          "(sp_smaps_snapshot --format binary), the format is detected\n"
+          "automatically. Output capture files are always written as text.\n"
+          "Captures compressed with gzip (or zstd, if support for it\n"
+          "was enabled at build time) are decompressed on the fly.\n"
           )
   MAN_ADD("OPTIONS", 0)
 
@@ -633,6 +648,21 @@ typedef struct meminfo_t meminfo_t; // Size,RSS,Shared_Clean, ...
  * meminfo_t
  * ------------------------------------------------------------------------- */
 
+/* smaps values held in meminfo_t */
+#define MEMINFO_FIELDS(X) \
+  X(Size) X(Rss) X(Shared_Clean) X(Shared_Dirty) X(Private_Clean) \
+  X(Private_Dirty) X(Pss) X(Swap) X(Referenced) X(Anonymous) X(Locked) \
+  X(Uss) X(Vmas)
+
+enum
+{
+#define X(v) MEMINFO_BIT_##v,
+  MEMINFO_FIELDS(X)
+#undef X
+};
+
+#define MEMINFO_HAS(v) (1u << MEMINFO_BIT_##v)
+
 struct meminfo_t
 {
   unsigned Size;
@@ -646,6 +676,11 @@ struct meminfo_t
   unsigned Referenced;
   unsigned Anonymous;
   unsigned Locked;
+  unsigned Uss;        // deep captures only: pages not mapped elsewhere
+  unsigned Vmas;       // folded captures only: mappings summed into this
+
+  unsigned present;    // MEMINFO_HAS() bits of values seen in capture,
+                       // captures made with --fields lack some of them
 };
 
 void       meminfo_ctor              (meminfo_t *self);
@@ -703,6 +738,9 @@ struct pidinfo_t
   char    *Name;
   int      Pid;
   int      PPid;
+  int      Tgid;    // zero if not captured
+  int      NSpid;   // pid in innermost pid namespace, zero if not captured
+  int      Brief;   // hybrid capture: mappings without smaps values
   int      Threads;
   unsigned VmPeak;
   unsigned VmSize;
@@ -776,6 +814,20 @@ struct smapsproc_t
 
   smapsproc_t *smapsproc_parent;
   array_t      smapsproc_children; // -> smapsproc_t *
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * incremental captures: process data is
+   * to be taken from the base capture
+   * - - - - - - - - - - - - - - - - - - - */
+
+  int          smapsproc_unchanged;
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * CLOCK_MONOTONIC seconds when the data
+   * was read, zero if not known
+   * - - - - - - - - - - - - - - - - - - - */
+
+  double       smapsproc_time;
 };
 
 void         smapsproc_ctor     (smapsproc_t *self);
@@ -795,6 +847,7 @@ struct smapssnap_t
   int         smapssnap_format;
   array_t     smapssnap_proclist; // -> smapsproc_t *
   smapsproc_t smapssnap_rootproc;
+  str_array_t smapssnap_info;     // "##Key: value" capture header lines
 };
 
 enum {
@@ -809,6 +862,8 @@ smapssnap_t *smapssnap_create   (void);
 void         smapssnap_delete   (smapssnap_t *self);
 void         smapssnap_delete_cb(void *self);
 
+int          smapssnap_load_cap (smapssnap_t *self, const char *path);
+
 /* ------------------------------------------------------------------------- *
  * analyze_t  --  temporary book keeping structure for smaps snapshot analysis
  * ------------------------------------------------------------------------- */
@@ -846,6 +901,8 @@ struct analyze_t
   meminfo_t *sysest;  // [ntypes]
   meminfo_t *sysmax;  // [ntypes]
   meminfo_t *appmax;  // [ntypes]
+
+  unsigned   present; // MEMINFO_HAS() bits of values seen in capture
 };
 
 void       analyze_ctor                  (analyze_t *self);
@@ -927,52 +984,22 @@ meminfo_parse(meminfo_t *self, char *line)
   char *key = slice(&line, ':');
   char *val = slice(&line,  -1);
 
-  if( !strcmp(key, "Size") )
-  {
-    self->Size  = strtoul(val, 0, 10);
-  }
-  else if( !strcmp(key, "Rss") )
-  {
-    self->Rss   = strtoul(val, 0, 10);
-  }
-  else if( !strcmp(key, "Shared_Clean") )
-  {
-    self->Shared_Clean  = strtoul(val, 0, 10);
-  }
-  else if( !strcmp(key, "Shared_Dirty") )
-  {
-    self->Shared_Dirty  = strtoul(val, 0, 10);
-  }
-  else if( !strcmp(key, "Private_Clean") )
-  {
-    self->Private_Clean = strtoul(val, 0, 10);
-  }
-  else if( !strcmp(key, "Private_Dirty") )
-  {
-    self->Private_Dirty = strtoul(val, 0, 10);
-  }
-  else if( !strcmp(key, "Pss") )
-  {
-    self->Pss   = strtoul(val, 0, 10);
-  }
-  else if( !strcmp(key, "Swap") )
-  {
-    self->Swap   = strtoul(val, 0, 10);
+#define X(v)\
+  if( !strcmp(key, #v) )\
+  {\
+    self->v = strtoul(val, 0, 10);\
+    self->present |= MEMINFO_HAS(v);\
+    return;\
   }
-  else if( !strcmp(key, "Referenced") )
-  {
-    self->Referenced   = strtoul(val, 0, 10);
-  }
-  else if( !strcmp(key, "Anonymous") )
-  {
-    self->Anonymous = strtoul(val, 0, 10);
-  }
-  else if( !strcmp(key, "Locked") )
-  {
-    self->Locked = strtoul(val, 0, 10);
-  }
-  else if( !strcmp(key, "KernelPageSize")
+  MEMINFO_FIELDS(X)
+#undef X
+
+  if( !strcmp(key, "KernelPageSize")
         || !strcmp(key, "MMUPageSize")
+        || !strcmp(key, "Pss_Anon")
+        || !strcmp(key, "Pss_File")
+        || !strcmp(key, "Pss_Shmem")
+        || !strcmp(key, "Pss_Dirty")
       )
   {
   }
@@ -1000,6 +1027,7 @@ meminfo_all_zeroes(const meminfo_t *self)
     && self->Referenced == 0
     && self->Anonymous == 0
     && self->Locked == 0
+    && self->Uss == 0
     ;
 }
 
@@ -1021,6 +1049,9 @@ meminfo_accumulate_appdata(meminfo_t *self, const meminfo_t *that)
   pusum(&self->Referenced,    that->Referenced);
   pusum(&self->Anonymous,     that->Anonymous);
   pusum(&self->Locked,        that->Locked);
+  pusum(&self->Uss,           that->Uss);
+  pusum(&self->Vmas,          that->Vmas);
+  self->present |= that->present;
 }
 
 /* ------------------------------------------------------------------------- *
@@ -1041,6 +1072,9 @@ meminfo_accumulate_libdata(meminfo_t *self, const meminfo_t *that)
   pumax(&self->Referenced,    that->Referenced);
   pusum(&self->Anonymous,     that->Anonymous);
   pusum(&self->Locked,        that->Locked);
+  pusum(&self->Uss,           that->Uss);
+  pusum(&self->Vmas,          that->Vmas);
+  self->present |= that->present;
 }
 
 /* ------------------------------------------------------------------------- *
@@ -1061,6 +1095,9 @@ meminfo_accumulate_maxdata(meminfo_t *self, const meminfo_t *that)
   pumax(&self->Referenced,    that->Referenced);
   pumax(&self->Anonymous,     that->Anonymous);
   pumax(&self->Locked,        that->Locked);
+  pumax(&self->Uss,           that->Uss);
+  pumax(&self->Vmas,          that->Vmas);
+  self->present |= that->present;
 }
 
 /* ------------------------------------------------------------------------- *
@@ -1217,6 +1254,20 @@ pidinfo_parse(pidinfo_t *self, char *line)
   {
     self->PPid  = strtol(val, 0, 10);
   }
+  else if( !strcmp(key, "Tgid") )
+  {
+    self->Tgid  = strtol(val, 0, 10);
+  }
+  else if( !strcmp(key, "NSpid") )
+  {
+    // NSpid: 4321 1 -> outermost ... innermost
+    for( char *tok; *(tok = slice(&line, -1)); val = tok ) { }
+    self->NSpid = strtol(val, 0, 10);
+  }
+  else if( !strcmp(key, "Brief") )
+  {
+    self->Brief = strtol(val, 0, 10);
+  }
   else if( !strcmp(key, "Threads") )
   {
     self->Threads       = strtol(val, 0, 10);
@@ -1262,7 +1313,6 @@ pidinfo_parse(pidinfo_t *self, char *line)
     self->VmPTE = strtoul(val, 0, 10);
   }
   else if( !strcmp(key, "State")
-        || !strcmp(key, "Tgid")
         || !strcmp(key, "TracerPid")
         || !strcmp(key, "Uid")
         || !strcmp(key, "Gid")
@@ -1422,6 +1472,9 @@ smapsproc_ctor(smapsproc_t *self)
 
   self->smapsproc_parent = 0;
   array_ctor(&self->smapsproc_children, 0);
+
+  self->smapsproc_unchanged = 0;
+  self->smapsproc_time = 0;
 }
 
 /* ------------------------------------------------------------------------- *
@@ -1436,33 +1489,6 @@ smapsproc_dtor(smapsproc_t *self)
   array_dtor(&self->smapsproc_children);
 }
 
-/* ------------------------------------------------------------------------- *
- * smapsproc_are_same
- * ------------------------------------------------------------------------- */
-
-int
-smapsproc_are_same(smapsproc_t *self, smapsproc_t *that)
-{
-  if( strcmp(self->smapsproc_pid.Name, that->smapsproc_pid.Name) ) return 0;
-
-#if 01
-# define cp(v) if( self->smapsproc_pid.v != that->smapsproc_pid.v ) return 0;
-  cp(VmPeak)
-  cp(VmSize)
-  cp(VmLck)
-  cp(VmHWM)
-  cp(VmRSS)
-  cp(VmData)
-  cp(VmStk)
-  cp(VmExe)
-  cp(VmLib)
-  cp(VmPTE)
-# undef cp
-#endif
-
-  return 1;
-}
-
 /* ------------------------------------------------------------------------- *
  * smapsproc_adopt_children
  * ------------------------------------------------------------------------- */
@@ -1489,52 +1515,22 @@ smapsproc_adopt_children(smapsproc_t *self, smapsproc_t *that)
 }
 
 /* ------------------------------------------------------------------------- *
- * smapsproc_collapse_threads
+ * smapsproc_drop_orphans  --  forget children that have been detached
  * ------------------------------------------------------------------------- */
 
-void
-smapsproc_collapse_threads(smapsproc_t *self)
+static void
+smapsproc_drop_orphans(smapsproc_t *self)
 {
-  /* - - - - - - - - - - - - - - - - - - - *
-   * recurse depth first
-   * - - - - - - - - - - - - - - - - - - - */
-
-  for( int i = 0; i < self->smapsproc_children.size; ++i )
-  {
-    smapsproc_t *that = self->smapsproc_children.data[i];
-    smapsproc_collapse_threads(that);
-  }
-
-  /* - - - - - - - - - - - - - - - - - - - *
-   * heuristic: children that are similar
-   * enough to parent are actually threads
-   * - - - - - - - - - - - - - - - - - - - */
-
   for( int i = 0; i < self->smapsproc_children.size; ++i )
   {
     smapsproc_t *that = self->smapsproc_children.data[i];
 
-    if( smapsproc_are_same(self, that) )
+    if( that->smapsproc_parent != self )
     {
-      fprintf(stderr, "REPARENT: %d\n", that->smapsproc_pid.Pid);
-
-      /* - - - - - - - - - - - - - - - - - - - *
-       * adopt grandchildren
-       * - - - - - - - - - - - - - - - - - - - */
-
-      smapsproc_adopt_children(self, that);
-
-      /* - - - - - - - - - - - - - - - - - - - *
-       * disassosiate parent & child
-       * - - - - - - - - - - - - - - - - - - - */
-
       self->smapsproc_children.data[i] = 0;
-      self->smapsproc_pid.Threads += that->smapsproc_pid.Threads;
-      that->smapsproc_parent = 0;
     }
   }
   array_compact(&self->smapsproc_children);
-
 }
 
 /* ------------------------------------------------------------------------- *
@@ -1659,6 +1655,7 @@ smapssnap_ctor(smapssnap_t *self)
 
   array_ctor(&self->smapssnap_proclist, smapsproc_delete_cb);
   smapsproc_ctor(&self->smapssnap_rootproc);
+  str_array_ctor(&self->smapssnap_info);
 }
 
 /* ------------------------------------------------------------------------- *
@@ -1671,6 +1668,7 @@ smapssnap_dtor(smapssnap_t *self)
   free(self->smapssnap_source);
   array_dtor(&self->smapssnap_proclist);
   smapsproc_dtor(&self->smapssnap_rootproc);
+  str_array_dtor(&self->smapssnap_info);
 }
 
 /* ------------------------------------------------------------------------- *
@@ -1693,121 +1691,805 @@ smapssnap_set_source(smapssnap_t *self, const char *path)
   xstrset(&self->smapssnap_source, path);
 }
 
+/* ------------------------------------------------------------------------- *
+ * smapssnap_get_info  --  lookup capture header value, or NULL
+ * ------------------------------------------------------------------------- */
+
+const char *
+smapssnap_get_info(const smapssnap_t *self, const char *key)
+{
+  size_t len = strlen(key);
+
+  for( size_t i = 0; i < self->smapssnap_info.size; ++i )
+  {
+    const char *row = self->smapssnap_info.data[i];
+    if( !strncmp(row, key, len) && row[len] == ':' )
+    {
+      row += len + 1;
+      while( *row == ' ' ) ++row;
+      return row;
+    }
+  }
+  return 0;
+}
+
+/* ------------------------------------------------------------------------- *
+ * smapssnap_get_sysval  --  lookup value from system statistics header
+ *
+ * The snapshot tool copies e.g. /proc/meminfo to capture header
+ * as "##meminfo: MemTotal: 1021476 kB" lines. Returns the number
+ * following the name, or -1 if the capture does not have it.
+ * ------------------------------------------------------------------------- */
+
+long long
+smapssnap_get_sysval(const smapssnap_t *self, const char *file,
+                     const char *name)
+{
+  size_t flen = strlen(file);
+  size_t nlen = strlen(name);
+
+  for( size_t i = 0; i < self->smapssnap_info.size; ++i )
+  {
+    const char *row = self->smapssnap_info.data[i];
+
+    if( strncmp(row, file, flen) || strncmp(row + flen, ": ", 2) )
+    {
+      continue;
+    }
+    row += flen + 2;
+
+    if( strncmp(row, name, nlen) || (row[nlen] != ':' && row[nlen] != ' ') )
+    {
+      continue;
+    }
+    return strtoll(row + nlen + 1, 0, 10);
+  }
+  return -1;
+}
+
 /* ------------------------------------------------------------------------- *
  * smapssnap_create_hierarchy
  * ------------------------------------------------------------------------- */
 
 /* - - - - - - - - - - - - - - - - - - - *
- * binsearch utility function
+ * binsearch utility function
+ * - - - - - - - - - - - - - - - - - - - */
+
+static smapsproc_t *
+proc_find(smapssnap_t *self, int pid)
+{
+  int lo = 0, hi = self->smapssnap_proclist.size;
+  while( lo < hi )
+  {
+    int i = (lo + hi) / 2;
+    smapsproc_t *p = self->smapssnap_proclist.data[i];
+
+    if( p->smapsproc_pid.Pid > pid ) { hi = i+0; continue; }
+    if( p->smapsproc_pid.Pid < pid ) { lo = i+1; continue; }
+    return p;
+  }
+  return 0;
+}
+
+void
+smapssnap_create_hierarchy(smapssnap_t *self)
+{
+  /* - - - - - - - - - - - - - - - - - - - *
+   * sort processes by PID
+   * - - - - - - - - - - - - - - - - - - - */
+
+  array_sort(&self->smapssnap_proclist, smapsproc_compare_pid_cb);
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * find parent for every process
+   * - - - - - - - - - - - - - - - - - - - */
+
+  for( size_t i = 0; i < self->smapssnap_proclist.size; ++i )
+  {
+    smapsproc_t *cur = self->smapssnap_proclist.data[i];
+    smapsproc_t *par = proc_find(self, cur->smapsproc_pid.PPid);
+
+    assert( cur->smapsproc_parent == 0 );
+
+    if( par == 0 || par == cur )
+    {
+      if( cur->smapsproc_pid.PPid != 0 )
+      {
+        fprintf(stderr, "PPID %d not found\n", cur->smapsproc_pid.PPid);
+      }
+      par = &self->smapssnap_rootproc;
+    }
+
+    cur->smapsproc_parent = par;
+    array_add(&par->smapsproc_children, cur);
+  }
+}
+
+/* ------------------------------------------------------------------------- *
+ * smapssnap_collapse_threads
+ * ------------------------------------------------------------------------- */
+
+void
+smapssnap_collapse_threads(smapssnap_t *self)
+{
+  /* - - - - - - - - - - - - - - - - - - - *
+   * processes whose Tgid differs from Pid
+   * are threads of the Tgid process: move
+   * their children to the thread group
+   * leader and detach them
+   *
+   * Note: create_hierarchy() has sorted
+   *       the process list by pid
+   * - - - - - - - - - - - - - - - - - - - */
+
+  for( size_t i = 0; i < self->smapssnap_proclist.size; ++i )
+  {
+    smapsproc_t *cur = self->smapssnap_proclist.data[i];
+    smapsproc_t *ldr;
+    int          tgid = cur->smapsproc_pid.Tgid;
+
+    if( tgid == 0 || tgid == cur->smapsproc_pid.Pid )
+    {
+      continue;
+    }
+
+    if( (ldr = proc_find(self, tgid)) == 0 )
+    {
+      fprintf(stderr, "TGID %d not found\n", tgid);
+      continue;
+    }
+
+    smapsproc_adopt_children(ldr, cur);
+    cur->smapsproc_parent = 0;
+  }
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * drop detached threads from children
+   * - - - - - - - - - - - - - - - - - - - */
+
+  smapsproc_drop_orphans(&self->smapssnap_rootproc);
+
+  for( size_t i = 0; i < self->smapssnap_proclist.size; ++i )
+  {
+    smapsproc_drop_orphans(self->smapssnap_proclist.data[i]);
+  }
+
+  for( size_t i = 0; i < self->smapssnap_proclist.size; ++i )
+  {
+    smapsproc_t *cur = self->smapssnap_proclist.data[i];
+
+    if( cur->smapsproc_parent == 0 )
+    {
+      self->smapssnap_proclist.data[i] = 0;
+      smapsproc_delete(cur);
+    }
+  }
+  array_compact(&self->smapssnap_proclist);
+}
+
+/* ------------------------------------------------------------------------- *
+ * smapssnap_add_process
+ * ------------------------------------------------------------------------- */
+
+smapsproc_t *
+smapssnap_add_process(smapssnap_t *self, int pid)
+{
+  smapsproc_t *proc;
+
+  for( int i = self->smapssnap_proclist.size; i-- > 0; )
+  {
+    proc = self->smapssnap_proclist.data[i];
+    if( proc->smapsproc_pid.Pid == pid )
+    {
+      return proc;
+    }
+  }
+  proc = smapsproc_create();
+  proc->smapsproc_pid.Pid = pid;
+  array_add(&self->smapssnap_proclist, proc);
+  return proc;
+}
+
+/* ------------------------------------------------------------------------- *
+ * smapssnap_load_cap
+ * ------------------------------------------------------------------------- */
+
+static int
+hexterm(const char *s)
+{
+  while( isxdigit(*s) )
+  {
+    ++s;
+  }
+  return *s;
+}
+
+/* - - - - - - - - - - - - - - - - - - - *
+ * binary capture field name -> member
+ * - - - - - - - - - - - - - - - - - - - */
+
+typedef struct
+{
+  const char *name;
+  size_t      offs;
+} binfield_t;
+
+static const binfield_t pidinfo_binfields[] =
+{
+#define X(v) { #v, offsetof(pidinfo_t, v) },
+  X(Pid) X(PPid) X(Tgid) X(NSpid) X(Threads) X(VmPeak) X(VmSize) X(VmLck) X(VmHWM)
+  X(VmRSS) X(VmData) X(VmStk) X(VmExe) X(VmLib) X(VmPTE) X(Brief)
+#undef X
+  { 0, 0 }
+};
+
+/* same order as MEMINFO_BIT_xxx, see binfield_index() */
+static const binfield_t meminfo_binfields[] =
+{
+#define X(v) { #v, offsetof(meminfo_t, v) },
+  MEMINFO_FIELDS(X)
+#undef X
+  { 0, 0 }
+};
+
+static int
+binfield_index(const binfield_t *tab, const char *name)
+{
+  for( int i = 0; tab[i].name; ++i )
+  {
+    if( !strcmp(tab[i].name, name) ) return i;
+  }
+  return -1;
+}
+
+static int
+binfield_lookup(const binfield_t *tab, const char *name)
+{
+  int i = binfield_index(tab, name);
+  return (i < 0) ? -1 : (int)tab[i].offs;
+}
+
+static int
+smapssnap_load_bin(smapssnap_t *self, const char *path, FILE *file)
+{
+  int            error = -1;
+  unsigned char *data  = 0;
+  size_t         size  = 0;
+  size_t         used  = 0;
+  char         **strs  = 0;  // string table, id -> text
+  size_t         nstrs = 0;
+  int           *offs[2] = { 0, 0 }; // field set -> member offsets
+  size_t         nfld[2] = { 0, 0 };
+  uint64_t      *prev  = 0;  // previous mapping values
+  uint64_t       tail  = 0;  // previous mapping end address
+  uint64_t       mask  = 0;  // mapping fields present in process
+  unsigned      *bits  = 0;  // mapping field set -> MEMINFO_HAS() bits
+  smapsproc_t   *proc  = 0;
+  double         time  = 0;  // from 'T' record for next process
+
+  const unsigned char *pos, *end;
+  uint64_t             val;
+
+#define GET(v) if( smapsbin_get_varint(&pos, end, &(v)) ) goto truncated
+#define STR(id) (((id) && (id) < nstrs && strs[id]) ? strs[id] : "")
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * slurp in the whole file
+   * - - - - - - - - - - - - - - - - - - - */
+
+  for( ;; )
+  {
+    if( size - used < 0x10000 )
+    {
+      if( (data = realloc(data, size += 0x10000)) == 0 )
+      {
+        perror(path); goto cleanup;
+      }
+    }
+    size_t n = fread(data + used, 1, size - used, file);
+    if( n == 0 ) break;
+    used += n;
+  }
+  if( ferror(file) )
+  {
+    perror(path); goto cleanup;
+  }
+
+  pos = data, end = data + used;
+
+  if( used < SMAPSBIN_MAGIC_SIZE ||
+      memcmp(data, SMAPSBIN_MAGIC, SMAPSBIN_MAGIC_SIZE) )
+  {
+    fprintf(stderr, "%s: not a binary capture\n", path);
+    goto cleanup;
+  }
+  pos += SMAPSBIN_MAGIC_SIZE;
+
+  GET(val);
+  if( val < 1 || val > SMAPSBIN_VERSION )
+  {
+    fprintf(stderr, "%s: unsupported binary capture version %u\n",
+            path, (unsigned)val);
+    goto cleanup;
+  }
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * decode records
+   * - - - - - - - - - - - - - - - - - - - */
+
+  while( pos < end )
+  {
+    int type = *pos++;
+
+    if( type == SMAPSBIN_END )
+    {
+      break;
+    }
+
+    switch( type )
+    {
+    case SMAPSBIN_STRING:
+      {
+        uint64_t id, len;
+        const char *str;
+
+        GET(id); GET(len);
+        if( (str = smapsbin_get_bytes(&pos, end, len)) == 0 )
+        {
+          goto truncated;
+        }
+        /* ids are handed out sequentially within a capture, each
+         * definition taking at least two bytes -> a valid id is below
+         * the number of bytes read */
+        if( id > used )
+        {
+          goto corrupted;
+        }
+        if( id >= nstrs )
+        {
+          size_t n = nstrs ? nstrs : 256;
+          char **tmp;
+
+          while( n <= id ) n *= 2;
+          if( (tmp = realloc(strs, n * sizeof *strs)) == 0 )
+          {
+            fprintf(stderr, "%s: string table: %s\n", path, strerror(errno));
+            goto cleanup;
+          }
+          strs = tmp;
+          memset(strs + nstrs, 0, (n - nstrs) * sizeof *strs);
+          nstrs = n;
+        }
+        free(strs[id]);
+        strs[id] = strndup(str, len);
+      }
+      break;
+
+    case SMAPSBIN_FIELDS:
+      {
+        uint64_t set, cnt, id;
+
+        GET(set); GET(cnt);
+        if( set > SMAPSBIN_FIELDS_MAPPING || cnt > 64 )
+        {
+          goto corrupted;
+        }
+        free(offs[set]);
+        offs[set] = calloc(cnt, sizeof *offs[set]);
+        nfld[set] = cnt;
+        if( set == SMAPSBIN_FIELDS_MAPPING )
+        {
+          free(prev);
+          prev = calloc(cnt, sizeof *prev);
+          free(bits);
+          bits = calloc(cnt, sizeof *bits);
+        }
+        for( size_t i = 0; i < cnt; ++i )
+        {
+          GET(id);
+          if( set == SMAPSBIN_FIELDS_STATUS )
+          {
+            offs[set][i] = binfield_lookup(pidinfo_binfields, STR(id));
+          }
+          else
+          {
+            int k = binfield_index(meminfo_binfields, STR(id));
+            offs[set][i] = (k < 0) ? -1 : (int)meminfo_binfields[k].offs;
+            bits[i]      = (k < 0) ?  0 : (1u << k);
+          }
+        }
+      }
+      break;
+
+    case SMAPSBIN_INFO:
+      {
+        uint64_t key, val;
+        char *row = 0;
+
+        GET(key); GET(val);
+        if( asprintf(&row, "%s: %s", STR(key), STR(val)) != -1 )
+        {
+          str_array_add(&self->smapssnap_info, row);
+          free(row);
+        }
+      }
+      break;
+
+    case SMAPSBIN_PROCESS:
+      {
+        uint64_t pid, name, present;
+        const char *str;
+
+        GET(pid); GET(name); GET(present);
+
+        proc = smapsproc_create();
+        proc->smapsproc_pid.Pid = (int)pid;
+        proc->smapsproc_time = time, time = 0;
+        array_add(&self->smapssnap_proclist, proc);
+
+        str = STR(name);
+        while( *str == '-' ) ++str;
+        xstrset(&proc->smapsproc_pid.Name, str);
+
+        for( size_t i = 0; i < nfld[SMAPSBIN_FIELDS_STATUS]; ++i )
+        {
+          if( present & (1ull << i) )
+          {
+            GET(val);
+            if( offs[SMAPSBIN_FIELDS_STATUS][i] >= 0 )
+            {
+              *(unsigned *)((char *)&proc->smapsproc_pid +
+                            offs[SMAPSBIN_FIELDS_STATUS][i]) = (unsigned)val;
+            }
+          }
+        }
+        GET(mask);
+
+        tail = 0;
+        if( prev != 0 )
+        {
+          memset(prev, 0, nfld[SMAPSBIN_FIELDS_MAPPING] * sizeof *prev);
+        }
+        self->smapssnap_format = SNAPFORMAT_NEW;
+      }
+      break;
+
+    case SMAPSBIN_TIME:
+      {
+        const char *started = smapssnap_get_info(self, "Started");
+
+        GET(val);
+        if( started != 0 )
+        {
+          time = strtod(started, 0) + val * 1e-6;
+        }
+      }
+      break;
+
+    case SMAPSBIN_UNCHANGED:
+      {
+        uint64_t pid;
+
+        GET(pid);
+
+        proc = smapsproc_create();
+        proc->smapsproc_pid.Pid = (int)pid;
+        proc->smapsproc_unchanged = 1;
+        array_add(&self->smapssnap_proclist, proc);
+        proc = 0;
+
+        self->smapssnap_format = SNAPFORMAT_NEW;
+      }
+      break;
+
+    case SMAPSBIN_MAPPING:
+      {
+        uint64_t head, len, prot, offset, major, minor, inode, file;
+        char     ptxt[8], node[32];
+
+        if( proc == 0 )
+        {
+          goto corrupted;
+        }
+
+        GET(head); GET(len); GET(prot); GET(offset);
+        GET(major); GET(minor); GET(inode); GET(file);
+
+        head = tail + smapsbin_unzigzag(head);
+        tail = head + len;
+
+        snprintf(node, sizeof node, "%02x:%02x",
+                 (unsigned)major, (unsigned)minor);
+
+        smapsmapp_t *mapp =
+          smapsproc_add_mapping(proc, (unsigned)head, (unsigned)tail,
+                                smapsbin_prot_text(ptxt, (unsigned)prot),
+                                (unsigned)offset, node, (unsigned)inode,
+                                STR(file));
+
+        for( size_t i = 0; i < nfld[SMAPSBIN_FIELDS_MAPPING]; ++i )
+        {
+          if( mask & (1ull << i) )
+          {
+            GET(val);
+            prev[i] += smapsbin_unzigzag(val);
+            if( offs[SMAPSBIN_FIELDS_MAPPING][i] >= 0 )
+            {
+              *(unsigned *)((char *)&mapp->smapsmapp_mem +
+                            offs[SMAPSBIN_FIELDS_MAPPING][i]) = (unsigned)prev[i];
+            }
+            mapp->smapsmapp_mem.present |= bits[i];
+          }
+        }
+
+        if( !strcmp(STR(file), "[rollup]") )
+        {
+          // smaps_rollup has no Size field, use status data
+          mapp->smapsmapp_mem.Size = proc->smapsproc_pid.VmSize;
+          mapp->smapsmapp_mem.present |= MEMINFO_HAS(Size);
+        }
+      }
+      break;
+
+    default:
+      goto corrupted;
+    }
+  }
+
+  error = 0;
+  goto cleanup;
+
+  truncated:
+  fprintf(stderr, "%s: truncated binary capture\n", path);
+  goto cleanup;
+
+  corrupted:
+  fprintf(stderr, "%s: corrupted binary capture at offset %zu\n",
+          path, (size_t)(pos - data));
+
+  cleanup:
+
+#undef STR
+#undef GET
+
+  for( size_t i = 0; i < nstrs; ++i )
+  {
+    free(strs[i]);
+  }
+  free(strs);
+  free(offs[0]);
+  free(offs[1]);
+  free(prev);
+  free(bits);
+  free(data);
+
+  return error;
+}
+
+/* - - - - - - - - - - - - - - - - - - - *
+ * transparent decompression of captures
+ * - - - - - - - - - - - - - - - - - - - */
+
+static ssize_t
+capture_gzip_read_cb(void *cookie, char *data, size_t size)
+{
+  int rc = gzread(cookie, data, size);
+  return (rc < 0) ? -1 : rc;
+}
+
+static int
+capture_gzip_close_cb(void *cookie)
+{
+  return (gzclose(cookie) == Z_OK) ? 0 : -1;
+}
+
+#ifdef HAVE_ZSTD
+typedef struct
+{
+  FILE          *file;
+  ZSTD_DStream  *zstd;
+  ZSTD_inBuffer  in;
+  char           buff[1<<16];
+} capture_zstd_t;
+
+static ssize_t
+capture_zstd_read_cb(void *cookie, char *data, size_t size)
+{
+  capture_zstd_t *self = cookie;
+  ZSTD_outBuffer  out  = { data, size, 0 };
+
+  while( out.pos == 0 )
+  {
+    if( self->in.pos == self->in.size )
+    {
+      self->in.size = fread(self->buff, 1, sizeof self->buff, self->file);
+      self->in.pos  = 0;
+      if( self->in.size == 0 )
+      {
+        break;
+      }
+    }
+    size_t rc = ZSTD_decompressStream(self->zstd, &out, &self->in);
+    if( ZSTD_isError(rc) )
+    {
+      fprintf(stderr, "zstd: %s\n", ZSTD_getErrorName(rc));
+      return -1;
+    }
+  }
+  return out.pos;
+}
+
+static int
+capture_zstd_close_cb(void *cookie)
+{
+  capture_zstd_t *self = cookie;
+  int rc = fclose(self->file);
+  ZSTD_freeDStream(self->zstd);
+  free(self);
+  return rc;
+}
+#endif
+
+/* - - - - - - - - - - - - - - - - - - - *
+ * incremental captures: fill in unchanged
+ * processes from the base capture
  * - - - - - - - - - - - - - - - - - - - */
 
-static smapsproc_t *
-proc_find(smapssnap_t *self, int pid)
+static void
+smapsproc_copy_from(smapsproc_t *self, const smapsproc_t *that)
 {
-  int lo = 0, hi = self->smapssnap_proclist.size;
-  while( lo < hi )
+  char *name = self->smapsproc_pid.Name;
+
+  self->smapsproc_pid = that->smapsproc_pid;
+  self->smapsproc_pid.Name = name;
+  xstrset(&self->smapsproc_pid.Name, that->smapsproc_pid.Name);
+
+  for( size_t i = 0; i < that->smapsproc_mapplist.size; ++i )
   {
-    int i = (lo + hi) / 2;
-    smapsproc_t *p = self->smapssnap_proclist.data[i];
+    const smapsmapp_t *src = that->smapsproc_mapplist.data[i];
+    const mapinfo_t   *map = &src->smapsmapp_map;
+    smapsmapp_t       *dst;
 
-    if( p->smapsproc_pid.Pid > pid ) { hi = i+0; continue; }
-    if( p->smapsproc_pid.Pid < pid ) { lo = i+1; continue; }
-    return p;
+    dst = smapsproc_add_mapping(self, map->head, map->tail, map->prot,
+                                map->offs, map->node, map->flgs, map->path);
+    dst->smapsmapp_mem = src->smapsmapp_mem;
   }
-  return 0;
 }
 
-void
-smapssnap_create_hierarchy(smapssnap_t *self)
+static int
+smapssnap_resolve_base(smapssnap_t *self, const char *path)
 {
-  /* - - - - - - - - - - - - - - - - - - - *
-   * sort processes by PID
-   * - - - - - - - - - - - - - - - - - - - */
-
-  array_sort(&self->smapssnap_proclist, smapsproc_compare_pid_cb);
-
-  /* - - - - - - - - - - - - - - - - - - - *
-   * find parent for every process
-   * - - - - - - - - - - - - - - - - - - - */
+  int          error = -1;
+  smapssnap_t *base  = 0;
+  char        *from  = 0;
+  const char  *name  = smapssnap_get_info(self, "Base");
+  const char  *seq   = smapssnap_get_info(self, "BaseSequence");
+  const char  *have  = 0;
+  const char  *dir   = strrchr(path, '/');
+  size_t       todo  = 0;
 
   for( size_t i = 0; i < self->smapssnap_proclist.size; ++i )
   {
-    smapsproc_t *cur = self->smapssnap_proclist.data[i];
-    smapsproc_t *par = proc_find(self, cur->smapsproc_pid.PPid);
+    const smapsproc_t *proc = self->smapssnap_proclist.data[i];
+    todo += proc->smapsproc_unchanged;
+  }
+  if( todo == 0 )
+  {
+    return 0;
+  }
 
-    assert( cur->smapsproc_parent == 0 );
+  if( name == 0 )
+  {
+    fprintf(stderr, "%s: unchanged processes, but no base capture\n", path);
+    goto cleanup;
+  }
 
-    if( par == 0 || par == cur )
-    {
-      if( cur->smapsproc_pid.PPid != 0 )
-      {
-        fprintf(stderr, "PPID %d not found\n", cur->smapsproc_pid.PPid);
-      }
-      par = &self->smapssnap_rootproc;
-    }
+  // base capture is in the same directory unless absolute path is given
+  if( *name == '/' || dir == 0 )
+  {
+    from = strdup(name);
+  }
+  else if( asprintf(&from, "%.*s%s", (int)(dir + 1 - path), path, name) == -1 )
+  {
+    from = 0;
+  }
+  if( from == 0 )
+  {
+    perror(path); goto cleanup;
+  }
 
-    cur->smapsproc_parent = par;
-    array_add(&par->smapsproc_children, cur);
+  base = smapssnap_create();
+
+  if( smapssnap_load_cap(base, from) != 0 )
+  {
+    fprintf(stderr, "%s: base capture %s could not be loaded\n", path, from);
+    goto cleanup;
   }
-}
 
-/* ------------------------------------------------------------------------- *
- * smapssnap_collapse_threads
- * ------------------------------------------------------------------------- */
+  have = smapssnap_get_info(base, "Sequence");
+  if( seq != 0 && (have == 0 || strcmp(seq, have)) )
+  {
+    fprintf(stderr, "%s: base capture %s has been overwritten\n", path, from);
+    goto cleanup;
+  }
 
-void
-smapssnap_collapse_threads(smapssnap_t *self)
-{
-  smapsproc_collapse_threads(&self->smapssnap_rootproc);
+  array_sort(&base->smapssnap_proclist, smapsproc_compare_pid_cb);
 
   for( size_t i = 0; i < self->smapssnap_proclist.size; ++i )
   {
-    smapsproc_t *cur = self->smapssnap_proclist.data[i];
+    smapsproc_t *proc = self->smapssnap_proclist.data[i];
+    smapsproc_t *prev;
 
-    if( cur->smapsproc_parent == 0 )
+    if( !proc->smapsproc_unchanged )
     {
-      self->smapssnap_proclist.data[i] = 0;
-      smapsproc_delete(cur);
+      continue;
     }
+
+    if( (prev = proc_find(base, proc->smapsproc_pid.Pid)) == 0 )
+    {
+      fprintf(stderr, "%s: PID %d not found in base capture %s\n",
+              path, proc->smapsproc_pid.Pid, from);
+      goto cleanup;
+    }
+
+    smapsproc_copy_from(proc, prev);
+    proc->smapsproc_unchanged = 0;
   }
-  array_compact(&self->smapssnap_proclist);
-}
 
-/* ------------------------------------------------------------------------- *
- * smapssnap_add_process
- * ------------------------------------------------------------------------- */
+  error = 0;
 
-smapsproc_t *
-smapssnap_add_process(smapssnap_t *self, int pid)
+  cleanup:
+
+  smapssnap_delete(base);
+  free(from);
+
+  return error;
+}
+
+static FILE *
+capture_open(const char *path)
 {
-  smapsproc_t *proc;
+  FILE          *file = 0;
+  unsigned char  magic[4] = { 0, 0, 0, 0 };
 
-  for( int i = self->smapssnap_proclist.size; i-- > 0; )
+  if( (file = fopen(path, "r")) == 0 )
   {
-    proc = self->smapssnap_proclist.data[i];
-    if( proc->smapsproc_pid.Pid == pid )
+    return 0;
+  }
+
+  size_t n = fread(magic, 1, sizeof magic, file);
+  rewind(file);
+
+  if( n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b )
+  {
+    cookie_io_functions_t io = { capture_gzip_read_cb, 0, 0, capture_gzip_close_cb };
+    gzFile gz = gzdopen(dup(fileno(file)), "rb");
+
+    fclose(file), file = 0;
+    if( gz != 0 && (file = fopencookie(gz, "r", io)) == 0 )
     {
-      return proc;
+      gzclose(gz);
     }
   }
-  proc = smapsproc_create();
-  proc->smapsproc_pid.Pid = pid;
-  array_add(&self->smapssnap_proclist, proc);
-  return proc;
-}
+#ifdef HAVE_ZSTD
+  else if( n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 &&
+           magic[2] == 0x2f && magic[3] == 0xfd )
+  {
+    cookie_io_functions_t io = { capture_zstd_read_cb, 0, 0, capture_zstd_close_cb };
+    capture_zstd_t *zs = calloc(1, sizeof *zs);
 
-/* ------------------------------------------------------------------------- *
- * smapssnap_load_cap
- * ------------------------------------------------------------------------- */
+    zs->file = file;
+    zs->zstd = ZSTD_createDStream();
+    ZSTD_initDStream(zs->zstd);
 
-static int
-hexterm(const char *s)
-{
-  while( isxdigit(*s) )
-  {
-    ++s;
+    if( (file = fopencookie(zs, "r", io)) == 0 )
+    {
+      capture_zstd_close_cb(zs);
+    }
   }
-  return *s;
+#endif
+
+  return file;
 }
 
 int
@@ -1822,11 +2504,27 @@ smapssnap_load_cap(smapssnap_t *self, const char *path)
 
   smapssnap_set_source(self, path);
 
-  if( (file = fopen(path, "r")) == 0 )
+  if( (file = capture_open(path)) == 0 )
   {
     perror(path); goto cleanup;
   }
 
+  /* - - - - - - - - - - - - - - - - - - - *
+   * binary captures are recognized from
+   * the first byte, text never starts
+   * with it
+   * - - - - - - - - - - - - - - - - - - - */
+
+  {
+    int c = getc(file);
+    ungetc(c, file);
+    if( c == (unsigned char)SMAPSBIN_MAGIC[0] )
+    {
+      error = smapssnap_load_bin(self, path, file);
+      goto cleanup;
+    }
+  }
+
   while( getline(&data, &size, file) >= 0 )
   {
     data[strcspn(data, "\r\n")] = 0;
@@ -1838,6 +2536,7 @@ smapssnap_load_cap(smapssnap_t *self, const char *path)
     else if( !strncmp(data, "==>", 3) )
     {
       // ==> /proc/1/smaps <==
+      // ==> /proc/1/smaps_rollup <==
 
       proc = 0;
       mapp = 0;
@@ -1847,7 +2546,8 @@ smapssnap_load_cap(smapssnap_t *self, const char *path)
 
       while( *pos && strcmp(slice(&pos, '/'), "proc") ) { }
       int pid = strtol(slice(&pos, '/'), 0, 10);
-      if( pid > 0 && !strcmp(slice(&pos, -1), "smaps") )
+      char *what = slice(&pos, -1);
+      if( pid > 0 && (!strcmp(what, "smaps") || !strcmp(what, "smaps_rollup")) )
       {
         proc = smapssnap_add_process(self, pid);
       }
@@ -1858,6 +2558,12 @@ smapssnap_load_cap(smapssnap_t *self, const char *path)
 
       free(backup);
     }
+    else if( !strncmp(data, "##", 2) )
+    {
+      // ##Time: 2011-12-22T12:00:00.000000Z
+
+      str_array_add(&self->smapssnap_info, data+2);
+    }
     else if( *data == '#' )
     {
       // #Name: init__2_
@@ -1865,7 +2571,18 @@ smapssnap_load_cap(smapssnap_t *self, const char *path)
       // #PPid: 0
       // #Threads: 1
 
-      if (proc)
+      if( proc && !strncmp(data, "#Unchanged:", 11) )
+      {
+        // #Unchanged: 1 -> see ##Base capture
+        proc->smapsproc_unchanged = 1;
+        self->smapssnap_format = SNAPFORMAT_NEW;
+      }
+      else if( proc && !strncmp(data, "#Time:", 6) )
+      {
+        // #Time: 12345.678901 -> CLOCK_MONOTONIC
+        proc->smapsproc_time = strtod(data + 6, 0);
+      }
+      else if (proc)
       {
         pidinfo_parse(&proc->smapsproc_pid, data+1);
         self->smapssnap_format = SNAPFORMAT_NEW;
@@ -1888,6 +2605,13 @@ smapssnap_load_cap(smapssnap_t *self, const char *path)
 
         mapp = smapsproc_add_mapping(proc, head, tail, prot,
                                      offs, node, flgs, path);
+
+        if( !strcmp(path, "[rollup]") )
+        {
+          // smaps_rollup has no Size field, use status data
+          mapp->smapsmapp_mem.Size = proc->smapsproc_pid.VmSize;
+          mapp->smapsmapp_mem.present |= MEMINFO_HAS(Size);
+        }
       }
     }
     else
@@ -1914,6 +2638,11 @@ smapssnap_load_cap(smapssnap_t *self, const char *path)
 
   if( file ) fclose(file);
 
+  if( error == 0 )
+  {
+    error = smapssnap_resolve_base(self, path);
+  }
+
   return error;
 }
 
@@ -1934,6 +2663,15 @@ smapssnap_save_cap(smapssnap_t *self, const char *path)
 
   array_sort(&self->smapssnap_proclist, smapsproc_compare_pid_cb);
 
+  for( size_t i = 0; i < self->smapssnap_info.size; ++i )
+  {
+    fprintf(file, "##%s\n", self->smapssnap_info.data[i]);
+  }
+  if( self->smapssnap_info.size != 0 )
+  {
+    fprintf(file, "\n");
+  }
+
   for( int p = 0; p < self->smapssnap_proclist.size; ++p )
   {
     const smapsproc_t *proc = self->smapssnap_proclist.data[p];
@@ -1946,8 +2684,14 @@ smapssnap_save_cap(smapssnap_t *self, const char *path)
 #define Pu(v) fprintf(file, "#%s: %u\n", #v, pi->v)
 
     Ps(Name);
+    if( proc->smapsproc_time > 0 )
+    {
+      fprintf(file, "#Time: %.6f\n", proc->smapsproc_time);
+    }
     Pi(Pid);
     Pi(PPid);
+    if( pi->Tgid )  Pi(Tgid);
+    if( pi->NSpid ) Pi(NSpid);
     Pi(Threads);
 
     if( pi->VmPeak
@@ -1973,6 +2717,7 @@ smapssnap_save_cap(smapssnap_t *self, const char *path)
       Pu(VmLib);
       Pu(VmPTE);
     }
+    if( pi->Brief ) Pi(Brief);
 #undef Pu
 #undef Pi
 #undef Ps
@@ -1988,7 +2733,8 @@ smapssnap_save_cap(smapssnap_t *self, const char *path)
               map->offs, map->node, map->flgs,
               map->path);
 
-#define Pu(v) fprintf(file, "%-14s %8u kB\n", #v":", mem->v)
+#define Pu(v) if( mem->present & MEMINFO_HAS(v) )\
+                fprintf(file, "%-14s %8u kB\n", #v":", mem->v)
 
       Pu(Size);
       Pu(Rss);
@@ -2001,6 +2747,11 @@ smapssnap_save_cap(smapssnap_t *self, const char *path)
       Pu(Referenced);
       Pu(Anonymous);
       Pu(Locked);
+      Pu(Uss);
+      if( mem->present & MEMINFO_HAS(Vmas) )
+      {
+        fprintf(file, "%-14s %8u\n", "Vmas:", mem->Vmas);
+      }
 
 #undef Pu
     }
@@ -2084,18 +2835,23 @@ smapssnap_save_csv(smapssnap_t *self, const char *path)
               map->offs, map->node, map->flgs,
               map->path);
 
-      fprintf(file, "%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u",
-              mem->Size,
-              mem->Rss,
-              mem->Shared_Clean,
-              mem->Shared_Dirty,
-              mem->Private_Clean,
-              mem->Private_Dirty,
-              mem->Pss,
-              mem->Swap,
-              mem->Referenced,
-              mem->Anonymous,
-              mem->Locked);
+      /* values missing from --fields captures are left empty */
+#define Pu(v) fprintf(file, (mem->present & MEMINFO_HAS(v)) ? "%u," : ",",\
+                    mem->v)
+
+      Pu(Size);
+      Pu(Rss);
+      Pu(Shared_Clean);
+      Pu(Shared_Dirty);
+      Pu(Private_Clean);
+      Pu(Private_Dirty);
+      Pu(Pss);
+      Pu(Swap);
+      Pu(Referenced);
+      Pu(Anonymous);
+      Pu(Locked);
+
+#undef Pu
 
       fprintf(file, "%u,%u,%u\n",
               mem->Private_Dirty,
@@ -2328,6 +3084,21 @@ analyze_sysest(analyze_t *self, int tid)
   return &self->sysest[tid];
 }
 
+/* ------------------------------------------------------------------------- *
+ * analyze_uval  --  html cell text, empty for values not in capture
+ *
+ * Captures made with --fields lack some values altogether, which is
+ * shown differently from zero ("-").
+ * ------------------------------------------------------------------------- */
+
+INLINE const char *
+analyze_uval(const analyze_t *self, unsigned has, unsigned n)
+{
+  return (self->present & has) ? uval(n) : "";
+}
+
+#define AVAL(v, m) analyze_uval(self, MEMINFO_HAS(v), (m)->v)
+
 /* ------------------------------------------------------------------------- *
  * analyze_sysmax
  * ------------------------------------------------------------------------- */
@@ -2591,6 +3362,7 @@ analyze_accumulate_data(analyze_t *self)
                                         mapp->smapsmapp_TID);
 
     meminfo_accumulate_appdata(dest, srce);
+    self->present |= srce->present;
   }
 
   /* - - - - - - - - - - - - - - - - - - - *
@@ -2792,27 +3564,27 @@ analyze_emit_page_table(analyze_t *self, FILE *file, const meminfo_t *mtab, cons
 
     fprintf(file, "<tr>\n");
     fprintf(file, "<th"LT" align=left>%s\n", self->stype[t]);
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(m->Private_Dirty));
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(m->Shared_Dirty));
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(m->Private_Clean));
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(m->Shared_Clean));
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(m->Rss));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Private_Dirty, m));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Shared_Dirty, m));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Private_Clean, m));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Shared_Clean, m));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Rss, m));
     if (pidinfo)
     {
       fprintf(file, "<td %s align=right>%s\n", bg,
           uval(t==0 ? pidinfo->VmHWM : 0));
     }
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(m->Size));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Size, m));
     if (pidinfo)
     {
       fprintf(file, "<td %s align=right>%s\n", bg,
           uval(t==0 ? pidinfo->VmPeak : 0));
     }
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(m->Pss));
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(m->Swap));
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(m->Referenced));
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(m->Anonymous));
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(m->Locked));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Pss, m));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Swap, m));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Referenced, m));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Anonymous, m));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Locked, m));
   }
   fprintf(file, "</table>\n");
 }
@@ -2988,16 +3760,16 @@ analyze_emit_lib_html(analyze_t *self, smapssnap_t *snap, const char *work)
 
         fprintf(file, "<td align=left>%s\n", m->smapsmapp_map.type);
         fprintf(file, "<td align=left style='font-family: monospace;'>%s\n", m->smapsmapp_map.prot);
-        fprintf(file, "<td align=right>%s\n", uval(m->smapsmapp_mem.Size));
-        fprintf(file, "<td align=right>%s\n", uval(m->smapsmapp_mem.Rss));
-        fprintf(file, "<td align=right>%s\n", uval(m->smapsmapp_mem.Private_Dirty));
-        fprintf(file, "<td align=right>%s\n", uval(m->smapsmapp_mem.Shared_Dirty));
-        fprintf(file, "<td align=right>%s\n", uval(m->smapsmapp_mem.Private_Clean));
-        fprintf(file, "<td align=right>%s\n", uval(m->smapsmapp_mem.Shared_Clean));
-        fprintf(file, "<td align=right>%s\n", uval(m->smapsmapp_mem.Pss));
-        fprintf(file, "<td align=right>%s\n", uval(m->smapsmapp_mem.Swap));
-        fprintf(file, "<td align=right>%s\n", uval(m->smapsmapp_mem.Anonymous));
-        fprintf(file, "<td align=right>%s\n", uval(m->smapsmapp_mem.Locked));
+        fprintf(file, "<td align=right>%s\n", AVAL(Size, &m->smapsmapp_mem));
+        fprintf(file, "<td align=right>%s\n", AVAL(Rss, &m->smapsmapp_mem));
+        fprintf(file, "<td align=right>%s\n", AVAL(Private_Dirty, &m->smapsmapp_mem));
+        fprintf(file, "<td align=right>%s\n", AVAL(Shared_Dirty, &m->smapsmapp_mem));
+        fprintf(file, "<td align=right>%s\n", AVAL(Private_Clean, &m->smapsmapp_mem));
+        fprintf(file, "<td align=right>%s\n", AVAL(Shared_Clean, &m->smapsmapp_mem));
+        fprintf(file, "<td align=right>%s\n", AVAL(Pss, &m->smapsmapp_mem));
+        fprintf(file, "<td align=right>%s\n", AVAL(Swap, &m->smapsmapp_mem));
+        fprintf(file, "<td align=right>%s\n", AVAL(Anonymous, &m->smapsmapp_mem));
+        fprintf(file, "<td align=right>%s\n", AVAL(Locked, &m->smapsmapp_mem));
       }
     }
 
@@ -3148,16 +3920,16 @@ analyze_emit_app_html(analyze_t *self, smapssnap_t *snap, const char *work)
 
         fprintf(file, "<td align=left>%s\n", m->smapsmapp_map.type);
         fprintf(file, "<td align=left style='font-family: monospace;'>%s\n", m->smapsmapp_map.prot);
-        fprintf(file, "<td align=right>%s\n", uval(m->smapsmapp_mem.Size));
-        fprintf(file, "<td align=right>%s\n", uval(m->smapsmapp_mem.Rss));
-        fprintf(file, "<td align=right>%s\n", uval(m->smapsmapp_mem.Private_Dirty));
-        fprintf(file, "<td align=right>%s\n", uval(m->smapsmapp_mem.Shared_Dirty));
-        fprintf(file, "<td align=right>%s\n", uval(m->smapsmapp_mem.Private_Clean));
-        fprintf(file, "<td align=right>%s\n", uval(m->smapsmapp_mem.Shared_Clean));
-        fprintf(file, "<td align=right>%s\n", uval(m->smapsmapp_mem.Pss));
-        fprintf(file, "<td align=right>%s\n", uval(m->smapsmapp_mem.Swap));
-        fprintf(file, "<td align=right>%s\n", uval(m->smapsmapp_mem.Anonymous));
-        fprintf(file, "<td align=right>%s\n", uval(m->smapsmapp_mem.Locked));
+        fprintf(file, "<td align=right>%s\n", AVAL(Size, &m->smapsmapp_mem));
+        fprintf(file, "<td align=right>%s\n", AVAL(Rss, &m->smapsmapp_mem));
+        fprintf(file, "<td align=right>%s\n", AVAL(Private_Dirty, &m->smapsmapp_mem));
+        fprintf(file, "<td align=right>%s\n", AVAL(Shared_Dirty, &m->smapsmapp_mem));
+        fprintf(file, "<td align=right>%s\n", AVAL(Private_Clean, &m->smapsmapp_mem));
+        fprintf(file, "<td align=right>%s\n", AVAL(Shared_Clean, &m->smapsmapp_mem));
+        fprintf(file, "<td align=right>%s\n", AVAL(Pss, &m->smapsmapp_mem));
+        fprintf(file, "<td align=right>%s\n", AVAL(Swap, &m->smapsmapp_mem));
+        fprintf(file, "<td align=right>%s\n", AVAL(Anonymous, &m->smapsmapp_mem));
+        fprintf(file, "<td align=right>%s\n", AVAL(Locked, &m->smapsmapp_mem));
       }
     }
 
@@ -3216,19 +3988,125 @@ analyze_emit_smaps_table(analyze_t *self, FILE *file, meminfo_t *v)
 
     fprintf(file, "<tr>\n");
     fprintf(file, "<th"LT" align=left>%s\n", self->stype[t]);
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(m->Private_Dirty));
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(m->Shared_Dirty));
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(m->Private_Clean));
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(m->Shared_Clean));
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(m->Rss));
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(m->Size));
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(m->Pss));
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(m->Swap));
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(m->Referenced));
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(m->Anonymous));
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(m->Locked));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Private_Dirty, m));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Shared_Dirty, m));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Private_Clean, m));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Shared_Clean, m));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Rss, m));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Size, m));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Pss, m));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Swap, m));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Referenced, m));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Anonymous, m));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Locked, m));
+  }
+
+  fprintf(file, "</table>\n");
+}
+
+/* ------------------------------------------------------------------------- *
+ * analyze_emit_reconciliation  --  user space vs. system wide memory use
+ * ------------------------------------------------------------------------- */
+
+static void
+analyze_emit_reconciliation_row(FILE *file, const char *bg, const char *name,
+                                long long kb, const char *note)
+{
+  fprintf(file, "<tr>\n");
+  fprintf(file, "<th"LT" align=left>%s\n", name);
+  fprintf(file, "<td %s align=right>%lld\n", bg, kb);
+  fprintf(file, "<td %s align=left>%s\n", bg, note);
+}
+
+static void
+analyze_emit_reconciliation(analyze_t *self, smapssnap_t *snap, FILE *file)
+{
+#define M(name) long long name = smapssnap_get_sysval(snap, "meminfo", #name)
+  M(MemTotal); M(MemFree); M(Buffers); M(Cached); M(Mapped);
+  M(Shmem); M(Slab); M(SReclaimable); M(SUnreclaim);
+  M(KernelStack); M(PageTables);
+#undef M
+
+  if( MemTotal < 0 || MemFree < 0 )
+  {
+    return;
+  }
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * page tables are per address space, so
+   * count only thread group leaders
+   * - - - - - - - - - - - - - - - - - - - */
+
+  long long pte = 0;
+
+  for( size_t i = 0; i < snap->smapssnap_proclist.size; ++i )
+  {
+    const pidinfo_t *pi = &((smapsproc_t *)snap->smapssnap_proclist.data[i])->smapsproc_pid;
+
+    if( pi->Tgid == 0 || pi->Tgid == pi->Pid )
+    {
+      pte += pi->VmPTE;
+    }
+  }
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * mapped file pages are already included
+   * in pss, count the rest of page cache
+   * - - - - - - - - - - - - - - - - - - - */
+
+  long long pss   = self->sysest[0].Pss;
+  long long slab  = Slab < 0 ? 0 : Slab;
+  long long kstk  = KernelStack < 0 ? 0 : KernelStack;
+  long long shmem = Shmem < 0 ? 0 : Shmem;
+  long long cache = 0;
+
+  if( Cached >= 0 )
+  {
+    cache = Cached - shmem - (Mapped < 0 ? 0 : Mapped);
+    if( Buffers > 0 ) cache += Buffers;
+    if( cache < 0 ) cache = 0;
   }
 
+  long long used = MemTotal - MemFree;
+  long long lost = used - pss - slab - kstk - pte - cache - shmem;
+
+  char note[256];
+
+  fprintf(file, "<table border=1>\n");
+  fprintf(file, "<tr>\n");
+  fprintf(file, "<th"TP">%s\n", "Class");
+  fprintf(file, "<th"TP">%s\n", "kB");
+  fprintf(file, "<th"TP">%s\n", "Source");
+
+  analyze_emit_reconciliation_row(file, D1, "Total", MemTotal,
+                                  "meminfo MemTotal");
+  analyze_emit_reconciliation_row(file, D1, "Free", MemFree,
+                                  "meminfo MemFree");
+  analyze_emit_reconciliation_row(file, D1, "Used", used,
+                                  "Total - Free");
+
+  snprintf(note, sizeof note, "sum of Pss over %zu captured processes",
+           snap->smapssnap_proclist.size);
+  analyze_emit_reconciliation_row(file, D2, "User space PSS", pss, note);
+
+  snprintf(note, sizeof note, "meminfo Slab (reclaimable %lld, unreclaimable %lld)",
+           SReclaimable, SUnreclaim);
+  analyze_emit_reconciliation_row(file, D2, "Slab", slab, note);
+
+  analyze_emit_reconciliation_row(file, D2, "Kernel stacks", kstk,
+                                  "meminfo KernelStack");
+
+  snprintf(note, sizeof note, "sum of VmPTE (meminfo PageTables %lld)",
+           PageTables);
+  analyze_emit_reconciliation_row(file, D2, "Page tables", pte, note);
+
+  analyze_emit_reconciliation_row(file, D2, "Page cache", cache,
+                                  "meminfo Cached + Buffers - Shmem - Mapped");
+  analyze_emit_reconciliation_row(file, D2, "Shmem", shmem,
+                                  "meminfo Shmem, mapped part is also in PSS");
+  analyze_emit_reconciliation_row(file, D1, "Unaccounted", lost,
+                                  "Used - all of the above");
+
   fprintf(file, "</table>\n");
 }
 
@@ -3438,15 +4316,15 @@ analyze_emit_table(analyze_t *self, FILE *file, const char *work, enum emit_type
       abort();
     }
 
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(s->Private_Dirty));
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(s->Shared_Dirty));
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(s->Private_Clean));
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(s->Shared_Clean));
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(s->Rss));
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(s->Size));
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(s->Pss));
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(s->Swap));
-    fprintf(file, "<td %s align=right>%s\n", bg, uval(s->Locked));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Private_Dirty, s));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Shared_Dirty, s));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Private_Clean, s));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Shared_Clean, s));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Rss, s));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Size, s));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Pss, s));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Swap, s));
+    fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Locked, s));
 
     if (type == EMIT_TYPE_APPLICATION)
     {
@@ -3458,7 +4336,7 @@ analyze_emit_table(analyze_t *self, FILE *file, const char *work, enum emit_type
       for( int t = 1; t < self->ntypes; ++t )
       {
 	meminfo_t *s = analyze_mem(self, a, t, type);
-	fprintf(file, "<td %s align=right>%s\n", bg, uval(s->Size));
+	fprintf(file, "<td %s align=right>%s\n", bg, AVAL(Size, s));
       }
     }
   }
@@ -3667,6 +4545,46 @@ analyze_emit_main_page(analyze_t *self, smapssnap_t *snap, const char *path)
 
   analyze_html_header(file, smapssnap_get_source(snap), work);
 
+  if( smapssnap_get_info(snap, "Time") )
+  {
+    fprintf(file, "<p>Captured: %s\n", smapssnap_get_info(snap, "Time"));
+  }
+
+  if( smapssnap_get_info(snap, "Partial") )
+  {
+    fprintf(file, "<p><b>Partial capture</b> (%s) because of the"
+            " capture deadline. The values below are too low.\n",
+            smapssnap_get_info(snap, "Partial"));
+  }
+
+  if( smapssnap_get_info(snap, "Hybrid") )
+  {
+    size_t brief = 0;
+
+    for( size_t i = 0; i < snap->smapssnap_proclist.size; ++i )
+    {
+      const smapsproc_t *proc = snap->smapssnap_proclist.data[i];
+      brief += (proc->smapsproc_pid.Brief != 0);
+    }
+    fprintf(file, "<p>Hybrid capture: %zu of %zu processes have mappings"
+            " only, their memory use is not included below.\n",
+            brief, snap->smapssnap_proclist.size);
+  }
+
+  if( smapssnap_get_info(snap, "Fields") )
+  {
+    fprintf(file, "<p>Captured fields: %s. Other values were not"
+            " captured, their cells are left empty.\n",
+            smapssnap_get_info(snap, "Fields"));
+  }
+
+  if( smapssnap_get_info(snap, "Folded") )
+  {
+    fprintf(file, "<p>Folded capture: %s. Mappings with the same path"
+            " and protection were summed up by the snapshot tool.\n",
+            smapssnap_get_info(snap, "Folded"));
+  }
+
   /* - - - - - - - - - - - - - - - - - - - *
    * memory usage tables
    * - - - - - - - - - - - - - - - - - - - */
@@ -3690,6 +4608,15 @@ analyze_emit_main_page(analyze_t *self, smapssnap_t *snap, const char *path)
   analyze_emit_smaps_table(self, file, self->appmax);
   fprintf(file, "<p>No process has values larger than the ones listed above.\n");
 
+  if( smapssnap_get_sysval(snap, "meminfo", "MemTotal") >= 0 )
+  {
+    fprintf(file, "<h2>System: Memory Reconciliation</h2>\n");
+    analyze_emit_reconciliation(self, snap, file);
+    fprintf(file, "<p>Unaccounted memory is used by the kernel in ways not"
+            " listed above, e.g. by drivers, or by processes not included"
+            " in the capture.\n");
+  }
+
   /* - - - - - - - - - - - - - - - - - - - *
    * process hierarchy tree
    * - - - - - - - - - - - - - - - - - - - */
@@ -3813,6 +4740,18 @@ analyze_emit_appval_table(analyze_t *self, smapssnap_t *snap, FILE *file)
   qsort_cmp_data = self;
   qsort(lut, self->nappls, sizeof *lut, analyze_emit_appval_table_cmp);
 
+  /* deep captures get an uss column after all the others, so that
+   * the layout stays the same for tools using column positions */
+  int uss = 0;
+  for( int i = 0; i < self->nappls; ++i )
+  {
+    if( analyze_app_mem(self, i, 0)->present & MEMINFO_HAS(Uss) )
+    {
+      uss = 1;
+      break;
+    }
+  }
+
   fprintf(file, "generator = %s %s\n", TOOL_NAME, TOOL_VERS);
   fprintf(file, "\n");
   fprintf(file, "name,pid,ppid,threads,pri,sha,cln,rss,size,rss,pss,swap,referenced");
@@ -3820,6 +4759,10 @@ analyze_emit_appval_table(analyze_t *self, smapssnap_t *snap, FILE *file)
   {
     fprintf(file, ",%s", self->stype[t]);
   }
+  if( uss )
+  {
+    fprintf(file, ",uss");
+  }
   fprintf(file, "\n");
 
   for( int i = 0; i < self->nappls; ++i )
@@ -3848,6 +4791,10 @@ analyze_emit_appval_table(analyze_t *self, smapssnap_t *snap, FILE *file)
       meminfo_t *s = analyze_app_mem(self, a, t);
       fprintf(file, ",%u", meminfo_total(s));
     }
+    if( uss )
+    {
+      fprintf(file, ",%u", s->Uss);
+    }
     fprintf(file, "\n");
   }
 }
@@ -4778,12 +5725,22 @@ smapsfilt_load_inputs(smapsfilt_t *self)
     if (error) continue;
     array_add(&self->smapsfilt_snaplist, snap);
 
+    if( smapssnap_get_info(snap, "Partial") )
+    {
+      fprintf(stderr, "Warning: %s: partial capture (%s),"
+              " totals are too low.\n", path,
+              smapssnap_get_info(snap, "Partial"));
+    }
+
 // QUARANTINE     smapssnap_save_cap(snap, "out1.cap");
 // QUARANTINE     smapssnap_save_csv(snap, "out1.csv");
 
     smapssnap_create_hierarchy(snap);
+    /* a capture where the deadline skipped every process has no
+     * records telling the format -> nothing to warn about */
     if (snap->smapssnap_format == SNAPFORMAT_OLD) {
-      fprintf(stderr, "Warning: %s: oldstyle capture file, not removing threads.\n", path);
+      if (snap->smapssnap_proclist.size > 0)
+        fprintf(stderr, "Warning: %s: oldstyle capture file, not removing threads.\n", path);
     } else {
       smapssnap_collapse_threads(snap);
     }
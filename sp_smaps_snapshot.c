@@ -48,8 +48,15 @@
  * ========================================================================= */
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -58,14 +65,33 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <dirent.h>
 #include <sched.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <regex.h>
+#include <poll.h>
+
+#include <linux/io_uring.h>
+
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+# include <zstd.h>
+#endif
 
 #define MSG_DISABLE_PROGRESS 0
 
 #include <libsysperf/msg.h>
 #include <libsysperf/argvec.h>
 
+#include "symtab.h"
+#include "smapsbin.h"
+#include "smapsring.h"
+
 /* ========================================================================= *
  * Configuration
  * ========================================================================= */
@@ -106,6 +132,210 @@ static const manual_t app_man[]=
           "However, this can be cause instability at least when the command\n"
           "is run from a serial console, so this behavior is optional\n"
           "rather than the default.\n"
+          "\n"
+          "On hosts with many processes the capture can be spread over\n"
+          "several worker threads (see --jobs). Process records are\n"
+          "still written in ascending pid order, so the output is the\n"
+          "same regardless of the number of workers used.\n"
+          "\n"
+          "In rollup mode (see --rollup) the per mapping smaps data is\n"
+          "replaced by /proc/pid/smaps_rollup, which holds the totals for\n"
+          "the whole process. This makes the capture much smaller and\n"
+          "faster to take, but only per process values can be reported\n"
+          "from it.\n"
+          "\n"
+          "In daemon mode (see --interval) the tool stays resident and\n"
+          "takes a capture at fixed intervals. The captures are written\n"
+          "to a ring of files derived from the output path, e.g. with\n"
+          "'-o smaps.cap' the files are smaps-000.cap, smaps-001.cap, ...\n"
+          "and once the ring is full, the oldest capture is overwritten.\n"
+          "Each capture is first written to a temporary file and renamed\n"
+          "in place when complete.\n"
+          "\n"
+          "Daemon mode captures can be made incremental (see --incremental).\n"
+          "Then only every Nth capture is a full one. In the others, the\n"
+          "processes whose /proc/pid/stat start time, virtual size, rss\n"
+          "and page fault counts have not changed since the previous\n"
+          "capture are written as references to the previous capture\n"
+          "file, which is named in the '##Base' header line. Their smaps\n"
+          "data is not read at all. sp_smaps_filter resolves the references\n"
+          "when loading the capture, as long as the earlier captures are\n"
+          "still available; once the ring wraps around, the oldest\n"
+          "incremental captures lose their base and can't be loaded\n"
+          "anymore. Note that shared memory accounting values\n"
+          "like Pss of an unchanged process can drift slightly until the\n"
+          "next full capture.\n"
+          "\n"
+          "With --uring the /proc files of many processes are opened and\n"
+          "read in batches using io_uring, which cuts down the number of\n"
+          "system calls needed per process. If io_uring is not supported\n"
+          "by the kernel, the files are read one by one as usual.\n"
+          "\n"
+          "The output can be compressed on the fly (see --compress). The\n"
+          "compressed captures can be given to sp_smaps_filter as is.\n"
+          "\n"
+          "The capture can be limited to processes of interest using the\n"
+          "--pid, --match, --cgroup and --tree options. A process is\n"
+          "captured if it is selected by any of the given options. The\n"
+          "selection is made before the smaps data is read, so a targeted\n"
+          "capture is cheaper to take than a full one.\n"
+          "\n"
+          "Processes are read one after another, so the capture is not\n"
+          "a single point in time. Each process record has a '#Time'\n"
+          "line holding the CLOCK_MONOTONIC time when reading of its data\n"
+          "started, the header has the time reading started in '##Started'\n"
+          "and the capture ends with a '##Window' line telling how many\n"
+          "seconds it took to read all processes. Processes that make up\n"
+          "a service can be captured as one coherent point in time with\n"
+          "--freeze, which suspends the cgroups given with --cgroup via\n"
+          "cgroup.freeze for the duration of the capture. The cgroups are\n"
+          "thawed also if the tool exits on error or is terminated by a\n"
+          "signal; the cgroup of the tool itself can't be frozen.\n"
+          "\n"
+          "Pss only tells the proportional share of memory. In deep mode\n"
+          "(see --deep) the physical frames of every resident page are\n"
+          "looked up from /proc/pid/pagemap and their map counts from\n"
+          "/proc/kpagecount. Each mapping then gets an 'Uss' line holding\n"
+          "the memory in pages mapped only there, i.e. exact unique set\n"
+          "size. The frames of all captured processes are also collected\n"
+          "into a system wide set, and the capture ends with '##Resident'\n"
+          "telling the memory used by the captured processes with every\n"
+          "frame counted once, and '##Shared' telling how much of it is\n"
+          "mapped by more than one of the captured processes. Combined\n"
+          "with --cgroup this shows how much memory the workers of a\n"
+          "service really share.\n"
+          "\n"
+          "Processes with thousands of anonymous mappings make large\n"
+          "captures. In fold mode (see --fold) the mappings of each\n"
+          "process that have the same path and protection are summed up\n"
+          "into one record while parsing smaps. The record keeps the\n"
+          "address range of the first mapping and gets a 'Vmas' line\n"
+          "telling how many mappings were combined; when Vmas is above\n"
+          "one, the range covers only part of the memory in the record\n"
+          "and Size holds the total. Per path and type reports made by\n"
+          "sp_smaps_filter stay the same. The capture ends with\n"
+          "'##Folded' telling the mapping and record counts.\n"
+          "\n"
+          "Most reports need only a few of the smaps values. With\n"
+          "--fields only the listed ones are written for each mapping,\n"
+          "and the list is stored in '##Fields'. sp_smaps_filter treats\n"
+          "the others as absent: they are left out when the capture is\n"
+          "written again and left empty in csv output.\n"
+          "\n"
+          "Watch mode (see --watch) follows one process, e.g. when\n"
+          "chasing a leak. Its smaps_rollup file is kept open and re-read\n"
+          "at every --interval, and each sample is written as a line of\n"
+          "CLOCK_MONOTONIC time followed by Pss, Rss, Anonymous and Swap\n"
+          "in kB. Sampling stops after --count samples, when the process\n"
+          "exits or when the tool is terminated.\n"
+          "\n"
+          "Periodic captures rarely hit the moments of memory pressure.\n"
+          "With --trigger the tool stays resident like in daemon mode, but\n"
+          "registers a PSI trigger on /proc/pressure/memory and takes a\n"
+          "capture whenever the kernel reports the given stall time within\n"
+          "the window. The capture header has the trigger in '##Trigger'\n"
+          "and the pressure averages read right after the event in\n"
+          "'##Pressure'. Rollup, selection and output options apply as\n"
+          "usual.\n"
+          "\n"
+          "Reading smaps makes the kernel walk the page tables of the\n"
+          "process, while the plain mapping list in /proc/pid/maps is\n"
+          "cheap to read. In hybrid mode (see --hybrid) status is read\n"
+          "for every process first, and full smaps data is captured only\n"
+          "for processes whose VmRSS exceeds the given size or that are\n"
+          "among the given number of largest processes. The others get\n"
+          "their mappings without any memory usage values and a\n"
+          "'#Brief: 1' line in the process record. Kernel threads get\n"
+          "just the status values, no other files are opened for them.\n"
+          "The limits are recorded in the '##Hybrid' header line.\n"
+          "\n"
+          "To run captures continuously on latency sensitive hosts, use\n"
+          "--gentle. The tool then runs with SCHED_IDLE policy, nice 19\n"
+          "and idle io class, stays off cpus listed as isolated or\n"
+          "nohz_full in /sys/devices/system/cpu and yields the cpu after\n"
+          "each process. The cpus can be restricted further with --cpus.\n"
+          "The rate of reading can be limited with --byte-rate (smaps\n"
+          "data per second) and --proc-rate (processes per second); the\n"
+          "tool sleeps between processes as needed to stay within the\n"
+          "limits, which makes the capture take correspondingly longer.\n"
+          "\n"
+          "Under memory pressure reading smaps can become very slow. The\n"
+          "capture can be bounded with --deadline: once the given time\n"
+          "has passed since '##Started', the remaining processes are left\n"
+          "out. With a per process limit, reading smaps of a process is\n"
+          "stopped when it takes longer than that, and the process is\n"
+          "written with the mappings read so far. Such a capture ends\n"
+          "with a '##Partial' line telling the number of skipped and\n"
+          "truncated processes, followed by their pids in '##Skipped'\n"
+          "and '##Truncated' lines. sp_smaps_filter warns about partial\n"
+          "captures, as the totals computed from them are too low.\n"
+          "\n"
+          "Every capture starts with '##' prefixed header lines holding\n"
+          "information about the whole capture, such as time stamp.\n"
+          "Captures of all processes with full smaps data include\n"
+          "/proc/meminfo in the header too, one line per input line,\n"
+          "e.g. '##meminfo: MemTotal: 1021476 kB'. sp_smaps_filter uses\n"
+          "it to reconcile the memory used by the captured processes\n"
+          "with the memory used by the system. With --sysinfo every\n"
+          "capture gets meminfo, and also /proc/vmstat, /proc/slabinfo,\n"
+          "/proc/zoneinfo and /proc/buddyinfo. Slabinfo is usually\n"
+          "readable by root only and is skipped otherwise.\n"
+          "\n"
+          "With '--format binary' the capture is written in compact binary\n"
+          "form instead of text: file paths and other strings are stored\n"
+          "only once, and addresses and memory usage values are delta\n"
+          "encoded using variable length integers. Binary captures can be\n"
+          "read by sp_smaps_filter just like text captures, and converted\n"
+          "back to text with sp_smaps_flatten.\n"
+          "\n"
+          "With --stats the tool measures where the capture time goes and\n"
+          "appends the results to the capture as '##Stats' lines, which\n"
+          "are also written to stderr:\n"
+          "\n"
+          "  ##Stats: window <seconds>\n"
+          "  ##Stats: phase <name> wall <seconds> cpu <seconds>\n"
+          "  ##Stats: file <type> bytes <count> calls <count>\n"
+          "  ##Stats: slow <pid> <seconds> <bytes> <name>\n"
+          "\n"
+          "Window is the total time taken by the capture. Phase times\n"
+          "are summed over worker threads; the smaps phase covers reading\n"
+          "smaps data, i.e. the page table walks done by the kernel, and\n"
+          "capture covers everything else done for a process. File\n"
+          "statistics count data read and system calls made (io_uring\n"
+          "requests when using --uring) per /proc file type. The slow\n"
+          "lines list the processes whose smaps took longest to read.\n"
+          "sp_smaps_filter keeps these lines along with the other capture\n"
+          "header lines.\n"
+          "\n"
+          "With --shm the binary captures are published to local consumers\n"
+          "through a POSIX shared memory object instead of files. The object\n"
+          "holds a header followed by a ring of fixed size slots (see --ring\n"
+          "and --shm-slot); each capture is copied into the slot after the\n"
+          "most recent one. Every slot has a sequence counter that is odd\n"
+          "while the slot is being rewritten, so readers never need to take\n"
+          "locks: they parse the capture in place and then check that the\n"
+          "counter is unchanged. The libsmapsring.a reader library and\n"
+          "smapsring.h implement this and iterate over the process and\n"
+          "mapping records without copying them.\n"
+          "\n"
+          "With --serve the tool stays resident and takes captures on\n"
+          "request from local clients connecting to a unix domain socket,\n"
+          "which saves the process startup and lets several tools share\n"
+          "one capture. Only the owner of the socket may connect. Each\n"
+          "connection carries one request line, and the reply is the\n"
+          "capture in the selected format, followed by end of file:\n"
+          "\n"
+          "  capture [<max-age>]\n"
+          "    Capture the processes selected on the command line. With\n"
+          "    max-age, the previous capture is sent again if it was taken\n"
+          "    at most that many seconds ago.\n"
+          "  rollup <pid>[,<pid>...]\n"
+          "    Capture smaps_rollup totals of the given processes.\n"
+          "  cgroup <path>\n"
+          "    Capture the processes in the given cgroup.\n"
+          "\n"
+          "Failed requests get a single '##Error: <reason>' line. Requests\n"
+          "are served one at a time.\n"
           )
   MAN_ADD("OPTIONS", 0)
 
@@ -114,6 +344,49 @@ static const manual_t app_man[]=
           "\n"
           "  Collects /proc/*/smaps files from all running processes, and writes the\n"
           "  result to 'after_boot.cap'.\n"
+          "\n"
+          "% "TOOL_NAME" --rollup -o totals.cap\n"
+          "\n"
+          "  Collects only per process memory usage totals, suitable for\n"
+          "  example for sp_smaps_appvals.\n"
+          "\n"
+          "% "TOOL_NAME" --interval 5 --ring 120 -o /var/tmp/smaps.cap\n"
+          "\n"
+          "  Takes a capture every 5 seconds, keeping the last 10 minutes\n"
+          "  worth of captures in /var/tmp/smaps-000.cap ... smaps-119.cap\n"
+          "\n"
+          "% "TOOL_NAME" -F binary -o snapshot.bin\n"
+          "\n"
+          "  Writes the capture in binary format.\n"
+          "\n"
+          "% "TOOL_NAME" --interval 10 --shm sp-smaps --ring 4\n"
+          "\n"
+          "  Publishes a capture every 10 seconds in /dev/shm/sp-smaps,\n"
+          "  keeping the last 4 of them.\n"
+          "\n"
+          "% "TOOL_NAME" --serve /run/sp-smaps.sock &\n"
+          "% echo 'rollup 1234,1240' | nc -U /run/sp-smaps.sock > pids.cap\n"
+          "\n"
+          "  Starts the capture service and asks it for the totals of two\n"
+          "  processes.\n"
+          "\n"
+          "% "TOOL_NAME" --cgroup system.slice/dbus.service --tree 1234\n"
+          "\n"
+          "  Captures processes in the dbus service cgroup, and process 1234\n"
+          "  together with all of its descendants.\n"
+          "\n"
+          "% "TOOL_NAME" --freeze --cgroup system.slice/foo.service\n"
+          "\n"
+          "  Captures the processes of foo.service while it is frozen.\n"
+          "\n"
+          "% "TOOL_NAME" --watch 1234 --interval 0.01 -o leak.txt\n"
+          "\n"
+          "  Samples the memory use of process 1234 at 100 Hz.\n"
+          "\n"
+          "% "TOOL_NAME" --trigger some,200,2000 --rollup -o /var/tmp/psi.cap\n"
+          "\n"
+          "  Captures process totals whenever tasks have been stalled on\n"
+          "  memory for 200 ms within two seconds, at most every 30 seconds.\n"
           )
   MAN_ADD("COPYRIGHT",
           "Copyright (C) 2004-2007,2009,2011 Nokia Corporation.\n\n"
@@ -144,6 +417,37 @@ enum
 
   opt_output,
   opt_realtime,
+  opt_jobs,
+  opt_rollup,
+  opt_sysinfo,
+  opt_interval,
+  opt_trigger,
+  opt_count,
+  opt_ring,
+  opt_format,
+  opt_uring,
+  opt_compress,
+  opt_pid,
+  opt_match,
+  opt_cgroup,
+  opt_tree,
+  opt_incremental,
+  opt_stats,
+  opt_freeze,
+  opt_deep,
+  opt_hybrid,
+  opt_gentle,
+  opt_cpus,
+  opt_byte_rate,
+  opt_proc_rate,
+  opt_deadline,
+  opt_shm,
+  opt_shm_slot,
+  opt_serve,
+  opt_proc_root,
+  opt_fold,
+  opt_fields,
+  opt_watch,
 };
 
 static const option_t app_opt[] =
@@ -184,6 +488,170 @@ static const option_t app_opt[] =
           "r", "realtime", 0,
           "Use realtime priority (needs to be run as root for this)" ),
 
+  OPT_ADD(opt_jobs,
+          "j", "jobs", "<count>",
+          "Number of worker threads used for reading /proc data.\n"
+          "Zero selects one worker per online cpu, at most four per\n"
+          "cpu are used. Default is 1.\n" ),
+
+  OPT_ADD(opt_rollup,
+          "R", "rollup", 0,
+          "Capture /proc/pid/smaps_rollup totals instead of\n"
+          "per mapping smaps data.\n" ),
+
+  OPT_ADD(opt_sysinfo,
+          "y", "sysinfo", 0,
+          "Include /proc/vmstat, slabinfo, zoneinfo and buddyinfo in\n"
+          "the capture header, and /proc/meminfo also in rollup and\n"
+          "targeted captures.\n" ),
+
+  OPT_ADD(opt_interval,
+          "i", "interval", "<seconds>",
+          "Stay resident and take a capture at given interval.\n"
+          "Requires output path to be specified.\n" ),
+
+  OPT_ADD(opt_trigger,
+          "T", "trigger", "<some|full>,<stall ms>,<window ms>[,<cooldown s>]",
+          "Stay resident and take a capture whenever memory pressure\n"
+          "reaches the given stall time within the window, see\n"
+          "/proc/pressure/memory. Later events are ignored until the\n"
+          "cooldown, 30 seconds by default, has passed. Requires output\n"
+          "path or --shm to be specified.\n" ),
+
+  OPT_ADD(opt_count,
+          "c", "count", "<captures>",
+          "Number of captures to take in daemon mode.\n"
+          "Zero means until terminated. Default is 0.\n" ),
+
+  OPT_ADD(opt_ring,
+          "n", "ring", "<files>",
+          "Number of capture files kept in daemon mode, or\n"
+          "shared memory slots with --shm.\n"
+          "Default is 10.\n" ),
+
+  OPT_ADD(opt_format,
+          "F", "format", "<text|binary>",
+          "Capture file format. Default is text.\n" ),
+
+  OPT_ADD(opt_uring,
+          "u", "uring", 0,
+          "Read /proc files in batches using io_uring, if available.\n"
+          "Used only with a single worker.\n" ),
+
+  OPT_ADD(opt_compress,
+          "z", "compress", "<gzip|zstd>",
+          "Compress output using given method. Support for zstd\n"
+          "depends on build configuration.\n" ),
+
+  OPT_ADD(opt_pid,
+          "p", "pid", "<pid[,pid...]>",
+          "Capture given processes.\n" ),
+
+  OPT_ADD(opt_match,
+          "m", "match", "<regex>",
+          "Capture processes whose name or command line matches\n"
+          "given extended regular expression.\n" ),
+
+  OPT_ADD(opt_cgroup,
+          "g", "cgroup", "<path>",
+          "Capture processes listed in cgroup.procs of given cgroup\n"
+          "v2 directory. Relative paths are taken to be relative to\n"
+          "/sys/fs/cgroup.\n" ),
+
+  OPT_ADD(opt_tree,
+          "t", "tree", "<pid>",
+          "Capture given process and all of its descendants.\n" ),
+
+  OPT_ADD(opt_incremental,
+          "I", "incremental", "<captures>",
+          "In daemon mode, take a full capture only every Nth time and\n"
+          "refer to the previous capture for unchanged processes in\n"
+          "the others. The ring must hold at least N captures.\n" ),
+
+  OPT_ADD(opt_stats,
+          "S", "stats", "<count>",
+          "Collect capture cost statistics, list given number of\n"
+          "slowest processes. The statistics are appended to the\n"
+          "capture and written to stderr.\n" ),
+
+  OPT_ADD(opt_freeze,
+          "f", "freeze", 0,
+          "Freeze cgroups given with --cgroup while capturing, so\n"
+          "that their processes are captured at the same point in\n"
+          "time. Requires cgroup v2.\n" ),
+
+  OPT_ADD(opt_deep,
+          "D", "deep", 0,
+          "Resolve exact page sharing using pagemap and kpagecount.\n"
+          "Adds Uss to every mapping. Needs root.\n" ),
+
+  OPT_ADD(opt_fold,
+          "l", "fold", 0,
+          "Sum up the mappings of each process that have the same\n"
+          "path and protection into one record with a Vmas count.\n" ),
+
+  OPT_ADD(opt_fields,
+          "K", "fields", "<field[,field...]>",
+          "Write only the given smaps fields, e.g. Size,Rss,Pss,\n"
+          "Private_Dirty. Other values of the mappings are dropped.\n" ),
+
+  OPT_ADD(opt_watch,
+          "w", "watch", "<pid>",
+          "Sample Pss, Rss, Anonymous and Swap of one process at the\n"
+          "given --interval (default 0.1 seconds) as one text line per\n"
+          "sample, until --count samples are taken or the process exits.\n" ),
+
+  OPT_ADD(opt_hybrid,
+          "H", "hybrid", "<kB>[,<count>]",
+          "Read smaps only for processes whose VmRSS exceeds given\n"
+          "size, or that are among the given number of largest ones.\n"
+          "Other processes get the plain mapping list from maps.\n"
+          "Zero size selects only by count.\n" ),
+
+  OPT_ADD(opt_gentle,
+          "G", "gentle", 0,
+          "Use idle cpu & io priority, avoid isolated cpus and yield\n"
+          "between processes, to minimize impact on other tasks.\n" ),
+
+  OPT_ADD(opt_cpus,
+          "C", "cpus", "<list>",
+          "Run only on given cpus, e.g. '0-1,4'. Isolated and\n"
+          "nohz_full cpus are left out.\n" ),
+
+  OPT_ADD(opt_byte_rate,
+          "B", "byte-rate", "<bytes>[k|M|G]",
+          "Limit smaps data read per second.\n" ),
+
+  OPT_ADD(opt_proc_rate,
+          "P", "proc-rate", "<count>",
+          "Limit processes captured per second.\n" ),
+
+  OPT_ADD(opt_deadline,
+          "d", "deadline", "<seconds>[,<seconds>]",
+          "Stop reading new processes once the capture has taken\n"
+          "given time. The optional second value limits the time\n"
+          "spent reading smaps of a single process.\n" ),
+
+  OPT_ADD(opt_shm,
+          "M", "shm", "<name>",
+          "Publish binary captures in a ring of slots in the named\n"
+          "POSIX shared memory object instead of output files.\n"
+          "The slot count is given with --ring.\n" ),
+
+  OPT_ADD(opt_shm_slot,
+          "Z", "shm-slot", "<bytes>[k|M|G]",
+          "Size of a shared memory ring slot. Default is 8M.\n" ),
+
+  OPT_ADD(opt_serve,
+          "e", "serve", "<socket>",
+          "Stay resident and answer capture requests made over\n"
+          "the given unix domain socket.\n" ),
+
+  OPT_ADD(opt_proc_root,
+          "x", "proc-root", "<dir>",
+          "Read process data from given directory instead of /proc,\n"
+          "e.g. a tree made with sp_smaps_fakeproc for benchmarks.\n" ),
+
   OPT_END
 };
 
@@ -200,11 +668,74 @@ static const option_t app_opt[] =
                          * file system block size. */
 
 static const char *outfile = 0;
+static int         realtime = 0;      // --realtime given
+static int         workers = 1;
+static const char *smaps   = "smaps"; // or "smaps_rollup"
+static double      interval = 0;      // daemon mode capture interval
+static unsigned    captures = 0;      // daemon mode capture count
+static unsigned    ring     = 10;     // daemon mode capture file count
+static int         binary   = 0;      // write binary capture format
+static long        sequence = -1;     // daemon mode capture number
+static int         use_uring = 0;     // batch /proc reads via io_uring
+static int         sysinfo  = 0;      // all system statistics to header
+
+enum
+{
+  COMPRESS_NONE,
+  COMPRESS_GZIP,
+  COMPRESS_ZSTD,
+};
+
+static int         compression = COMPRESS_NONE;
+
+static const char  cgroup_root[] = "/sys/fs/cgroup";
+
+static unsigned    incr_every    = 0;  // full capture interval, 0 = off
+static const char *incr_base     = 0;  // previous capture file, if
+static long        incr_base_seq = -1; // current capture is incremental
+
+static uint64_t    capture_started = 0; // CLOCK_MONOTONIC at capture start
+
+static int         stats         = 0;  // collect capture statistics
+static unsigned    stats_slowest = 0;  // number of slowest pids listed
+
+static int         hybrid        = 0;  // smaps only for large processes
+static unsigned long hybrid_rss  = 0;  // VmRSS threshold in kB, 0 = none
+static unsigned    hybrid_top    = 0;  // number of largest always detailed
+
+static double      deadline      = 0;  // capture time budget, 0 = none
+static double      deadline_proc = 0;  // smaps read limit per process
+
+static int         fold          = 0;  // aggregate mappings by path & prot
+
+static int         watch_pid     = 0;  // process sampled in watch mode
+
+static const char *trigger_kind  = 0;  // "some" or "full" pressure trigger
+static unsigned    trigger_stall = 0;  // stall time in window, ms
+static unsigned    trigger_window = 0; // trigger window, ms
+static double      trigger_cooldown = 30; // seconds between captures
+static char        trigger_label[256]; // pressure at last trigger event
+
+static const char *shm_name      = 0;  // shared memory ring object
+static uint64_t    shm_slot_size = 8<<20; // bytes per ring slot
+
+static volatile sig_atomic_t terminate = 0;
 
 /* ========================================================================= *
  * Utility functions
  * ========================================================================= */
 
+/* ------------------------------------------------------------------------- *
+ * clock_nsec  --  read clock as nanoseconds
+ * ------------------------------------------------------------------------- */
+
+static uint64_t clock_nsec(clockid_t id)
+{
+  struct timespec ts;
+  clock_gettime(id, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
 /* ------------------------------------------------------------------------- *
  * use_maximum_priority  --  to get stable results for MT apps
  * ------------------------------------------------------------------------- */
@@ -299,495 +830,5945 @@ static void write_all_or_exit(int fd, const void *data, size_t size)
   }
 }
 
+/* ------------------------------------------------------------------------- *
+ * parse_bytes  --  parse byte count with optional k, M or G suffix
+ * ------------------------------------------------------------------------- */
+
+static uint64_t parse_bytes(const char *par, const char *what)
+{
+  char     *end = (char *)par;
+  uint64_t  val = strtoull(par, &end, 10);
+
+  switch( *end )
+  {
+  case 'G': val <<= 10; /* fall through */
+  case 'M': val <<= 10; /* fall through */
+  case 'k': val <<= 10; ++end; break;
+  }
+  if( end == par || *end != 0 )
+  {
+    msg_fatal("invalid %s: '%s'\n", what, par);
+  }
+  return val;
+}
+
 /* ========================================================================= *
- * Buffered Output
+ * Capture Statistics
  * ========================================================================= */
 
+enum
+{
+  STATS_ENUMERATE,
+  STATS_SELECT,
+  STATS_PREFETCH,
+  STATS_CAPTURE,
+  STATS_SMAPS,
+  STATS_OUTPUT,
+  STATS_PHASES
+};
+
+static const char * const stats_phase_name[STATS_PHASES] =
+{
+  "enumerate", "select", "prefetch", "capture", "smaps", "output",
+};
+
+enum
+{
+  STATS_FILE_DIR,
+  STATS_FILE_EXE,
+  STATS_FILE_CMDLINE,
+  STATS_FILE_STATUS,
+  STATS_FILE_SMAPS,
+  STATS_FILE_MAPS,
+  STATS_FILE_OTHER,
+  STATS_FILES
+};
+
+static const char * const stats_file_name[STATS_FILES] =
+{
+  "dir", "exe", "cmdline", "status", "smaps", "maps", "other",
+};
+
+/* Updated from worker threads, use atomic adds */
+static uint64_t stats_phase_wall[STATS_PHASES];
+static uint64_t stats_phase_cpu[STATS_PHASES];
+static uint64_t stats_file_bytes[STATS_FILES];
+static uint64_t stats_file_calls[STATS_FILES];
+
 /* ------------------------------------------------------------------------- *
- * output_buff  --  writes to stdout done via this
+ * statslow_t  --  slowest smaps reads, updated only from main thread
  * ------------------------------------------------------------------------- */
 
-static int    output_fd = -1;
-static char   output_buff[TXBUFF];
-static size_t output_offs = 0;
+typedef struct statslow_t
+{
+  int      pid;
+  uint64_t nsec;
+  size_t   bytes;
+  char     name[64];
+} statslow_t;
+
+static statslow_t *stats_slow       = 0;
+static unsigned    stats_slow_count = 0;
 
 /* ------------------------------------------------------------------------- *
- * output_space  --  return space available in output buffer
+ * statclock_t  --  start time of measured phase
  * ------------------------------------------------------------------------- */
 
-static size_t output_space(int force_flush)
+typedef struct statclock_t
 {
-  if( output_offs != 0 )
-  {
-    if( output_offs == sizeof output_buff || force_flush )
-    {
-      if( output_fd == -1 )
-      {
-        output_fd = STDOUT_FILENO;
-
-        if( outfile != 0 )
-        {
-          int fd = open(outfile, O_WRONLY|O_CREAT|O_TRUNC, 0666);
-          if( fd == -1 )
-          {
-            msg_error("%s: %s\n(using stdout)", outfile, strerror(errno));
-          }
-          else
-          {
-            output_fd = fd;
-          }
-        }
-      }
+  uint64_t wall;
+  uint64_t cpu;
+} statclock_t;
 
-      write_all_or_exit(output_fd, output_buff, output_offs);
-      output_offs = 0;
-    }
+static void statclock_start(statclock_t *self)
+{
+  if( stats )
+  {
+    self->wall = clock_nsec(CLOCK_MONOTONIC);
+    self->cpu  = clock_nsec(CLOCK_THREAD_CPUTIME_ID);
   }
-  return sizeof output_buff - output_offs;
 }
 
 /* ------------------------------------------------------------------------- *
- * output_raw  --  queue output
+ * statclock_stop  --  add time since start to phase, return wall time
  * ------------------------------------------------------------------------- */
 
-static void output_raw(const void *data, size_t size)
+static uint64_t statclock_stop(statclock_t *self, int phase)
 {
-  const char *pos = data;
-  const char *end = pos + size;
+  uint64_t wall = 0;
 
-  while( pos < end )
+  if( stats )
   {
-    size_t count = end - pos;
-    size_t space = output_space(0);
-
-    if( count > space ) count = space;
-
-    memcpy(output_buff + output_offs, pos, count);
+    uint64_t cpu = clock_nsec(CLOCK_THREAD_CPUTIME_ID) - self->cpu;
 
-    output_offs += count;
-    pos += count;
+    wall = clock_nsec(CLOCK_MONOTONIC) - self->wall;
+    __atomic_fetch_add(&stats_phase_wall[phase], wall, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats_phase_cpu[phase], cpu, __ATOMIC_RELAXED);
   }
+  return wall;
 }
 
 /* ------------------------------------------------------------------------- *
- * output_fmt  --  queue formatted output
+ * stats_file  --  account data read & system calls made for /proc file
  * ------------------------------------------------------------------------- */
 
-static void output_fmt(const char *fmt, ...)
+static void stats_file(const char *name, size_t bytes, size_t calls)
 {
-  char temp[1<<10];
-  char *work = temp;
+  int type = STATS_FILE_OTHER;
+  const char *base;
 
-  va_list va;
-  size_t  n;
+  if( !stats )
+  {
+    return;
+  }
 
-  va_start(va, fmt);
-  n = vsnprintf(work, sizeof temp, fmt, va);
-  va_end(va);
+  /* "pid/status" when read relative to /proc */
+  if( (base = strrchr(name, '/')) != 0 )
+  {
+    name = base + 1;
+  }
 
-  if( n > sizeof temp )
+  if( !strcmp(name, "dir") )
   {
-    work = alloca(n);
-    va_start(va, fmt);
-    vsnprintf(work, n, fmt, va);
-    va_end(va);
+    type = STATS_FILE_DIR;
+  }
+  else if( !strcmp(name, "exe") )
+  {
+    type = STATS_FILE_EXE;
+  }
+  else if( !strcmp(name, "cmdline") )
+  {
+    type = STATS_FILE_CMDLINE;
+  }
+  else if( !strcmp(name, "status") )
+  {
+    type = STATS_FILE_STATUS;
+  }
+  else if( !strncmp(name, "smaps", 5) )
+  {
+    type = STATS_FILE_SMAPS;
+  }
+  else if( !strcmp(name, "maps") )
+  {
+    type = STATS_FILE_MAPS;
   }
 
-  output_raw(work, n);
+  __atomic_fetch_add(&stats_file_bytes[type], bytes, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&stats_file_calls[type], calls, __ATOMIC_RELAXED);
 }
 
 /* ------------------------------------------------------------------------- *
- * output_file  --  queue file contents to output
+ * stats_slow_add  --  remember process if among the slowest to read
  * ------------------------------------------------------------------------- */
 
-static size_t output_file(const char *path)
+static void stats_slow_add(int pid, uint64_t nsec, size_t bytes,
+                           const char *name)
 {
-  size_t cnt = 0;
-  char temp[RXBUFF];
-  int file = open(path,O_RDONLY);
+  unsigned i;
 
-  if( file == -1 )
+  if( !stats || stats_slowest == 0 )
   {
-    msg_error("%s: %s\n", path, strerror(errno));
-    goto cleanup;
+    return;
   }
 
-  for( ;; )
+  if( stats_slow == 0 &&
+      (stats_slow = calloc(stats_slowest, sizeof *stats_slow)) == 0 )
   {
-    int rc = read(file, temp, sizeof temp);
+    msg_fatal("stats: %s\n", strerror(errno));
+  }
 
-    if( rc == 0 )
+  /* keep the list in descending order, drop the fastest if full */
+  for( i = stats_slow_count; i > 0 && stats_slow[i-1].nsec < nsec; --i )
+  {
+    if( i < stats_slowest )
     {
-      break;
+      stats_slow[i] = stats_slow[i-1];
     }
-
-    if( rc == -1 )
+  }
+  if( i < stats_slowest )
+  {
+    stats_slow[i].pid   = pid;
+    stats_slow[i].nsec  = nsec;
+    stats_slow[i].bytes = bytes;
+    snprintf(stats_slow[i].name, sizeof stats_slow[i].name, "%s",
+             name ? name : "unknown");
+    if( stats_slow_count < stats_slowest )
     {
-      switch( errno )
-      {
-      case EAGAIN:
-      case EINTR:
-        continue;
-
-      default:
-        perror(path);
-        goto cleanup;
-      }
+      ++stats_slow_count;
     }
-
-    output_raw(temp, rc);
-    cnt += rc;
   }
+}
 
-  cleanup:
+/* ------------------------------------------------------------------------- *
+ * stats_reset  --  clear statistics before capture
+ * ------------------------------------------------------------------------- */
 
-  if( file != -1 ) close(file);
-  return cnt;
+static void stats_reset(void)
+{
+  memset(stats_phase_wall, 0, sizeof stats_phase_wall);
+  memset(stats_phase_cpu,  0, sizeof stats_phase_cpu);
+  memset(stats_file_bytes, 0, sizeof stats_file_bytes);
+  memset(stats_file_calls, 0, sizeof stats_file_calls);
+  stats_slow_count = 0;
 }
 
 /* ------------------------------------------------------------------------- *
- * input_file  --  read file contents, terminate with '\0'
+ * input_error  --  report error about file "where/name"
  * ------------------------------------------------------------------------- */
 
-static size_t input_file(const char *path, void *pdata, size_t *psize)
+static void input_error(const char *where, const char *name, int err)
 {
+  /* kernel threads have no memory map: their smaps is just empty, but
+   * smaps_rollup fails with ESRCH -> treat it as empty file too */
+  if( err == ESRCH && !strcmp(name, "smaps_rollup") )
+  {
+    return;
+  }
 
-  size_t  done = 0;
-  char   *data = *(char **)pdata;
-  size_t  size = *psize;
-  int     file = -1;
+  if( where != 0 )
+  {
+    msg_error("%s/%s: %s\n", where, name, strerror(err));
+  }
+  else
+  {
+    msg_error("%s: %s\n", name, strerror(err));
+  }
+}
 
-  if( (file = open(path,O_RDONLY)) == -1 )
+/* ------------------------------------------------------------------------- *
+ * input_open  --  open file relative to directory fd for reading
+ *
+ * Use AT_FDCWD & full path as name for normal files. The where string
+ * is used only for error messages. If the directory could not be
+ * opened (dir is -1), the error has been reported already.
+ * ------------------------------------------------------------------------- */
+
+static int input_open(int dir, const char *where, const char *name)
+{
+  int file = -1;
+
+  if( dir != -1 && (file = openat(dir, name, O_RDONLY|O_CLOEXEC)) == -1 )
   {
-    msg_error("%s: %s\n", path, strerror(errno));
-    goto cleanup;
+    input_error(where, name, errno);
   }
+  return file;
+}
 
-  for( ;; )
+/* ========================================================================= *
+ * Buffered Output
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * output_buff  --  writes to stdout done via this
+ * ------------------------------------------------------------------------- */
+
+static int    output_fd = -1;
+static char   output_buff[TXBUFF];
+static size_t output_offs = 0;
+static int    output_zerocopy = 1; // try sendfile() for smaps data
+
+static z_stream      output_gzip;
+#ifdef HAVE_ZSTD
+static ZSTD_CStream *output_zstd = 0;
+#endif
+
+/* ------------------------------------------------------------------------- *
+ * output_write  --  write data to output file, compressing if needed
+ * ------------------------------------------------------------------------- */
+
+static void output_write(const void *data, size_t size, int finish)
+{
+  unsigned char temp[TXBUFF];
+
+  switch( compression )
   {
-    if( size - done < 0x1000 )
+  case COMPRESS_GZIP:
+    output_gzip.next_in  = (unsigned char *)data;
+    output_gzip.avail_in = size;
+    do
     {
-      if( (data = realloc(data, (size += 0x1000))) == 0 )
+      output_gzip.next_out  = temp;
+      output_gzip.avail_out = sizeof temp;
+      if( deflate(&output_gzip, finish ? Z_FINISH : Z_NO_FLUSH) == Z_STREAM_ERROR )
       {
-        msg_fatal("%s: %s\n", path, strerror(errno));
+        msg_fatal("deflate: %s\n", output_gzip.msg ? output_gzip.msg : "stream error");
       }
-    }
-
-    ssize_t rc = read(file, data + done, size - done);
+      write_all_or_exit(output_fd, temp, sizeof temp - output_gzip.avail_out);
+    } while( output_gzip.avail_out == 0 );
+    break;
 
-    if( rc == -1 )
+#ifdef HAVE_ZSTD
+  case COMPRESS_ZSTD:
     {
-      switch( errno )
-      {
-      case EAGAIN:
-      case EINTR:
-        continue;
+      ZSTD_inBuffer in = { data, size, 0 };
+      size_t        rc;
 
-      default:
-        msg_error("%s: %s\n", path, strerror(errno));
-        goto cleanup;
-      }
-    }
+      do
+      {
+        ZSTD_outBuffer out = { temp, sizeof temp, 0 };
 
-    if( rc == 0 )
-    {
-      break;
+        rc = ZSTD_compressStream2(output_zstd, &out, &in,
+                                  finish ? ZSTD_e_end : ZSTD_e_continue);
+        if( ZSTD_isError(rc) )
+        {
+          msg_fatal("zstd: %s\n", ZSTD_getErrorName(rc));
+        }
+        write_all_or_exit(output_fd, temp, out.pos);
+      } while( finish ? rc != 0 : in.pos < in.size );
     }
+    break;
+#endif
 
-    done += (size_t)rc;
+  default:
+    write_all_or_exit(output_fd, data, size);
+    break;
   }
+}
 
-  cleanup:
+/* ------------------------------------------------------------------------- *
+ * output_open  --  direct output to file, or stdout if path is NULL
+ * ------------------------------------------------------------------------- */
 
-  if( file != -1 )
-  {
-    close(file);
+static void output_attach(int fd);
+
+static int output_open(const char *path)
+{
+  int fd = STDOUT_FILENO;
+
+  if( path != 0 && (fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1 )
+  {
+    msg_error("%s: %s\n", path, strerror(errno));
+    return -1;
   }
+  output_attach(fd);
+  return 0;
+}
 
-  if( done == size )
+/* ------------------------------------------------------------------------- *
+ * output_attach  --  direct output to already open file descriptor
+ * ------------------------------------------------------------------------- */
+
+static void output_attach(int fd)
+{
+  output_fd = fd;
+
+  switch( compression )
   {
-    if( (data = realloc(data, (size += 1))) == 0 )
+  case COMPRESS_GZIP:
+    memset(&output_gzip, 0, sizeof output_gzip);
+    if( deflateInit2(&output_gzip, Z_BEST_SPEED, Z_DEFLATED,
+                     15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK )
     {
-      msg_fatal("%s: %s\n", path, strerror(errno));
+      msg_fatal("deflateInit: %s\n", output_gzip.msg ? output_gzip.msg : "failed");
+    }
+    break;
+
+#ifdef HAVE_ZSTD
+  case COMPRESS_ZSTD:
+    if( output_zstd == 0 && (output_zstd = ZSTD_createCStream()) == 0 )
+    {
+      msg_fatal("zstd: unable to create stream\n");
     }
+    ZSTD_CCtx_reset(output_zstd, ZSTD_reset_session_only);
+    ZSTD_CCtx_setParameter(output_zstd, ZSTD_c_compressionLevel, 3);
+    break;
+#endif
   }
-  data[done] = 0;
+}
 
-  *(char **)pdata = data;
-  *psize = size;
+/* ------------------------------------------------------------------------- *
+ * output_space  --  return space available in output buffer
+ * ------------------------------------------------------------------------- */
 
-  return done;
+static void output_ensure_open(void)
+{
+  if( output_fd == -1 && output_open(outfile) == -1 )
+  {
+    msg_error("(using stdout)\n");
+    output_open(0);
+  }
 }
 
-#define uc(c) ((unsigned char)(c))
-#define wc(c) ((c)>0 && (c)<33)
-#define bc(c) (uc(c)>32)
+static size_t output_space(int force_flush)
+{
+  if( output_offs != 0 )
+  {
+    if( output_offs == sizeof output_buff || force_flush )
+    {
+      output_ensure_open();
 
-static char *strip(char *str)
+      output_write(output_buff, output_offs, 0);
+      output_offs = 0;
+    }
+  }
+  return sizeof output_buff - output_offs;
+}
+
+/* ------------------------------------------------------------------------- *
+ * output_close  --  flush buffered output & close output file
+ * ------------------------------------------------------------------------- */
+
+static int output_close(void)
 {
-  char *src = str;
-  char *dst = str;
+  int err = 0;
 
-  while( wc(*src) ) ++src;
+  output_space(1);
 
-  for( ;; )
+  if( output_fd != -1 && compression != COMPRESS_NONE )
   {
-    if( bc(*src) )
+    output_write(0, 0, 1);
+    if( compression == COMPRESS_GZIP )
     {
-      *dst++ = *src++;
-      continue;
+      deflateEnd(&output_gzip);
     }
+  }
 
-    while( wc(*src) ) ++src;
-
-    if( *src == 0 ) break;
-
-    *dst++ = ' ';
+  if( output_fd != -1 && output_fd != STDOUT_FILENO )
+  {
+    if( close(output_fd) == -1 )
+    {
+      msg_error("close: %s\n", strerror(errno));
+      err = -1;
+    }
   }
-  *dst = 0;
-  return str;
+  output_fd = -1;
+  return err;
 }
 
-static char *token(char **ppos, int sep)
+/* ------------------------------------------------------------------------- *
+ * output_raw  --  queue output
+ * ------------------------------------------------------------------------- */
+
+static void output_raw(const void *data, size_t size)
 {
-  char *beg = *ppos;
+  const char *pos = data;
+  const char *end = pos + size;
 
-  if( sep < 0 )
+  while( pos < end )
   {
-    while( wc(*beg) ) ++beg;
+    size_t count = end - pos;
+    size_t space = output_space(0);
+
+    if( count > space ) count = space;
+
+    memcpy(output_buff + output_offs, pos, count);
+
+    output_offs += count;
+    pos += count;
   }
+}
 
-  char *end = beg;
+/* ------------------------------------------------------------------------- *
+ * output_writev  --  write queued output followed by data in one go
+ * ------------------------------------------------------------------------- */
 
-  for( ; *end; ++end )
+static void output_writev(const void *data, size_t size)
+{
+  struct iovec iov[2] =
   {
-    //printf("??? '%c' vs '%c'\n", (sep<0) ? '?' : sep, *end);
-    if( ((sep<0) && wc(*end)) || (uc(*end) == uc(sep)) )
+    { output_buff, output_offs },
+    { (void *)data, size },
+  };
+  struct iovec *pos = iov;
+  int           cnt = 2;
+
+  output_ensure_open();
+
+  while( cnt > 0 )
+  {
+    ssize_t put = writev(output_fd, pos, cnt);
+
+    if( put == -1 )
     {
-      *end++ = 0; break;
+      switch( errno )
+      {
+      case EAGAIN:
+      case EINTR:
+        continue;
+
+      default:
+        msg_fatal("write error: %s\n", strerror(errno));
+      }
+    }
+
+    while( cnt > 0 && (size_t)put >= pos->iov_len )
+    {
+      put -= pos->iov_len, ++pos, --cnt;
+    }
+    if( cnt > 0 )
+    {
+      pos->iov_base = (char *)pos->iov_base + put;
+      pos->iov_len -= put;
     }
   }
-  *ppos = end;
-  return strip(beg);
+  output_offs = 0;
 }
 
-typedef struct proc_pid_status_t {
-  char *Name;
-  char *Pid;
-  char *PPid;
-  char *Threads;
-  char *FDSize;
-  char *VmPeak;
-  char *VmSize;
-  char *VmLck;
-  char *VmHWM;
-  char *VmRSS;
-  char *VmData;
-  char *VmStk;
-  char *VmExe;
-  char *VmLib;
-  char *VmPTE;
-
-} proc_pid_status_t;
+/* ------------------------------------------------------------------------- *
+ * output_file  --  copy file contents to output
+ *
+ * If the kernel allows it, the data is moved from file to output
+ * with sendfile() without going through user space. Otherwise the
+ * file is read directly into the output buffer.
+ * ------------------------------------------------------------------------- */
 
-static void
-proc_pid_status_parse(proc_pid_status_t *self, char *data)
+static size_t output_file(int dir, const char *where, const char *name)
 {
-  static char empty[1] = "";
+  size_t cnt   = 0;
+  size_t calls = 1;
+  int    file  = input_open(dir, where, name);
 
-  memset(self, 0, sizeof *self);
+  if( file == -1 )
+  {
+    goto cleanup;
+  }
 
-  self->Name    = empty;
-  self->Pid     = "0";
-  self->PPid    = "0";
-  self->Threads = "0";
+  if( output_zerocopy )
+  {
+    output_space(1);
+    output_ensure_open();
 
-  while( *data )
+    for( ;; )
+    {
+      ssize_t rc = sendfile(output_fd, file, 0, 1<<20);
+
+      ++calls;
+      if( rc > 0 )
+      {
+        cnt += rc;
+        continue;
+      }
+      if( rc == 0 )
+      {
+        goto cleanup;
+      }
+      if( errno == EINTR || errno == EAGAIN )
+      {
+        continue;
+      }
+      if( cnt == 0 && (errno == EINVAL || errno == ENOSYS) )
+      {
+        /* /proc file or output does not support it, do not
+         * try again for the rest of the run */
+        msg_progress("sendfile: %s (using buffered output)\n",
+                     strerror(errno));
+        output_zerocopy = 0;
+        break;
+      }
+      input_error(where, name, errno);
+      goto cleanup;
+    }
+  }
+
+  for( ;; )
   {
-    char *row = token(&data, '\n');
-    char *key = token(&row, ':');
+    size_t  space = output_space(0);
+    ssize_t rc    = read(file, output_buff + output_offs, space);
 
-    if( !strcmp(key, "Name") )
+    ++calls;
+
+    if( rc == 0 )
     {
-      self->Name = strip(row);
+      break;
     }
-#define X(v) else if( !strcmp(key, #v) ) { self->v = token(&row, -1); }
-    X(Pid)
-    X(PPid)
-    X(Threads)
-    X(FDSize)
-    X(VmPeak)
-    X(VmSize)
-    X(VmLck)
-    X(VmHWM)
-    X(VmRSS)
-    X(VmData)
-    X(VmStk)
-    X(VmExe)
-    X(VmLib)
-    X(VmPTE)
-#undef X
+
+    if( rc == -1 )
+    {
+      switch( errno )
+      {
+      case EAGAIN:
+      case EINTR:
+        continue;
+
+      default:
+        input_error(where, name, errno);
+        goto cleanup;
+      }
+    }
+
+    output_offs += rc;
+    cnt += rc;
+  }
+
+  cleanup:
+
+  if( file != -1 ) close(file), ++calls;
+  stats_file(name, cnt, calls);
+  return cnt;
+}
+
+/* ------------------------------------------------------------------------- *
+ * output_fmt  --  queue formatted output
+ * ------------------------------------------------------------------------- */
+
+static void output_fmt(const char *fmt, ...)
+{
+  char temp[1<<10];
+  char *work = temp;
+
+  va_list va;
+  int     n;
+
+  va_start(va, fmt);
+  n = vsnprintf(work, sizeof temp, fmt, va);
+  va_end(va);
+
+  if( n >= (int)sizeof temp )
+  {
+    work = alloca(n + 1);
+    va_start(va, fmt);
+    vsnprintf(work, n + 1, fmt, va);
+    va_end(va);
   }
+
+  if( n > 0 )
+  {
+    output_raw(work, n);
+  }
+}
+
+/* ------------------------------------------------------------------------- *
+ * output_byte  --  queue single byte
+ * ------------------------------------------------------------------------- */
+
+static void output_byte(int byte)
+{
+  unsigned char temp = (unsigned char)byte;
+  output_raw(&temp, 1);
+}
+
+/* ------------------------------------------------------------------------- *
+ * output_varint  --  queue varint encoded value
+ * ------------------------------------------------------------------------- */
+
+static void output_varint(uint64_t val)
+{
+  unsigned char temp[SMAPSBIN_VARINT_MAX];
+  output_raw(temp, smapsbin_put_varint(temp, val));
 }
 
 /* ========================================================================= *
- * Snapshot from /proc/pid/smaps information
+ * Capture Records
  * ========================================================================= */
 
-static char *kthreadd_pid;
+/* ------------------------------------------------------------------------- *
+ * capbuf_t  --  growable buffer for capture data of one process
+ * ------------------------------------------------------------------------- */
 
-static int is_kthreadd(const proc_pid_status_t *status)
+typedef struct capbuf_t
 {
-  if (status->Name == NULL)
-    return 0;
-  if (status->PPid == NULL)
-    return 0;
-  return strcmp(status->Name, "kthreadd") == 0
-         && strcmp(status->PPid, "0") == 0;
+  char   *data;
+  size_t  size;
+  size_t  alloc;
+} capbuf_t;
+
+#define CAPBUF_INIT { 0, 0, 0 }
+
+/* ------------------------------------------------------------------------- *
+ * capbuf_dtor  --  release buffer memory
+ * ------------------------------------------------------------------------- */
+
+static void capbuf_dtor(capbuf_t *self)
+{
+  free(self->data);
+  self->data  = 0;
+  self->size  = 0;
+  self->alloc = 0;
 }
 
-static int is_kernel_thread(const proc_pid_status_t *status)
-{
-  if (kthreadd_pid == NULL)
-    return 0;
-  if (status->PPid == NULL)
-    return 0;
-  return strcmp(status->PPid, kthreadd_pid) == 0;
+/* ------------------------------------------------------------------------- *
+ * capbuf_reserve  --  make room for at least given amount of data
+ * ------------------------------------------------------------------------- */
+
+static char *capbuf_reserve(capbuf_t *self, size_t need)
+{
+  if( self->alloc - self->size < need )
+  {
+    size_t alloc = self->alloc ? self->alloc : RXBUFF;
+
+    while( alloc - self->size < need )
+    {
+      alloc <<= 1;
+    }
+    if( (self->data = realloc(self->data, alloc)) == 0 )
+    {
+      msg_fatal("capture buffer: %s\n", strerror(errno));
+    }
+    self->alloc = alloc;
+  }
+  return self->data + self->size;
+}
+
+/* ------------------------------------------------------------------------- *
+ * capbuf_fmt  --  append formatted text to buffer
+ * ------------------------------------------------------------------------- */
+
+static void capbuf_fmt(capbuf_t *self, const char *fmt, ...)
+{
+  size_t  space = 256;
+  va_list va;
+  int     n;
+
+  for( ;; )
+  {
+    char *work = capbuf_reserve(self, space);
+
+    va_start(va, fmt);
+    n = vsnprintf(work, space, fmt, va);
+    va_end(va);
+
+    if( n < 0 )
+    {
+      return;
+    }
+    if( (size_t)n < space )
+    {
+      break;
+    }
+    space = n + 1;
+  }
+  self->size += n;
+}
+
+/* ------------------------------------------------------------------------- *
+ * capbuf_byte  --  append single byte to buffer
+ * ------------------------------------------------------------------------- */
+
+static void capbuf_byte(capbuf_t *self, int byte)
+{
+  *capbuf_reserve(self, 1) = (char)byte;
+  self->size += 1;
+}
+
+/* ------------------------------------------------------------------------- *
+ * capbuf_varint  --  append varint encoded value to buffer
+ * ------------------------------------------------------------------------- */
+
+static void capbuf_varint(capbuf_t *self, uint64_t val)
+{
+  char *work = capbuf_reserve(self, SMAPSBIN_VARINT_MAX);
+  self->size += smapsbin_put_varint((unsigned char *)work, val);
+}
+
+/* ------------------------------------------------------------------------- *
+ * capbuf_file  --  append file contents to buffer, stop at given time
+ *
+ * The until time is CLOCK_MONOTONIC nanoseconds, zero for no limit.
+ * Sets *truncated if reading was stopped before end of file.
+ * ------------------------------------------------------------------------- */
+
+static size_t capbuf_file(capbuf_t *self, int dir, const char *where,
+                          const char *name, uint64_t until, int *truncated)
+{
+  size_t cnt   = 0;
+  size_t calls = 1;
+  int    file  = input_open(dir, where, name);
+
+  if( file == -1 )
+  {
+    goto cleanup;
+  }
+
+  for( ;; )
+  {
+    char *temp = capbuf_reserve(self, RXBUFF);
+    int   rc   = read(file, temp, RXBUFF);
+
+    ++calls;
+
+    if( rc == 0 )
+    {
+      break;
+    }
+
+    if( rc == -1 )
+    {
+      switch( errno )
+      {
+      case EAGAIN:
+      case EINTR:
+        continue;
+
+      default:
+        input_error(where, name, errno);
+        goto cleanup;
+      }
+    }
+
+    self->size += rc;
+    cnt += rc;
+
+    /* /proc files return whole records per read, so the data
+     * read so far ends at a record boundary */
+    if( until != 0 && clock_nsec(CLOCK_MONOTONIC) > until )
+    {
+      *truncated = 1;
+      break;
+    }
+  }
+
+  cleanup:
+
+  if( file != -1 ) close(file), ++calls;
+  stats_file(name, cnt, calls);
+  return cnt;
+}
+
+/* ========================================================================= *
+ * io_uring Batched Input
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * uring_t  --  minimal io_uring instance driven via raw system calls
+ * ------------------------------------------------------------------------- */
+
+typedef struct uring_t
+{
+  int                  fd;
+  unsigned             queued;  // sqes not yet submitted
+
+  unsigned            *sq_head;
+  unsigned            *sq_tail;
+  unsigned            *sq_mask;
+  unsigned            *sq_array;
+  unsigned             sq_entries;
+  struct io_uring_sqe *sqes;
+
+  unsigned            *cq_head;
+  unsigned            *cq_tail;
+  unsigned            *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void                *sq_ptr;
+  size_t               sq_len;
+  void                *cq_ptr;
+  size_t               cq_len;
+  size_t               sqes_len;
+} uring_t;
+
+/* ------------------------------------------------------------------------- *
+ * uring_dtor  --  release io_uring instance
+ * ------------------------------------------------------------------------- */
+
+static void uring_dtor(uring_t *self)
+{
+  if( self->sqes != 0 && self->sqes != MAP_FAILED )
+  {
+    munmap(self->sqes, self->sqes_len);
+  }
+  if( self->cq_ptr != 0 && self->cq_ptr != MAP_FAILED &&
+      self->cq_ptr != self->sq_ptr )
+  {
+    munmap(self->cq_ptr, self->cq_len);
+  }
+  if( self->sq_ptr != 0 && self->sq_ptr != MAP_FAILED )
+  {
+    munmap(self->sq_ptr, self->sq_len);
+  }
+  if( self->fd != -1 )
+  {
+    close(self->fd);
+  }
+  memset(self, 0, sizeof *self);
+  self->fd = -1;
+}
+
+/* ------------------------------------------------------------------------- *
+ * uring_ctor  --  set up io_uring instance, returns -1 if not supported
+ * ------------------------------------------------------------------------- */
+
+static int uring_ctor(uring_t *self, unsigned entries)
+{
+  struct io_uring_params p;
+
+  memset(self, 0, sizeof *self);
+  memset(&p, 0, sizeof p);
+
+  if( (self->fd = syscall(__NR_io_uring_setup, entries, &p)) == -1 )
+  {
+    msg_progress("io_uring: %s\n", strerror(errno));
+    goto failed;
+  }
+
+  /* openat & reads from current file position are needed */
+  if( !(p.features & IORING_FEAT_RW_CUR_POS) )
+  {
+    msg_progress("io_uring: kernel too old\n");
+    goto failed;
+  }
+
+  self->sq_len   = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  self->cq_len   = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  self->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  if( p.features & IORING_FEAT_SINGLE_MMAP )
+  {
+    if( self->sq_len < self->cq_len ) self->sq_len = self->cq_len;
+  }
+
+  self->sq_ptr = mmap(0, self->sq_len, PROT_READ|PROT_WRITE,
+                      MAP_SHARED|MAP_POPULATE, self->fd, IORING_OFF_SQ_RING);
+  if( self->sq_ptr == MAP_FAILED )
+  {
+    msg_progress("io_uring: mmap: %s\n", strerror(errno));
+    goto failed;
+  }
+
+  if( p.features & IORING_FEAT_SINGLE_MMAP )
+  {
+    self->cq_ptr = self->sq_ptr;
+  }
+  else
+  {
+    self->cq_ptr = mmap(0, self->cq_len, PROT_READ|PROT_WRITE,
+                        MAP_SHARED|MAP_POPULATE, self->fd, IORING_OFF_CQ_RING);
+    if( self->cq_ptr == MAP_FAILED )
+    {
+      msg_progress("io_uring: mmap: %s\n", strerror(errno));
+      goto failed;
+    }
+  }
+
+  self->sqes = mmap(0, self->sqes_len, PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_POPULATE, self->fd, IORING_OFF_SQES);
+  if( self->sqes == MAP_FAILED )
+  {
+    msg_progress("io_uring: mmap: %s\n", strerror(errno));
+    goto failed;
+  }
+
+  self->sq_head    = (unsigned *)((char *)self->sq_ptr + p.sq_off.head);
+  self->sq_tail    = (unsigned *)((char *)self->sq_ptr + p.sq_off.tail);
+  self->sq_mask    = (unsigned *)((char *)self->sq_ptr + p.sq_off.ring_mask);
+  self->sq_array   = (unsigned *)((char *)self->sq_ptr + p.sq_off.array);
+  self->sq_entries = p.sq_entries;
+
+  self->cq_head    = (unsigned *)((char *)self->cq_ptr + p.cq_off.head);
+  self->cq_tail    = (unsigned *)((char *)self->cq_ptr + p.cq_off.tail);
+  self->cq_mask    = (unsigned *)((char *)self->cq_ptr + p.cq_off.ring_mask);
+  self->cqes       = (struct io_uring_cqe *)((char *)self->cq_ptr + p.cq_off.cqes);
+
+  return 0;
+
+  failed:
+
+  if( self->fd == -1 )
+  {
+    /* nothing mapped yet */
+    return -1;
+  }
+  uring_dtor(self);
+  return -1;
+}
+
+/* ------------------------------------------------------------------------- *
+ * uring_sqe  --  get next submission queue entry, NULL if queue is full
+ * ------------------------------------------------------------------------- */
+
+static struct io_uring_sqe *uring_sqe(uring_t *self, int op, uint64_t data)
+{
+  unsigned head = __atomic_load_n(self->sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *self->sq_tail;
+  unsigned slot;
+
+  struct io_uring_sqe *sqe;
+
+  if( tail - head >= self->sq_entries )
+  {
+    return 0;
+  }
+
+  slot = tail & *self->sq_mask;
+  sqe  = &self->sqes[slot];
+
+  memset(sqe, 0, sizeof *sqe);
+  sqe->opcode    = op;
+  sqe->user_data = data;
+
+  self->sq_array[slot] = slot;
+  __atomic_store_n(self->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  self->queued += 1;
+
+  return sqe;
+}
+
+/* ------------------------------------------------------------------------- *
+ * uring_wait  --  submit queued entries & wait for one completion
+ * ------------------------------------------------------------------------- */
+
+static void uring_wait(uring_t *self, uint64_t *pdata, int *pres)
+{
+  for( ;; )
+  {
+    unsigned head = *self->cq_head;
+    unsigned tail = __atomic_load_n(self->cq_tail, __ATOMIC_ACQUIRE);
+
+    if( head != tail && self->queued == 0 )
+    {
+      struct io_uring_cqe *cqe = &self->cqes[head & *self->cq_mask];
+
+      *pdata = cqe->user_data;
+      *pres  = cqe->res;
+      __atomic_store_n(self->cq_head, head + 1, __ATOMIC_RELEASE);
+      return;
+    }
+
+    int rc = syscall(__NR_io_uring_enter, self->fd, self->queued,
+                     head != tail ? 0 : 1, IORING_ENTER_GETEVENTS, 0, 0);
+    if( rc == -1 )
+    {
+      if( errno == EINTR || errno == EAGAIN || errno == EBUSY )
+      {
+        continue;
+      }
+      /* reads may still be in flight -> can't continue */
+      msg_fatal("io_uring_enter: %s\n", strerror(errno));
+    }
+    self->queued -= rc;
+  }
+}
+
+/* ------------------------------------------------------------------------- *
+ * input_file_at  --  read file relative to directory fd, terminate with '\0'
+ * ------------------------------------------------------------------------- */
+
+static size_t input_file_at(int dir, const char *where, const char *name,
+                            void *pdata, size_t *psize)
+{
+
+  size_t  done = 0;
+  char   *data = *(char **)pdata;
+  size_t  size = *psize;
+  int     file = -1;
+  size_t  calls = 1;
+
+  if( (file = input_open(dir, where, name)) == -1 )
+  {
+    goto cleanup;
+  }
+
+  for( ;; )
+  {
+    if( size - done < 0x1000 )
+    {
+      if( (data = realloc(data, (size += 0x1000))) == 0 )
+      {
+        msg_fatal("%s: %s\n", name, strerror(errno));
+      }
+    }
+
+    ssize_t rc = read(file, data + done, size - done);
+
+    ++calls;
+
+    if( rc == -1 )
+    {
+      switch( errno )
+      {
+      case EAGAIN:
+      case EINTR:
+        continue;
+
+      default:
+        input_error(where, name, errno);
+        goto cleanup;
+      }
+    }
+
+    if( rc == 0 )
+    {
+      break;
+    }
+
+    done += (size_t)rc;
+  }
+
+  cleanup:
+
+  if( file != -1 )
+  {
+    close(file), ++calls;
+  }
+  stats_file(name, done, calls);
+
+  if( done == size )
+  {
+    if( (data = realloc(data, (size += 1))) == 0 )
+    {
+      msg_fatal("%s: %s\n", name, strerror(errno));
+    }
+  }
+  data[done] = 0;
+
+  *(char **)pdata = data;
+  *psize = size;
+
+  return done;
+}
+
+/* ------------------------------------------------------------------------- *
+ * input_file  --  read file contents, terminate with '\0'
+ * ------------------------------------------------------------------------- */
+
+static size_t input_file(const char *path, void *pdata, size_t *psize)
+{
+  return input_file_at(AT_FDCWD, 0, path, pdata, psize);
+}
+
+#define uc(c) ((unsigned char)(c))
+#define wc(c) ((c)>0 && (c)<33)
+#define bc(c) (uc(c)>32)
+
+static char *strip(char *str)
+{
+  char *src = str;
+  char *dst = str;
+
+  while( wc(*src) ) ++src;
+
+  for( ;; )
+  {
+    if( bc(*src) )
+    {
+      *dst++ = *src++;
+      continue;
+    }
+
+    while( wc(*src) ) ++src;
+
+    if( *src == 0 ) break;
+
+    *dst++ = ' ';
+  }
+  *dst = 0;
+  return str;
+}
+
+static char *token(char **ppos, int sep)
+{
+  char *beg = *ppos;
+
+  if( sep < 0 )
+  {
+    while( wc(*beg) ) ++beg;
+  }
+
+  char *end = beg;
+
+  for( ; *end; ++end )
+  {
+    //printf("??? '%c' vs '%c'\n", (sep<0) ? '?' : sep, *end);
+    if( ((sep<0) && wc(*end)) || (uc(*end) == uc(sep)) )
+    {
+      *end++ = 0; break;
+    }
+  }
+  *ppos = end;
+  return strip(beg);
+}
+
+/* Numeric /proc/pid/status fields included in captures */
+#define PROC_PID_STATUS_FIELDS(X) \
+  X(Pid) X(PPid) X(Tgid) X(Threads) X(FDSize) X(VmPeak) X(VmSize) X(VmLck) \
+  X(VmHWM) X(VmRSS) X(VmData) X(VmStk) X(VmExe) X(VmLib) X(VmPTE)
+
+typedef struct proc_pid_status_t {
+  char *Name;
+  char *Pid;
+  char *PPid;
+  char *Tgid;
+  char *Threads;
+  char *FDSize;
+  char *VmPeak;
+  char *VmSize;
+  char *VmLck;
+  char *VmHWM;
+  char *VmRSS;
+  char *VmData;
+  char *VmStk;
+  char *VmExe;
+  char *VmLib;
+  char *VmPTE;
+  char *NSpid;   // list of pids, from outermost to innermost namespace
+
+} proc_pid_status_t;
+
+static void
+proc_pid_status_parse(proc_pid_status_t *self, char *data)
+{
+  static char empty[1] = "";
+
+  memset(self, 0, sizeof *self);
+
+  self->Name    = empty;
+  self->Pid     = "0";
+  self->PPid    = "0";
+  self->Threads = "0";
+
+  while( *data )
+  {
+    char *row = token(&data, '\n');
+    char *key = token(&row, ':');
+
+    if( !strcmp(key, "Name") )
+    {
+      self->Name = strip(row);
+    }
+    else if( !strcmp(key, "NSpid") )
+    {
+      self->NSpid = strip(row);
+    }
+#define X(v) else if( !strcmp(key, #v) ) { self->v = token(&row, -1); }
+    PROC_PID_STATUS_FIELDS(X)
+#undef X
+  }
+}
+
+/* ========================================================================= *
+ * Low Impact Capture
+ * ========================================================================= */
+
+static int         gentle          = 0;  // --gentle
+static const char *gentle_cpus     = 0;  // --cpus
+static uint64_t    gentle_byte_rate = 0; // smaps bytes per second, 0 = any
+static double      gentle_proc_rate = 0; // processes per second, 0 = any
+
+/* ------------------------------------------------------------------------- *
+ * cpuset_parse  --  add cpus in "0-3,8" style list to set
+ * ------------------------------------------------------------------------- */
+
+static int cpuset_parse(cpu_set_t *set, const char *list)
+{
+  const char *pos = list;
+
+  while( *pos )
+  {
+    char *end;
+    long  lo, hi;
+
+    lo = hi = strtol(pos, &end, 10);
+    if( end == pos ) return -1;
+
+    if( *end == '-' )
+    {
+      pos = end + 1;
+      hi  = strtol(pos, &end, 10);
+      if( end == pos ) return -1;
+    }
+
+    if( lo < 0 || hi < lo || hi >= CPU_SETSIZE ) return -1;
+
+    for( long cpu = lo; cpu <= hi; ++cpu )
+    {
+      CPU_SET(cpu, set);
+    }
+
+    pos = end;
+    if( *pos == ',' )
+    {
+      ++pos;
+    }
+    else if( *pos != 0 && *pos != '\n' )
+    {
+      return -1;
+    }
+    else
+    {
+      break;
+    }
+  }
+  return 0;
+}
+
+/* ------------------------------------------------------------------------- *
+ * cpuset_remove_file  --  remove cpus listed in sysfs file from set
+ * ------------------------------------------------------------------------- */
+
+static void cpuset_remove_file(cpu_set_t *set, const char *path)
+{
+  char     *text = 0;
+  size_t    size = 0;
+  cpu_set_t drop;
+
+  CPU_ZERO(&drop);
+
+  if( access(path, R_OK) == 0 && input_file(path, &text, &size) > 0 )
+  {
+    if( cpuset_parse(&drop, strip(text)) == -1 )
+    {
+      msg_warning("%s: can't parse cpu list\n", path);
+    }
+    else if( CPU_COUNT(&drop) )
+    {
+      msg_progress("%s: %s, not used\n", path, text);
+      for( int cpu = 0; cpu < CPU_SETSIZE; ++cpu )
+      {
+        if( CPU_ISSET(cpu, &drop) ) CPU_CLR(cpu, set);
+      }
+    }
+  }
+  free(text);
+}
+
+/* ------------------------------------------------------------------------- *
+ * use_minimum_priority  --  stay out of the way of other processes
+ *
+ * Worker threads are created after this, so they inherit the scheduling
+ * policy, io priority and cpu affinity.
+ * ------------------------------------------------------------------------- */
+
+#define IOPRIO_WHO_PROCESS  1
+#define IOPRIO_CLASS_IDLE   3
+#define IOPRIO_CLASS_SHIFT 13
+
+static void use_minimum_priority(void)
+{
+  struct sched_param param = { .sched_priority = 0 };
+
+  if( setpriority(PRIO_PROCESS, 0, 19) == -1 )
+  {
+    msg_warning("unable to set nice priority: %s\n", strerror(errno));
+  }
+
+  if( sched_setscheduler(0, SCHED_IDLE, &param) == -1 )
+  {
+    msg_warning("unable to set SCHED_IDLE: %s\n", strerror(errno));
+  }
+  else
+  {
+    msg_progress("sched policy  : SCHED_IDLE\n");
+  }
+
+  if( syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+              IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == -1 )
+  {
+    msg_warning("unable to set idle io priority: %s\n", strerror(errno));
+  }
+  else
+  {
+    msg_progress("io priority   : idle\n");
+  }
+}
+
+/* ------------------------------------------------------------------------- *
+ * use_gentle_cpus  --  pin to given cpus, skip isolated & nohz_full ones
+ * ------------------------------------------------------------------------- */
+
+static void use_gentle_cpus(void)
+{
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+
+  if( gentle_cpus != 0 )
+  {
+    if( cpuset_parse(&set, gentle_cpus) == -1 || CPU_COUNT(&set) == 0 )
+    {
+      msg_fatal("invalid cpu list: '%s'\n", gentle_cpus);
+    }
+  }
+  else if( sched_getaffinity(0, sizeof set, &set) == -1 )
+  {
+    msg_warning("unable to get cpu affinity: %s\n", strerror(errno));
+    return;
+  }
+
+  cpu_set_t keep = set;
+
+  cpuset_remove_file(&keep, "/sys/devices/system/cpu/isolated");
+  cpuset_remove_file(&keep, "/sys/devices/system/cpu/nohz_full");
+
+  if( CPU_COUNT(&keep) == 0 )
+  {
+    msg_warning("all allowed cpus are isolated, using them anyway\n");
+    keep = set;
+  }
+
+  if( sched_setaffinity(0, sizeof keep, &keep) == -1 )
+  {
+    msg_warning("unable to set cpu affinity: %s\n", strerror(errno));
+  }
+  else
+  {
+    msg_progress("cpu affinity  : %d cpus\n", CPU_COUNT(&keep));
+  }
+}
+
+/* ------------------------------------------------------------------------- *
+ * gentle_pace  --  yield & sleep to keep within the capture rate limits
+ *
+ * Called after each process from all workers. The limits apply to
+ * the capture as a whole: the delay is computed from the totals since
+ * gentle_reset() so that short bursts are evened out.
+ * ------------------------------------------------------------------------- */
+
+static pthread_mutex_t gentle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t        gentle_start = 0;
+static uint64_t        gentle_bytes = 0;
+static uint64_t        gentle_procs = 0;
+
+static void gentle_reset(void)
+{
+  gentle_start = clock_nsec(CLOCK_MONOTONIC);
+  gentle_bytes = 0;
+  gentle_procs = 0;
+}
+
+static void gentle_pace(size_t bytes)
+{
+  uint64_t wake = 0;
+
+  if( gentle )
+  {
+    sched_yield();
+  }
+
+  if( gentle_byte_rate == 0 && gentle_proc_rate <= 0 )
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&gentle_mutex);
+  gentle_bytes += bytes;
+  gentle_procs += 1;
+  if( gentle_byte_rate != 0 )
+  {
+    uint64_t t = gentle_start + gentle_bytes * 1000000000.0 / gentle_byte_rate;
+    if( wake < t ) wake = t;
+  }
+  if( gentle_proc_rate > 0 )
+  {
+    uint64_t t = gentle_start + gentle_procs * 1e9 / gentle_proc_rate;
+    if( wake < t ) wake = t;
+  }
+  pthread_mutex_unlock(&gentle_mutex);
+
+  if( wake > clock_nsec(CLOCK_MONOTONIC) )
+  {
+    struct timespec ts = { wake / 1000000000, wake % 1000000000 };
+
+    while( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR
+           && !terminate )
+    {
+    }
+  }
+}
+
+/* ========================================================================= *
+ * Process Selection
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * pidset_t  --  set of process ids
+ * ------------------------------------------------------------------------- */
+
+typedef struct pidset_t
+{
+  int    *pid;
+  size_t  count;
+  size_t  alloc;
+} pidset_t;
+
+#define PIDSET_INIT { 0, 0, 0 }
+
+static int pidset_compare_cb(const void *a1, const void *a2)
+{
+  int p1 = *(const int *)a1;
+  int p2 = *(const int *)a2;
+  return (p1 > p2) - (p1 < p2);
+}
+
+/* ------------------------------------------------------------------------- *
+ * pidset_dtor  --  release set memory
+ * ------------------------------------------------------------------------- */
+
+static void pidset_dtor(pidset_t *self)
+{
+  free(self->pid);
+  self->pid   = 0;
+  self->count = 0;
+  self->alloc = 0;
+}
+
+/* ------------------------------------------------------------------------- *
+ * pidset_add  --  add pid to set, keeping the set sorted
+ * ------------------------------------------------------------------------- */
+
+static void pidset_add(pidset_t *self, int pid)
+{
+  size_t i = self->count;
+
+  if( self->count == self->alloc )
+  {
+    self->alloc = self->alloc ? self->alloc * 2 : 64;
+    if( (self->pid = realloc(self->pid, self->alloc * sizeof *self->pid)) == 0 )
+    {
+      msg_fatal("pid set: %s\n", strerror(errno));
+    }
+  }
+
+  /* pids are mostly added in ascending order */
+  while( i > 0 && self->pid[i-1] > pid )
+  {
+    --i;
+  }
+  if( i > 0 && self->pid[i-1] == pid )
+  {
+    return;
+  }
+  memmove(self->pid + i + 1, self->pid + i, (self->count - i) * sizeof *self->pid);
+  self->pid[i] = pid;
+  self->count += 1;
+}
+
+/* ------------------------------------------------------------------------- *
+ * pidset_has  --  check if pid is in set
+ * ------------------------------------------------------------------------- */
+
+static int pidset_has(const pidset_t *self, int pid)
+{
+  return self->count != 0 &&
+    bsearch(&pid, self->pid, self->count, sizeof *self->pid,
+            pidset_compare_cb) != 0;
+}
+
+/* ------------------------------------------------------------------------- *
+ * pidset_parse  --  add comma separated pids to set
+ * ------------------------------------------------------------------------- */
+
+static int pidset_parse(pidset_t *self, const char *list)
+{
+  for( const char *pos = list; *pos; )
+  {
+    char *end = (char *)pos;
+    long  pid = strtol(pos, &end, 10);
+
+    if( end == pos || pid <= 0 || (*end != 0 && *end != ',') )
+    {
+      return -1;
+    }
+    pidset_add(self, (int)pid);
+    pos = (*end == ',') ? end + 1 : end;
+  }
+  return 0;
+}
+
+/* ------------------------------------------------------------------------- *
+ * selection criteria from command line
+ * ------------------------------------------------------------------------- */
+
+static pidset_t     select_pid    = PIDSET_INIT; // --pid
+static pidset_t     select_tree   = PIDSET_INIT; // --tree roots
+static const char **select_cgroup = 0;           // --cgroup paths
+static size_t       select_cgroups = 0;
+static regex_t      select_regex;                // --match
+static int          select_match  = 0;
+
+static int select_active(void)
+{
+  return (select_pid.count || select_tree.count ||
+          select_cgroups   || select_match);
+}
+
+/* ------------------------------------------------------------------------- *
+ * cgroup_path  --  make cgroup path absolute, relative to cgroup_root
+ * ------------------------------------------------------------------------- */
+
+static char *cgroup_path(const char *cgroup)
+{
+  char *path = 0;
+
+  if( *cgroup == '/' )
+  {
+    path = strdup(cgroup);
+  }
+  else if( asprintf(&path, "%s/%s", cgroup_root, cgroup) == -1 )
+  {
+    path = 0;
+  }
+  if( path == 0 )
+  {
+    msg_fatal("%s: %s\n", cgroup, strerror(errno));
+  }
+  return path;
+}
+
+/* ------------------------------------------------------------------------- *
+ * select_cgroup_pids  --  add processes in a cgroup to pid set
+ * ------------------------------------------------------------------------- */
+
+static void select_cgroup_pids(pidset_t *pids, const char *cgroup)
+{
+  char       *path = cgroup_path(cgroup);
+  char       *text = 0;
+  size_t      size = 0;
+  struct stat st;
+
+  if( stat(path, &st) == 0 && S_ISDIR(st.st_mode) )
+  {
+    char *temp = 0;
+    if( asprintf(&temp, "%s/cgroup.procs", path) == -1 )
+    {
+      msg_fatal("%s: %s\n", cgroup, strerror(errno));
+    }
+    free(path), path = temp;
+  }
+
+  input_file(path, &text, &size);
+
+  for( char *pos = text; *pos; )
+  {
+    char *end = pos;
+    long  pid = strtol(pos, &end, 10);
+
+    if( end == pos )
+    {
+      break;
+    }
+    if( pid > 0 )
+    {
+      pidset_add(pids, (int)pid);
+    }
+    pos = end;
+  }
+
+  free(text);
+  free(path);
+}
+
+/* ------------------------------------------------------------------------- *
+ * select_read_ppid  --  get parent pid from /proc/pid/stat
+ * ------------------------------------------------------------------------- */
+
+static int select_read_ppid(const char *root, int pid)
+{
+  char  path[256];
+  char  text[512];
+  int   ppid = 0;
+  int   file;
+
+  snprintf(path, sizeof path, "%s/%d/stat", root, pid);
+
+  if( (file = open(path, O_RDONLY)) != -1 )
+  {
+    ssize_t n = read(file, text, sizeof text - 1);
+
+    if( n > 0 )
+    {
+      char *pos;
+
+      text[n] = 0;
+
+      /* "pid (comm) state ppid ..." where comm can contain anything */
+      if( (pos = strrchr(text, ')')) != 0 )
+      {
+        sscanf(pos + 1, " %*c %d", &ppid);
+      }
+    }
+    close(file);
+  }
+  return ppid;
+}
+
+/* ------------------------------------------------------------------------- *
+ * select_match_name  --  check process comm & cmdline against regex
+ * ------------------------------------------------------------------------- */
+
+static int select_match_name(const char *root, int pid)
+{
+  char   path[256];
+  char  *text = 0;
+  size_t size = 0;
+  size_t used;
+  int    hit  = 0;
+
+  snprintf(path, sizeof path, "%s/%d/comm", root, pid);
+  input_file(path, &text, &size);
+  text[strcspn(text, "\n")] = 0;
+
+  if( regexec(&select_regex, text, 0, 0, 0) == 0 )
+  {
+    hit = 1;
+  }
+  else
+  {
+    snprintf(path, sizeof path, "%s/%d/cmdline", root, pid);
+    used = input_file(path, &text, &size);
+
+    /* argv[] is '\0' separated -> match against space separated */
+    for( size_t i = 0; i + 1 < used; ++i )
+    {
+      if( text[i] == 0 ) text[i] = ' ';
+    }
+    hit = (used != 0 && regexec(&select_regex, text, 0, 0, 0) == 0);
+  }
+
+  free(text);
+  return hit;
+}
+
+/* ========================================================================= *
+ * Cgroup Freezing
+ * ========================================================================= */
+
+#define FREEZE_TIMEOUT_MS 1000 // max wait for cgroup to reach frozen state
+
+/* ------------------------------------------------------------------------- *
+ * freezegrp_t  --  cgroup frozen for the duration of capture
+ * ------------------------------------------------------------------------- */
+
+typedef struct freezegrp_t
+{
+  char *path;  // cgroup directory
+  int   fd;    // cgroup.freeze, open for writing
+} freezegrp_t;
+
+static int          freeze       = 0; // --freeze
+static freezegrp_t *freeze_group = 0;
+static size_t       freeze_count = 0;
+
+static const int freeze_signals[] = { SIGINT, SIGTERM, SIGHUP, SIGQUIT };
+
+#define FREEZE_SIGNALS (sizeof freeze_signals / sizeof *freeze_signals)
+
+static struct sigaction freeze_prev[FREEZE_SIGNALS];
+
+/* ------------------------------------------------------------------------- *
+ * freeze_thaw  --  let frozen cgroups run again, async signal safe
+ * ------------------------------------------------------------------------- */
+
+static void freeze_thaw(void)
+{
+  for( size_t i = 0; i < freeze_count; ++i )
+  {
+    if( write(freeze_group[i].fd, "0", 1) == -1 )
+    {
+      // nothing sensible to do, keep on thawing the rest
+    }
+  }
+}
+
+/* ------------------------------------------------------------------------- *
+ * freeze_signal_cb  --  thaw before handling terminating signals
+ * ------------------------------------------------------------------------- */
+
+static void freeze_signal_cb(int sig)
+{
+  freeze_thaw();
+
+  for( size_t i = 0; i < FREEZE_SIGNALS; ++i )
+  {
+    if( freeze_signals[i] == sig )
+    {
+      sigaction(sig, &freeze_prev[i], 0);
+    }
+  }
+  raise(sig);
+}
+
+/* ------------------------------------------------------------------------- *
+ * freeze_own_cgroup  --  locate cgroup v2 directory of this process
+ * ------------------------------------------------------------------------- */
+
+static char *freeze_own_cgroup(void)
+{
+  char  *res  = 0;
+  char  *text = 0;
+  size_t size = 0;
+  char  *own  = 0;
+  char  *mnt  = 0;
+
+  /* cgroup v2 entry: "0::/path/of/cgroup" */
+  input_file("/proc/self/cgroup", &text, &size);
+  for( char *pos = text; *pos; )
+  {
+    char *row = pos;
+
+    pos += strcspn(pos, "\n");
+    if( *pos ) *pos++ = 0;
+
+    if( !strncmp(row, "0::", 3) )
+    {
+      own = strdup(row + 3);
+    }
+  }
+
+  /* mount point is 5th field, fs type follows " - " separator */
+  input_file("/proc/self/mountinfo", &text, &size);
+  for( char *pos = text; *pos && !mnt; )
+  {
+    char *row = pos;
+
+    pos += strcspn(pos, "\n");
+    if( *pos ) *pos++ = 0;
+
+    char *sep = strstr(row, " - ");
+
+    if( sep != 0 && !strncmp(sep, " - cgroup2 ", 11) )
+    {
+      char *fld = row;
+      for( int i = 0; i < 4 && fld; ++i )
+      {
+        if( (fld = strchr(fld, ' ')) != 0 ) ++fld;
+      }
+      if( fld != 0 )
+      {
+        mnt = strndup(fld, strcspn(fld, " "));
+      }
+    }
+  }
+
+  if( own != 0 && mnt != 0 && asprintf(&res, "%s%s", mnt, own) == -1 )
+  {
+    res = 0;
+  }
+
+  free(own);
+  free(mnt);
+  free(text);
+  return res;
+}
+
+/* ------------------------------------------------------------------------- *
+ * freeze_contains_self  --  check if we would get frozen too
+ * ------------------------------------------------------------------------- */
+
+static int freeze_contains_self(const char *path)
+{
+  int   res = 0;
+  char *own = freeze_own_cgroup();
+  char *dir = own ? realpath(own, 0) : 0;
+  char *grp = realpath(path, 0);
+
+  if( dir != 0 && grp != 0 )
+  {
+    size_t len = strlen(grp);
+
+    /* path is own cgroup or one of its ancestors */
+    res = (!strncmp(dir, grp, len) && (dir[len] == 0 || dir[len] == '/' ||
+                                       !strcmp(grp, "/")));
+  }
+
+  free(grp);
+  free(dir);
+  free(own);
+  return res;
+}
+
+/* ------------------------------------------------------------------------- *
+ * freeze_wait  --  wait until cgroup reports being frozen
+ * ------------------------------------------------------------------------- */
+
+static int freeze_wait(const freezegrp_t *grp, uint64_t deadline)
+{
+  int    res  = 0;
+  char  *path = 0;
+  char  *text = 0;
+  size_t size = 0;
+
+  if( asprintf(&path, "%s/cgroup.events", grp->path) == -1 )
+  {
+    msg_fatal("%s: %s\n", grp->path, strerror(errno));
+  }
+
+  for( ;; )
+  {
+    if( input_file(path, &text, &size) == 0 )
+    {
+      break;
+    }
+    if( !strncmp(text, "frozen 1", 8) || strstr(text, "\nfrozen 1") )
+    {
+      res = 1;
+      break;
+    }
+    if( clock_nsec(CLOCK_MONOTONIC) >= deadline )
+    {
+      break;
+    }
+    nanosleep(&(struct timespec){ 0, 1000000 }, 0);
+  }
+
+  free(text);
+  free(path);
+  return res;
+}
+
+/* ------------------------------------------------------------------------- *
+ * freeze_start  --  freeze cgroups selected with --cgroup
+ * ------------------------------------------------------------------------- */
+
+static void freeze_start(void)
+{
+  struct sigaction sa;
+  uint64_t         deadline;
+
+  if( !freeze || freeze_group != 0 )
+  {
+    return;
+  }
+
+  if( (freeze_group = calloc(select_cgroups, sizeof *freeze_group)) == 0 )
+  {
+    msg_fatal("freeze: %s\n", strerror(errno));
+  }
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * handlers must be in place before the
+   * first cgroup gets frozen
+   * - - - - - - - - - - - - - - - - - - - */
+
+  memset(&sa, 0, sizeof sa);
+  sigemptyset(&sa.sa_mask);
+  sa.sa_handler = freeze_signal_cb;
+  for( size_t i = 0; i < FREEZE_SIGNALS; ++i )
+  {
+    sigaction(freeze_signals[i], &sa, &freeze_prev[i]);
+  }
+
+  for( size_t i = 0; i < select_cgroups; ++i )
+  {
+    char *path = cgroup_path(select_cgroup[i]);
+    char *file = 0;
+    int   fd   = -1;
+
+    if( freeze_contains_self(path) )
+    {
+      msg_fatal("%s: refusing to freeze cgroup of "TOOL_NAME"\n", path);
+    }
+
+    if( asprintf(&file, "%s/cgroup.freeze", path) == -1 )
+    {
+      msg_fatal("%s: %s\n", path, strerror(errno));
+    }
+
+    if( (fd = open(file, O_WRONLY|O_CLOEXEC)) == -1 )
+    {
+      msg_warning("%s: %s (not frozen)\n", file, strerror(errno));
+      free(path);
+    }
+    else
+    {
+      freeze_group[freeze_count].path = path;
+      freeze_group[freeze_count].fd   = fd;
+      ++freeze_count;
+
+      if( write(fd, "1", 1) == -1 )
+      {
+        msg_warning("%s: %s (not frozen)\n", file, strerror(errno));
+      }
+    }
+    free(file);
+  }
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * freezing is asynchronous, wait until
+   * all tasks have stopped
+   * - - - - - - - - - - - - - - - - - - - */
+
+  deadline = clock_nsec(CLOCK_MONOTONIC) + FREEZE_TIMEOUT_MS * 1000000ull;
+
+  for( size_t i = 0; i < freeze_count; ++i )
+  {
+    if( !freeze_wait(&freeze_group[i], deadline) )
+    {
+      msg_warning("%s: not frozen within %d ms\n",
+                  freeze_group[i].path, FREEZE_TIMEOUT_MS);
+    }
+  }
+}
+
+/* ------------------------------------------------------------------------- *
+ * freeze_stop  --  thaw frozen cgroups, also called at exit
+ * ------------------------------------------------------------------------- */
+
+static void freeze_stop(void)
+{
+  if( freeze_group == 0 )
+  {
+    return;
+  }
+
+  freeze_thaw();
+
+  for( size_t i = 0; i < FREEZE_SIGNALS; ++i )
+  {
+    sigaction(freeze_signals[i], &freeze_prev[i], 0);
+  }
+
+  for( size_t i = 0; i < freeze_count; ++i )
+  {
+    close(freeze_group[i].fd);
+    free(freeze_group[i].path);
+  }
+  free(freeze_group), freeze_group = 0;
+  freeze_count = 0;
+}
+
+/* ========================================================================= *
+ * Change Detection for Incremental Captures
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * procsig_t  --  cheap to read indicators of process memory changes
+ * ------------------------------------------------------------------------- */
+
+typedef struct procsig_t
+{
+  int                pid;
+  int                valid;
+  unsigned long long start;
+  unsigned long long vsize;
+  unsigned long long rss;
+  unsigned long long minflt;
+  unsigned long long majflt;
+} procsig_t;
+
+static procsig_t *procsig_prev       = 0; // from previous capture
+static size_t     procsig_prev_count = 0;
+
+/* ------------------------------------------------------------------------- *
+ * procsig_read  --  fill in signature from /proc/pid/stat
+ * ------------------------------------------------------------------------- */
+
+static void procsig_read(procsig_t *self, const char *root, int pid)
+{
+  char path[256];
+  char text[1024];
+  int  file;
+
+  memset(self, 0, sizeof *self);
+  self->pid = pid;
+
+  snprintf(path, sizeof path, "%s/%d/stat", root, pid);
+
+  if( (file = open(path, O_RDONLY)) != -1 )
+  {
+    ssize_t n = read(file, text, sizeof text - 1);
+    char   *pos;
+
+    if( n > 0 && (text[n] = 0, pos = strrchr(text, ')')) != 0 )
+    {
+      /* fields after comm: state ppid pgrp session tty_nr tpgid
+       * flags minflt cminflt majflt cmajflt utime stime cutime
+       * cstime priority nice num_threads itrealvalue starttime
+       * vsize rss */
+      self->valid =
+        sscanf(pos + 1,
+               " %*c %*d %*d %*d %*d %*d %*u %llu %*u %llu %*u"
+               " %*u %*u %*d %*d %*d %*d %*d %*d %llu %llu %llu",
+               &self->minflt, &self->majflt,
+               &self->start, &self->vsize, &self->rss) == 5;
+    }
+    close(file);
+  }
+}
+
+/* ------------------------------------------------------------------------- *
+ * procsig_compare_pid_cb  --  bsearch callback for finding by pid
+ * ------------------------------------------------------------------------- */
+
+static int procsig_compare_pid_cb(const void *a1, const void *a2)
+{
+  const procsig_t *s1 = a1;
+  const procsig_t *s2 = a2;
+  return (s1->pid > s2->pid) - (s1->pid < s2->pid);
+}
+
+/* ------------------------------------------------------------------------- *
+ * procsig_unchanged  --  check signature against previous capture
+ * ------------------------------------------------------------------------- */
+
+static int procsig_unchanged(const procsig_t *self)
+{
+  const procsig_t *prev;
+
+  if( !self->valid || procsig_prev_count == 0 )
+  {
+    return 0;
+  }
+
+  prev = bsearch(self, procsig_prev, procsig_prev_count, sizeof *prev,
+                 procsig_compare_pid_cb);
+
+  return (prev != 0 && prev->valid &&
+          prev->start  == self->start  &&
+          prev->vsize  == self->vsize  &&
+          prev->rss    == self->rss    &&
+          prev->minflt == self->minflt &&
+          prev->majflt == self->majflt);
+}
+
+/* ========================================================================= *
+ * Binary Capture String Table
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * strtab  --  strings interned by capture workers, shared by all threads
+ *
+ * The table is reset at the start of each capture, so that string ids
+ * are dense and every capture is self-contained. The string definitions
+ * are written to output on first use within the capture.
+ * ------------------------------------------------------------------------- */
+
+static pthread_mutex_t strtab_mutex = PTHREAD_MUTEX_INITIALIZER;
+static symtab_t       *strtab_lut   = 0; // string -> id - 1
+static char          **strtab_text  = 0; // id - 1 -> string
+static unsigned char  *strtab_done  = 0; // id - 1 -> defined in output
+static size_t          strtab_count = 0;
+static size_t          strtab_alloc = 0;
+
+/* ------------------------------------------------------------------------- *
+ * strtab_intern  --  get id for string, zero is used for empty string
+ * ------------------------------------------------------------------------- */
+
+static unsigned strtab_intern(const char *str)
+{
+  int id;
+
+  if( str == 0 || *str == 0 )
+  {
+    return 0;
+  }
+
+  pthread_mutex_lock(&strtab_mutex);
+
+  if( strtab_lut == 0 )
+  {
+    strtab_lut = symtab_create();
+  }
+
+  id = symtab_enumerate(strtab_lut, str);
+
+  if( (size_t)id == strtab_count )
+  {
+    if( strtab_count == strtab_alloc )
+    {
+      strtab_alloc = strtab_alloc ? strtab_alloc * 2 : 1024;
+      strtab_text  = realloc(strtab_text, strtab_alloc * sizeof *strtab_text);
+      strtab_done  = realloc(strtab_done, strtab_alloc * sizeof *strtab_done);
+      if( strtab_text == 0 || strtab_done == 0 )
+      {
+        msg_fatal("string table: %s\n", strerror(errno));
+      }
+    }
+    strtab_text[strtab_count] = strdup(str);
+    strtab_done[strtab_count] = 0;
+    ++strtab_count;
+  }
+
+  pthread_mutex_unlock(&strtab_mutex);
+
+  return (unsigned)id + 1;
+}
+
+/* ------------------------------------------------------------------------- *
+ * strtab_string  --  get string for id, valid until the next reset
+ * ------------------------------------------------------------------------- */
+
+static const char *strtab_string(unsigned id)
+{
+  const char *str = "";
+
+  if( id != 0 )
+  {
+    pthread_mutex_lock(&strtab_mutex);
+    str = strtab_text[id - 1];
+    pthread_mutex_unlock(&strtab_mutex);
+  }
+  return str;
+}
+
+/* ------------------------------------------------------------------------- *
+ * strtab_output  --  write string definition unless already done
+ * ------------------------------------------------------------------------- */
+
+static void strtab_output(unsigned id)
+{
+  const char *str = 0;
+
+  if( id == 0 )
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&strtab_mutex);
+  if( !strtab_done[id - 1] )
+  {
+    strtab_done[id - 1] = 1;
+    str = strtab_text[id - 1];
+  }
+  pthread_mutex_unlock(&strtab_mutex);
+
+  if( str != 0 )
+  {
+    size_t len = strlen(str);
+    output_byte(SMAPSBIN_STRING);
+    output_varint(id);
+    output_varint(len);
+    output_raw(str, len);
+  }
+}
+
+/* ------------------------------------------------------------------------- *
+ * strtab_reset  --  start new capture: forget all interned strings
+ * ------------------------------------------------------------------------- */
+
+static void strtab_reset(void)
+{
+  pthread_mutex_lock(&strtab_mutex);
+  symtab_delete(strtab_lut), strtab_lut = 0;
+  for( size_t i = 0; i < strtab_count; ++i )
+  {
+    free(strtab_text[i]);
+  }
+  strtab_count = 0;
+  pthread_mutex_unlock(&strtab_mutex);
+}
+
+/* ------------------------------------------------------------------------- *
+ * output_fields  --  write field name list record
+ * ------------------------------------------------------------------------- */
+
+static void output_fields(int set, const char * const *name, size_t count)
+{
+  unsigned id[count];
+
+  for( size_t i = 0; i < count; ++i )
+  {
+    strtab_output(id[i] = strtab_intern(name[i]));
+  }
+
+  output_byte(SMAPSBIN_FIELDS);
+  output_varint(set);
+  output_varint(count);
+  for( size_t i = 0; i < count; ++i )
+  {
+    output_varint(id[i]);
+  }
+}
+
+/* ------------------------------------------------------------------------- *
+ * output_info  --  write capture level information
+ * ------------------------------------------------------------------------- */
+
+static void output_info(const char *key, const char *fmt, ...)
+{
+  char   *val = 0;
+  va_list va;
+
+  va_start(va, fmt);
+  if( vasprintf(&val, fmt, va) == -1 )
+  {
+    msg_fatal("%s: %s\n", key, strerror(errno));
+  }
+  va_end(va);
+
+  if( binary )
+  {
+    unsigned k = strtab_intern(key);
+    unsigned v = strtab_intern(val);
+
+    strtab_output(k);
+    strtab_output(v);
+    output_byte(SMAPSBIN_INFO);
+    output_varint(k);
+    output_varint(v);
+  }
+  else
+  {
+    output_fmt("##%s: %s\n", key, val);
+  }
+
+  free(val);
+}
+
+/* ========================================================================= *
+ * Snapshot from /proc/pid/smaps information
+ * ========================================================================= */
+
+static char *kthreadd_pid;
+
+static int is_kthreadd(const proc_pid_status_t *status)
+{
+  if (status->Name == NULL)
+    return 0;
+  if (status->PPid == NULL)
+    return 0;
+  return strcmp(status->Name, "kthreadd") == 0
+         && strcmp(status->PPid, "0") == 0;
+}
+
+static int is_kernel_thread(const proc_pid_status_t *status)
+{
+  if (kthreadd_pid == NULL)
+    return 0;
+  if (status->PPid == NULL)
+    return 0;
+  return strcmp(status->PPid, kthreadd_pid) == 0;
+}
+
+static void check_kthreadd(const proc_pid_status_t *status)
+{
+  if (kthreadd_pid)
+    return;
+  if (status->Pid == NULL)
+    return;
+  if (is_kthreadd(status))
+    kthreadd_pid = strdup(status->Pid);
+}
+
+/* ------------------------------------------------------------------------- *
+ * deadline_expired  --  capture time budget has been used up
+ * ------------------------------------------------------------------------- */
+
+static int deadline_expired(void)
+{
+  return (deadline > 0 &&
+          clock_nsec(CLOCK_MONOTONIC) - capture_started > deadline * 1e9);
+}
+
+/* ------------------------------------------------------------------------- *
+ * snapjob_t  --  capture state for one process
+ * ------------------------------------------------------------------------- */
+
+enum
+{
+  PREFETCH_CMDLINE,
+  PREFETCH_STATUS,
+  PREFETCH_SMAPS,
+  PREFETCH_FILES
+};
+
+#define PREFETCH_BATCH 64 // processes per io_uring batch
+
+enum
+{
+  DETAIL_SMAPS, // full smaps data
+  DETAIL_MAPS,  // hybrid mode: mapping list only
+  DETAIL_NONE,  // hybrid mode: kernel thread, status only
+};
+
+enum
+{
+  PARTIAL_NONE,
+  PARTIAL_SKIPPED,   // capture deadline passed before reading
+  PARTIAL_TRUNCATED, // smaps reading took too long
+};
+
+typedef struct snapjob_t
+{
+  int               pid;         // process to capture
+  int               done;        // record is ready for output
+  capbuf_t          record;      // capture data for the process
+  size_t            smaps_bytes; // amount of smaps data in the record
+  uint64_t          smaps_nsec;  // time taken to read smaps (--stats)
+  uint64_t          time;        // CLOCK_MONOTONIC when reading started
+  char             *name;        // application name used in the record
+  char             *status_text; // /proc/pid/status content
+  size_t            status_size;
+  proc_pid_status_t status;      // parsed from status_text
+  int               deferred;    // smaps data is copied at output time
+  int               prefetched;  // input files already read via io_uring
+  int               unchanged;   // refer to previous capture instead
+  int               detail;      // DETAIL_SMAPS, _MAPS or _NONE
+  int               partial;     // PARTIAL_SKIPPED or _TRUNCATED
+  int               dirfd;       // open /proc/pid directory, or -1
+  char              where[128];  // "/proc/pid" for messages
+  capbuf_t          prefetch[PREFETCH_FILES]; // cmdline, status & smaps
+  unsigned         *strids;      // strings referred by binary record
+  size_t            strids_count;
+  size_t            strids_alloc;
+} snapjob_t;
+
+/* ------------------------------------------------------------------------- *
+ * smaps_fields  --  numeric smaps values stored in binary captures
+ * ------------------------------------------------------------------------- */
+
+static const char * const smaps_fields[] =
+{
+  "Size", "KernelPageSize", "MMUPageSize", "Rss", "Pss", "Pss_Dirty",
+  "Pss_Anon", "Pss_File", "Pss_Shmem", "Shared_Clean", "Shared_Dirty",
+  "Private_Clean", "Private_Dirty", "Referenced", "Anonymous", "KSM",
+  "LazyFree", "AnonHugePages", "ShmemPmdMapped", "FilePmdMapped",
+  "Shared_Hugetlb", "Private_Hugetlb", "Swap", "SwapPss", "Locked",
+  "Uss",  // added in deep mode
+  "Vmas", // added in fold mode, must be last
+};
+
+#define SMAPS_FIELDS (sizeof smaps_fields / sizeof *smaps_fields)
+
+/* smaps_fields indices needed when folding mappings */
+#define SMAPS_FIELD_SIZE           0
+#define SMAPS_FIELD_KERNELPAGESIZE 1
+#define SMAPS_FIELD_MMUPAGESIZE    2
+#define SMAPS_FIELD_VMAS           (SMAPS_FIELDS - 1)
+
+static const char * const status_fields[] =
+{
+#define X(v) #v,
+  PROC_PID_STATUS_FIELDS(X)
+  X(NSpid) // innermost pid only
+  X(Brief) // hybrid mode: mapping list without smaps values
+#undef X
+};
+
+#define STATUS_FIELDS (sizeof status_fields / sizeof *status_fields)
+
+/* ------------------------------------------------------------------------- *
+ * snapvma_t  --  one mapping parsed from smaps for binary encoding
+ * ------------------------------------------------------------------------- */
+
+typedef struct snapvma_t
+{
+  uint64_t head, tail, offs, inode;
+  unsigned prot, major, minor, path;
+  uint64_t value[SMAPS_FIELDS];
+} snapvma_t;
+
+/* ------------------------------------------------------------------------- *
+ * foldkey_t  --  mapping grouping key used in fold mode
+ * ------------------------------------------------------------------------- */
+
+typedef struct foldkey_t
+{
+  unsigned path, prot;
+  size_t   index;      // position in mapping array
+} foldkey_t;
+
+/* ------------------------------------------------------------------------- *
+ * snapwork_t  --  scratch buffers owned by one capture worker
+ * ------------------------------------------------------------------------- */
+
+typedef struct snapwork_t
+{
+  char      *cmdline_text;
+  size_t     cmdline_size;
+  capbuf_t   smaps;        // raw smaps text in binary & fold modes
+  snapvma_t *vmas;         // mappings parsed from smaps
+  size_t     vmas_alloc;
+  capbuf_t   deep;         // smaps text with Uss lines added
+  uint64_t  *pagemap;      // deep mode pagemap / kpagecount chunk
+  uint64_t  *counts;
+  uint64_t  *pfns;         // frames mapped by current process
+  size_t     pfns_count;
+  size_t     pfns_alloc;
+  foldkey_t *keys;         // fold mode mapping grouping
+  size_t     keys_alloc;
+} snapwork_t;
+
+#define SNAPWORK_INIT { 0, 0, CAPBUF_INIT, 0, 0, CAPBUF_INIT, 0, 0, 0, 0, 0, 0, 0 }
+
+/* ------------------------------------------------------------------------- *
+ * snapwork_dtor  --  release worker scratch buffers
+ * ------------------------------------------------------------------------- */
+
+static void snapwork_dtor(snapwork_t *self)
+{
+  free(self->cmdline_text), self->cmdline_text = 0;
+  capbuf_dtor(&self->smaps);
+  free(self->vmas), self->vmas = 0;
+  capbuf_dtor(&self->deep);
+  free(self->pagemap), self->pagemap = 0;
+  free(self->counts), self->counts = 0;
+  free(self->pfns), self->pfns = 0;
+  self->pfns_count = self->pfns_alloc = 0;
+  free(self->keys), self->keys = 0;
+  self->keys_alloc = 0;
+}
+
+static const char *proc_root = "/proc"; // --proc-root, for test trees
+static int         proc_fd   = -1;      // proc_root, kept open between captures
+
+#define PROC_DIRENT_BUFF (128<<10) // getdents64 buffer size
+
+/* ------------------------------------------------------------------------- *
+ * linux_dirent64_t  --  directory entry returned by getdents64
+ * ------------------------------------------------------------------------- */
+
+typedef struct linux_dirent64_t
+{
+  uint64_t       d_ino;
+  int64_t        d_off;
+  unsigned short d_reclen;
+  unsigned char  d_type;
+  char           d_name[];
+} linux_dirent64_t;
+
+/* ------------------------------------------------------------------------- *
+ * snapjob_opendir  --  open /proc/pid directory for reading process files
+ *
+ * All files for the process are opened relative to the directory fd.
+ * If the pid gets reused while capturing, reads via the stale directory
+ * fail instead of returning data from another process.
+ * ------------------------------------------------------------------------- */
+
+static int snapjob_opendir(snapjob_t *self)
+{
+  char name[16];
+
+  snprintf(name, sizeof name, "%d", self->pid);
+  snprintf(self->where, sizeof self->where, "%s/%s", proc_root, name);
+
+  self->dirfd = openat(proc_fd, name, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  stats_file("dir", 0, 1);
+  if( self->dirfd == -1 )
+  {
+    msg_error("%s: %s\n", self->where, strerror(errno));
+  }
+  return self->dirfd;
+}
+
+/* ------------------------------------------------------------------------- *
+ * snapjob_closedir  --  close /proc/pid directory
+ * ------------------------------------------------------------------------- */
+
+static void snapjob_closedir(snapjob_t *self)
+{
+  if( self->dirfd != -1 )
+  {
+    close(self->dirfd), self->dirfd = -1;
+    stats_file("dir", 0, 1);
+  }
+}
+
+/* ------------------------------------------------------------------------- *
+ * snapjob_maps_file  --  name of the file holding mapping data, or NULL
+ * ------------------------------------------------------------------------- */
+
+static const char *snapjob_maps_file(const snapjob_t *self)
+{
+  switch( self->detail )
+  {
+  case DETAIL_MAPS: return "maps";
+  case DETAIL_NONE: return 0;
+  default:          return smaps;
+  }
+}
+
+/* ------------------------------------------------------------------------- *
+ * snapjob_read_smaps  --  append smaps data of the process to buffer
+ * ------------------------------------------------------------------------- */
+
+static void snapjob_read_smaps(snapjob_t *self, capbuf_t *buf)
+{
+  statclock_t clock;
+  uint64_t    until     = 0;
+  int         truncated = 0;
+
+  if( self->detail == DETAIL_NONE )
+  {
+    self->smaps_bytes = 0;
+    return;
+  }
+
+  if( deadline_proc > 0 )
+  {
+    until = self->time + (uint64_t)(deadline_proc * 1e9);
+  }
+
+  statclock_start(&clock);
+  self->smaps_bytes = capbuf_file(buf, self->dirfd, self->where,
+                                  snapjob_maps_file(self), until, &truncated);
+  if( truncated )
+  {
+    msg_warning("%s: smaps reading took too long, truncated\n", self->where);
+    self->partial = PARTIAL_TRUNCATED;
+  }
+  self->smaps_nsec  = statclock_stop(&clock, STATS_SMAPS);
+}
+
+/* ------------------------------------------------------------------------- *
+ * snapjob_dtor  --  release process capture data
+ * ------------------------------------------------------------------------- */
+
+static void snapjob_dtor(snapjob_t *self)
+{
+  capbuf_dtor(&self->record);
+  free(self->name), self->name = 0;
+  free(self->status_text), self->status_text = 0;
+  self->status_size = 0;
+  free(self->strids), self->strids = 0;
+  self->strids_count = self->strids_alloc = 0;
+  for( int i = 0; i < PREFETCH_FILES; ++i )
+  {
+    capbuf_dtor(&self->prefetch[i]);
+  }
+  self->prefetched = 0;
+  snapjob_closedir(self);
+}
+
+/* ------------------------------------------------------------------------- *
+ * snapjob_intern  --  get string id & remember it needs to be defined
+ * ------------------------------------------------------------------------- */
+
+static unsigned snapjob_intern(snapjob_t *self, const char *str)
+{
+  unsigned id = strtab_intern(str);
+
+  if( id != 0 )
+  {
+    if( self->strids_count == self->strids_alloc )
+    {
+      self->strids_alloc = self->strids_alloc ? self->strids_alloc * 2 : 64;
+      self->strids = realloc(self->strids,
+                             self->strids_alloc * sizeof *self->strids);
+      if( self->strids == 0 )
+      {
+        msg_fatal("string ids: %s\n", strerror(errno));
+      }
+    }
+    self->strids[self->strids_count++] = id;
+  }
+  return id;
+}
+
+/* ------------------------------------------------------------------------- *
+ * snapjob_compare_pid_cb  --  qsort callback for ordering by pid
+ * ------------------------------------------------------------------------- */
+
+static int snapjob_compare_pid_cb(const void *a1, const void *a2)
+{
+  const snapjob_t *j1 = a1;
+  const snapjob_t *j2 = a2;
+  return (j1->pid > j2->pid) - (j1->pid < j2->pid);
+}
+
+/* ------------------------------------------------------------------------- *
+ * snapshot_enumerate  --  list processes to capture in pid order
+ * ------------------------------------------------------------------------- */
+
+static int snapshot_enumerate(snapjob_t **pjobs, size_t *pcount)
+{
+  int        err   = -1;
+  char      *buff  = 0;
+  snapjob_t *jobs  = 0;
+  size_t     count = 0;
+  size_t     alloc = 0;
+  long       size;
+
+  if( proc_fd == -1 )
+  {
+    proc_fd = open(proc_root, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if( proc_fd == -1 )
+    {
+      perror(proc_root);
+      goto cleanup;
+    }
+  }
+  else if( lseek(proc_fd, 0, SEEK_SET) == -1 )
+  {
+    perror(proc_root);
+    goto cleanup;
+  }
+
+  if( (buff = malloc(PROC_DIRENT_BUFF)) == 0 )
+  {
+    msg_fatal("process list: %s\n", strerror(errno));
+  }
+
+  while( (size = syscall(SYS_getdents64, proc_fd, buff, PROC_DIRENT_BUFF)) > 0 )
+  {
+    stats_file("dir", size, 1);
+
+    for( long pos = 0; pos < size; )
+    {
+      linux_dirent64_t *de = (linux_dirent64_t *)(buff + pos);
+
+      pos += de->d_reclen;
+
+      if( de->d_type != DT_DIR && de->d_type != DT_UNKNOWN )
+      {
+        continue;
+      }
+      if( de->d_name[0] < '1' || '9' < de->d_name[0] )
+      {
+        continue;
+      }
+
+      if( count == alloc )
+      {
+        alloc = alloc ? alloc * 2 : 256;
+        if( (jobs = realloc(jobs, alloc * sizeof *jobs)) == 0 )
+        {
+          msg_fatal("process list: %s\n", strerror(errno));
+        }
+      }
+      memset(&jobs[count], 0, sizeof *jobs);
+      jobs[count].dirfd = -1;
+      jobs[count++].pid = strtol(de->d_name, 0, 10);
+    }
+  }
+
+  if( size == -1 )
+  {
+    perror(proc_root);
+    goto cleanup;
+  }
+
+  qsort(jobs, count, sizeof *jobs, snapjob_compare_pid_cb);
+
+  err = 0;
+
+  cleanup:
+
+  free(buff);
+
+  *pjobs  = jobs;
+  *pcount = count;
+
+  return err;
+}
+
+/* ------------------------------------------------------------------------- *
+ * snapshot_select  --  drop processes not selected from command line
+ * ------------------------------------------------------------------------- */
+
+static void snapshot_select(snapjob_t *jobs, size_t *pcount)
+{
+  size_t   count = *pcount;
+  size_t   keep  = 0;
+  pidset_t pids  = PIDSET_INIT;
+  int     *ppid  = 0;
+  char    *hit   = 0;
+
+  if( !select_active() )
+  {
+    return;
+  }
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * explicit pids & cgroup members
+   * - - - - - - - - - - - - - - - - - - - */
+
+  for( size_t i = 0; i < select_pid.count; ++i )
+  {
+    pidset_add(&pids, select_pid.pid[i]);
+  }
+  for( size_t i = 0; i < select_cgroups; ++i )
+  {
+    select_cgroup_pids(&pids, select_cgroup[i]);
+  }
+
+  hit = calloc(count ? count : 1, 1);
+
+  for( size_t i = 0; i < count; ++i )
+  {
+    hit[i] = pidset_has(&pids, jobs[i].pid);
+  }
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * descendants: walk up the parent chain
+   * until a tree root is found
+   * - - - - - - - - - - - - - - - - - - - */
+
+  if( select_tree.count )
+  {
+    ppid = calloc(count ? count : 1, sizeof *ppid);
+
+    for( size_t i = 0; i < count; ++i )
+    {
+      ppid[i] = select_read_ppid(proc_root, jobs[i].pid);
+    }
+
+    for( size_t i = 0; i < count; ++i )
+    {
+      int pid = jobs[i].pid;
+
+      for( size_t depth = 0; !hit[i] && pid > 0 && depth < count; ++depth )
+      {
+        snapjob_t  key = { .pid = pid };
+        snapjob_t *job;
+
+        if( pidset_has(&select_tree, pid) )
+        {
+          hit[i] = 1;
+          break;
+        }
+        job = bsearch(&key, jobs, count, sizeof *jobs, snapjob_compare_pid_cb);
+        pid = job ? ppid[job - jobs] : 0;
+      }
+    }
+  }
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * name / command line pattern
+   * - - - - - - - - - - - - - - - - - - - */
+
+  if( select_match )
+  {
+    for( size_t i = 0; i < count; ++i )
+    {
+      if( !hit[i] )
+      {
+        hit[i] = select_match_name(proc_root, jobs[i].pid);
+      }
+    }
+  }
+
+  for( size_t i = 0; i < count; ++i )
+  {
+    if( hit[i] )
+    {
+      jobs[keep++] = jobs[i];
+    }
+  }
+
+  msg_progress("selected %zu of %zu processes\n", keep, count);
+
+  *pcount = keep;
+
+  free(ppid);
+  free(hit);
+  pidset_dtor(&pids);
+}
+
+/* ------------------------------------------------------------------------- *
+ * snapshot_hybrid  --  decide which processes get full smaps data
+ *
+ * Reads status of every process. Kernel threads have no mappings and
+ * get nothing but status. Of the rest, the ones with VmRSS above the
+ * threshold or among the largest hybrid_top are captured in full, the
+ * others get just the mapping list from maps, which is much cheaper
+ * to read as the kernel does not need to walk the page tables.
+ * ------------------------------------------------------------------------- */
+
+typedef struct
+{
+  unsigned long rss;
+  size_t        job;
+} hybrid_rss_t;
+
+static int hybrid_rss_compare_cb(const void *a1, const void *a2)
+{
+  const hybrid_rss_t *r1 = a1;
+  const hybrid_rss_t *r2 = a2;
+  return (r1->rss < r2->rss) - (r1->rss > r2->rss);
+}
+
+static void snapshot_hybrid(snapjob_t *jobs, size_t count)
+{
+  hybrid_rss_t *rss      = calloc(count ? count : 1, sizeof *rss);
+  size_t        users    = 0;
+  size_t        detailed = 0;
+  size_t        kernel   = 0;
+  char          name[32];
+
+  if( rss == 0 )
+  {
+    msg_fatal("hybrid capture: %s\n", strerror(errno));
+  }
+
+  for( size_t i = 0; i < count; ++i )
+  {
+    snapjob_t *job = &jobs[i];
+
+    if( job->unchanged )
+    {
+      continue;
+    }
+
+    job->time = clock_nsec(CLOCK_MONOTONIC);
+    snprintf(name, sizeof name, "%d/status", job->pid);
+    input_file_at(proc_fd, proc_root, name,
+                  &job->status_text, &job->status_size);
+    proc_pid_status_parse(&job->status, job->status_text);
+    check_kthreadd(&job->status);
+
+    if( is_kthreadd(&job->status) || is_kernel_thread(&job->status) )
+    {
+      job->detail = DETAIL_NONE, ++kernel;
+      continue;
+    }
+
+    rss[users].rss = job->status.VmRSS ? strtoul(job->status.VmRSS, 0, 10) : 0;
+    rss[users].job = i;
+    ++users;
+  }
+
+  qsort(rss, users, sizeof *rss, hybrid_rss_compare_cb);
+
+  for( size_t i = 0; i < users; ++i )
+  {
+    int full = (i < hybrid_top) || (hybrid_rss != 0 && rss[i].rss > hybrid_rss);
+
+    jobs[rss[i].job].detail = full ? DETAIL_SMAPS : DETAIL_MAPS;
+    detailed += full;
+  }
+
+  msg_progress("hybrid: smaps for %zu, maps for %zu, %zu kernel threads\n",
+               detailed, users - detailed, kernel);
+
+  free(rss);
+}
+
+/* ------------------------------------------------------------------------- *
+ * snapshot_prefetch_file  --  name of prefetched file of given kind
+ * ------------------------------------------------------------------------- */
+
+static const char *snapshot_prefetch_file(const snapjob_t *job, int k)
+{
+  switch( k )
+  {
+  case PREFETCH_CMDLINE: return "cmdline";
+  case PREFETCH_STATUS:  return "status";
+  default:               return snapjob_maps_file(job);
+  }
+}
+
+/* ------------------------------------------------------------------------- *
+ * snapshot_prefetch  --  read /proc files for a batch of jobs via io_uring
+ *
+ * All files are first opened in one go, then read in rounds where
+ * each round has one read pending for every file not yet at EOF.
+ * ------------------------------------------------------------------------- */
+
+static void snapshot_prefetch(uring_t *ring, snapjob_t *jobs, size_t count)
+{
+  int      fd[count][PREFETCH_FILES];
+  size_t   pending = 0;
+  uint64_t data;
+  int      res;
+
+  statclock_t clock;
+
+  statclock_start(&clock);
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * open all files
+   * - - - - - - - - - - - - - - - - - - - */
+
+  for( size_t i = 0; i < count; ++i )
+  {
+    if( !jobs[i].unchanged && deadline_expired() )
+    {
+      jobs[i].partial = PARTIAL_SKIPPED;
+    }
+    else if( !jobs[i].unchanged && jobs[i].detail != DETAIL_NONE )
+    {
+      jobs[i].time = clock_nsec(CLOCK_MONOTONIC);
+      snapjob_opendir(&jobs[i]);
+    }
+
+    for( int k = 0; k < PREFETCH_FILES; ++k )
+    {
+      struct io_uring_sqe *sqe;
+
+      fd[i][k] = -1;
+      if( jobs[i].unchanged || jobs[i].dirfd == -1 )
+      {
+        continue;
+      }
+
+      sqe = uring_sqe(ring, IORING_OP_OPENAT, i * PREFETCH_FILES + k);
+      sqe->fd          = jobs[i].dirfd;
+      sqe->addr        = (uintptr_t)snapshot_prefetch_file(&jobs[i], k);
+      sqe->open_flags  = O_RDONLY|O_CLOEXEC;
+      stats_file(snapshot_prefetch_file(&jobs[i], k), 0, 2); // open & close
+      ++pending;
+    }
+  }
+
+  for( ; pending > 0; --pending )
+  {
+    uring_wait(ring, &data, &res);
+    fd[data / PREFETCH_FILES][data % PREFETCH_FILES] = res;
+    if( res < 0 )
+    {
+      input_error(jobs[data / PREFETCH_FILES].where,
+                  snapshot_prefetch_file(&jobs[data / PREFETCH_FILES],
+                                         data % PREFETCH_FILES), -res);
+    }
+  }
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * read until all files are at EOF
+   * - - - - - - - - - - - - - - - - - - - */
+
+  for( ;; )
+  {
+    for( size_t i = 0; i < count; ++i )
+    {
+      for( int k = 0; k < PREFETCH_FILES; ++k )
+      {
+        size_t chunk = (k == PREFETCH_SMAPS) ? TXBUFF : RXBUFF;
+        capbuf_t *buf = &jobs[i].prefetch[k];
+        struct io_uring_sqe *sqe;
+
+        if( fd[i][k] < 0 )
+        {
+          continue;
+        }
+
+        if( k == PREFETCH_SMAPS && deadline_proc > 0 &&
+            clock_nsec(CLOCK_MONOTONIC) - jobs[i].time > deadline_proc * 1e9 )
+        {
+          msg_warning("%s: smaps reading took too long, truncated\n",
+                      jobs[i].where);
+          jobs[i].partial = PARTIAL_TRUNCATED;
+          close(fd[i][k]), fd[i][k] = -1;
+          continue;
+        }
+
+        sqe = uring_sqe(ring, IORING_OP_READ, i * PREFETCH_FILES + k);
+        sqe->fd   = fd[i][k];
+        sqe->addr = (uintptr_t)capbuf_reserve(buf, chunk + 1);
+        sqe->len  = chunk;
+        sqe->off  = (uint64_t)-1; // current file position
+        stats_file(snapshot_prefetch_file(&jobs[i], k), 0, 1);
+        ++pending;
+      }
+    }
+
+    if( pending == 0 )
+    {
+      break;
+    }
+
+    for( ; pending > 0; --pending )
+    {
+      size_t i, k;
+
+      uring_wait(ring, &data, &res);
+      i = data / PREFETCH_FILES;
+      k = data % PREFETCH_FILES;
+
+      if( res > 0 )
+      {
+        jobs[i].prefetch[k].size += res;
+        stats_file(snapshot_prefetch_file(&jobs[i], k), res, 0);
+      }
+      else if( res == -EINTR || res == -EAGAIN )
+      {
+        // retry on next round
+      }
+      else
+      {
+        if( res < 0 )
+        {
+          input_error(jobs[i].where, snapshot_prefetch_file(&jobs[i], k), -res);
+        }
+        close(fd[i][k]), fd[i][k] = -1;
+
+        if( k == PREFETCH_SMAPS && stats )
+        {
+          /* latency within the batch, includes waiting for others */
+          jobs[i].smaps_nsec = clock_nsec(CLOCK_MONOTONIC) - clock.wall;
+        }
+      }
+    }
+  }
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * terminate text for parsing
+   * - - - - - - - - - - - - - - - - - - - */
+
+  for( size_t i = 0; i < count; ++i )
+  {
+    for( int k = 0; k < PREFETCH_FILES; ++k )
+    {
+      *capbuf_reserve(&jobs[i].prefetch[k], 1) = 0;
+    }
+    jobs[i].prefetched = (!jobs[i].unchanged &&
+                          jobs[i].detail != DETAIL_NONE &&
+                          jobs[i].partial != PARTIAL_SKIPPED);
+  }
+
+  statclock_stop(&clock, STATS_PREFETCH);
+}
+
+/* ------------------------------------------------------------------------- *
+ * snapshot_is_mapping  --  smaps line starts with "head-tail" address range
+ * ------------------------------------------------------------------------- */
+
+static int snapshot_is_mapping(const char *row)
+{
+  const char *pos = row;
+
+  while( isxdigit(uc(*pos)) ) ++pos;
+
+  return pos > row && *pos == '-';
+}
+
+/* ========================================================================= *
+ * Field Projection
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * With --fields only the selected smaps values are written for each
+ * mapping. The text parsers treat the missing ones as absent, and the
+ * binary format has a per process mask of the fields present anyway.
+ * ------------------------------------------------------------------------- */
+
+static uint64_t    fields_mask = 0; // smaps_fields bits to keep, 0 = all
+static const char *fields_list = 0; // as given on command line
+
+/* ------------------------------------------------------------------------- *
+ * fields_select  --  parse comma separated list of smaps fields to keep
+ * ------------------------------------------------------------------------- */
+
+static void fields_select(const char *list)
+{
+  char *work = strdup(list);
+  char *save = 0;
+
+  fields_list = list;
+  fields_mask = 0;
+
+  for( char *key = strtok_r(work, ",", &save); key;
+       key = strtok_r(0, ",", &save) )
+  {
+    size_t i = 0;
+
+    while( i < SMAPS_FIELDS && strcmp(smaps_fields[i], key) ) ++i;
+
+    if( i == SMAPS_FIELDS )
+    {
+      msg_fatal("unknown smaps field: '%s'\n", key);
+    }
+    fields_mask |= 1ull << i;
+  }
+  free(work);
+
+  if( fields_mask == 0 )
+  {
+    msg_fatal("no smaps fields selected: '%s'\n", list);
+  }
+}
+
+/* ------------------------------------------------------------------------- *
+ * fields_project  --  copy smaps text keeping only selected field lines
+ * ------------------------------------------------------------------------- */
+
+static void fields_project(const char *text, capbuf_t *out)
+{
+  while( *text )
+  {
+    const char *eol  = strchr(text, '\n');
+    const char *next = eol ? eol + 1 : text + strlen(text);
+    int         keep = snapshot_is_mapping(text);
+
+    if( !keep )
+    {
+      const char *col = memchr(text, ':', next - text);
+
+      for( size_t i = 0; col && i < SMAPS_FIELDS; ++i )
+      {
+        if( (fields_mask & (1ull << i)) &&
+            strlen(smaps_fields[i]) == (size_t)(col - text) &&
+            !memcmp(smaps_fields[i], text, col - text) )
+        {
+          keep = 1;
+          break;
+        }
+      }
+    }
+
+    if( keep )
+    {
+      memcpy(capbuf_reserve(out, next - text), text, next - text);
+      out->size += next - text;
+    }
+    text = next;
+  }
+}
+
+/* ========================================================================= *
+ * Mapping Folding
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * In fold mode, the mappings of a process that have the same path and
+ * protection are summed up into one record, the first of them. Vmas
+ * tells how many mappings were combined. The record keeps the address
+ * range of the first mapping, so that it does not overlap the others,
+ * and Size holds the total size of the group. As the postprocessing
+ * tools group mappings by path and type anyway, the reports stay the
+ * same while processes with tens of thousands of anonymous mappings
+ * take only a few records.
+ * ------------------------------------------------------------------------- */
+
+static size_t fold_vmas_in  = 0; // mappings read, updated atomically
+static size_t fold_vmas_out = 0; // records written
+
+/* ------------------------------------------------------------------------- *
+ * snapshot_parse_vmas  --  parse smaps text into worker mapping array
+ *
+ * Returns number of mappings, sets bits of smaps_fields seen in *pmask.
+ * The text is modified while parsing.
+ * ------------------------------------------------------------------------- */
+
+static size_t snapshot_parse_vmas(snapwork_t *work, snapjob_t *job,
+                                  char *pos, uint64_t *pmask)
+{
+  snapvma_t *vma   = 0;
+  size_t     count = 0;
+  uint64_t   mask  = 0;
+
+  while( *pos )
+  {
+    char *row = pos;
+    char *eol = strchr(pos, '\n');
+
+    if( eol != 0 )
+    {
+      *eol = 0, pos = eol + 1;
+    }
+    else
+    {
+      pos = row + strlen(row);
+    }
+
+    if( snapshot_is_mapping(row) )
+    {
+      unsigned long long head = 0, tail = 0, offs = 0, inode = 0;
+      unsigned major = 0, minor = 0;
+      char     prot[8] = "";
+      int      skip = 0;
+
+      sscanf(row, "%llx-%llx %7s %llx %x:%x %llu %n",
+             &head, &tail, prot, &offs, &major, &minor, &inode, &skip);
+
+      if( count == work->vmas_alloc )
+      {
+        work->vmas_alloc = work->vmas_alloc ? work->vmas_alloc * 2 : 256;
+        work->vmas = realloc(work->vmas, work->vmas_alloc * sizeof *work->vmas);
+        if( work->vmas == 0 )
+        {
+          msg_fatal("mapping list: %s\n", strerror(errno));
+        }
+      }
+      vma = &work->vmas[count++];
+      memset(vma, 0, sizeof *vma);
+
+      vma->head  = head;
+      vma->tail  = tail;
+      vma->offs  = offs;
+      vma->inode = inode;
+      vma->major = major;
+      vma->minor = minor;
+      vma->prot  = smapsbin_prot_bits(prot);
+      vma->path  = skip ? snapjob_intern(job, strip(row + skip)) : 0;
+    }
+    else if( vma != 0 )
+    {
+      char *val = strchr(row, ':');
+
+      if( val == 0 )
+      {
+        continue;
+      }
+      *val++ = 0;
+
+      for( size_t i = 0; i < SMAPS_FIELDS; ++i )
+      {
+        if( !strcmp(smaps_fields[i], row) )
+        {
+          vma->value[i] = strtoull(val, 0, 10);
+          mask |= 1ull << i;
+          break;
+        }
+      }
+    }
+  }
+
+  /* folded records need Size, their address range is the first one's */
+  if( fields_mask )
+  {
+    mask &= fields_mask | (fold ? 1ull << SMAPS_FIELD_SIZE : 0);
+  }
+  *pmask = mask;
+  return count;
+}
+
+/* ------------------------------------------------------------------------- *
+ * foldkey_compare_cb  --  qsort callback for ordering by path, prot & index
+ * ------------------------------------------------------------------------- */
+
+static int foldkey_compare_cb(const void *a1, const void *a2)
+{
+  const foldkey_t *k1 = a1;
+  const foldkey_t *k2 = a2;
+
+  if( k1->path  != k2->path  ) return (k1->path  > k2->path)  ? 1 : -1;
+  if( k1->prot  != k2->prot  ) return (k1->prot  > k2->prot)  ? 1 : -1;
+  if( k1->index != k2->index ) return (k1->index > k2->index) ? 1 : -1;
+  return 0;
+}
+
+/* ------------------------------------------------------------------------- *
+ * snapshot_fold  --  combine mappings with same path & protection
+ *
+ * Returns the number of records left in the mapping array, which keeps
+ * the address order of the first mapping of each group.
+ * ------------------------------------------------------------------------- */
+
+static size_t snapshot_fold(snapwork_t *work, size_t count, uint64_t *pmask)
+{
+  snapvma_t *vmas = work->vmas;
+  size_t     kept = 0;
+
+  if( count > work->keys_alloc )
+  {
+    work->keys_alloc = count;
+    free(work->keys);
+    if( (work->keys = malloc(count * sizeof *work->keys)) == 0 )
+    {
+      msg_fatal("fold keys: %s\n", strerror(errno));
+    }
+  }
+
+  for( size_t i = 0; i < count; ++i )
+  {
+    work->keys[i].path  = vmas[i].path;
+    work->keys[i].prot  = vmas[i].prot;
+    work->keys[i].index = i;
+    vmas[i].value[SMAPS_FIELD_VMAS] = 1;
+  }
+  qsort(work->keys, count, sizeof *work->keys, foldkey_compare_cb);
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * sum each group into its first mapping,
+   * the others are left with zero Vmas
+   * - - - - - - - - - - - - - - - - - - - */
+
+  for( size_t i = 0; i < count; )
+  {
+    snapvma_t *lead = &vmas[work->keys[i].index];
+    size_t     k    = i + 1;
+
+    for( ; k < count && work->keys[k].path == work->keys[i].path &&
+           work->keys[k].prot == work->keys[i].prot; ++k )
+    {
+      snapvma_t *vma = &vmas[work->keys[k].index];
+
+      for( size_t f = 0; f < SMAPS_FIELDS; ++f )
+      {
+        /* page sizes are properties, not amounts */
+        if( f != SMAPS_FIELD_KERNELPAGESIZE && f != SMAPS_FIELD_MMUPAGESIZE )
+        {
+          lead->value[f] += vma->value[f];
+        }
+      }
+      vma->value[SMAPS_FIELD_VMAS] = 0;
+    }
+    i = k;
+  }
+
+  for( size_t i = 0; i < count; ++i )
+  {
+    if( vmas[i].value[SMAPS_FIELD_VMAS] != 0 )
+    {
+      vmas[kept++] = vmas[i];
+    }
+  }
+
+  __atomic_add_fetch(&fold_vmas_in,  count, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&fold_vmas_out, kept,  __ATOMIC_RELAXED);
+
+  *pmask |= 1ull << SMAPS_FIELD_VMAS;
+  return kept;
+}
+
+/* ------------------------------------------------------------------------- *
+ * snapshot_fold_text  --  fold smaps text into text capture record
+ * ------------------------------------------------------------------------- */
+
+static void snapshot_fold_text(snapwork_t *work, snapjob_t *job, char *text,
+                               capbuf_t *out)
+{
+  uint64_t mask  = 0;
+  size_t   count = snapshot_parse_vmas(work, job, text, &mask);
+
+  count = snapshot_fold(work, count, &mask);
+
+  for( size_t k = 0; k < count; ++k )
+  {
+    const snapvma_t *vma = &work->vmas[k];
+    const char      *path = strtab_string(vma->path);
+    char             prot[8];
+    size_t           len  = out->size;
+
+    capbuf_fmt(out, "%08"PRIx64"-%08"PRIx64" %s %08"PRIx64" %02x:%02x %"PRIu64" ",
+               vma->head, vma->tail, smapsbin_prot_text(prot, vma->prot),
+               vma->offs, vma->major, vma->minor, vma->inode);
+
+    /* pad path to the same column as the kernel does */
+    len = out->size - len;
+    capbuf_fmt(out, "%*s%s\n", *path && len < 73 ? (int)(73 - len) : 0, "",
+               path);
+
+    for( size_t i = 0; i < SMAPS_FIELDS; ++i )
+    {
+      if( mask & (1ull << i) )
+      {
+        capbuf_fmt(out, "%s:%*s%8"PRIu64"%s\n", smaps_fields[i],
+                   (int)(15 - strlen(smaps_fields[i])), "", vma->value[i],
+                   i == SMAPS_FIELD_VMAS ? "" : " kB");
+      }
+    }
+  }
+}
+
+/* ------------------------------------------------------------------------- *
+ * fold_finish  --  write folding totals to capture trailer
+ * ------------------------------------------------------------------------- */
+
+static void fold_finish(void)
+{
+  output_info("Folded", "%zu mappings into %zu records",
+              fold_vmas_in, fold_vmas_out);
+  fold_vmas_in = fold_vmas_out = 0;
+}
+
+/* ========================================================================= *
+ * Deep Capture: Exact Page Sharing via pagemap & kpagecount
+ * ========================================================================= */
+
+#define PAGEMAP_PRESENT  (1ull << 63)
+#define PAGEMAP_PFN_MASK ((1ull << 55) - 1)
+
+#define DEEP_CHUNK 4096 // pagemap entries handled at once
+
+/* ------------------------------------------------------------------------- *
+ * pfnset_t  --  set of physical frame numbers, two level bitmap
+ * ------------------------------------------------------------------------- */
+
+#define PFNSET_LEAF_BITS 18 // frames per leaf bitmap, 32 kB each
+
+typedef struct pfnset_t
+{
+  uint64_t **leaf;
+  size_t     leaves;
+  uint64_t   count;  // frames in set
+} pfnset_t;
+
+#define PFNSET_INIT { 0, 0, 0 }
+
+/* ------------------------------------------------------------------------- *
+ * pfnset_add  --  add frame to set, returns 1 if it was not there yet
+ * ------------------------------------------------------------------------- */
+
+static int pfnset_add(pfnset_t *self, uint64_t pfn)
+{
+  size_t    top  = pfn >> PFNSET_LEAF_BITS;
+  uint64_t  bit  = pfn & ((1u << PFNSET_LEAF_BITS) - 1);
+  uint64_t *word;
+
+  if( top >= self->leaves )
+  {
+    size_t leaves = top + 1;
+    if( (self->leaf = realloc(self->leaf, leaves * sizeof *self->leaf)) == 0 )
+    {
+      msg_fatal("frame set: %s\n", strerror(errno));
+    }
+    memset(self->leaf + self->leaves, 0,
+           (leaves - self->leaves) * sizeof *self->leaf);
+    self->leaves = leaves;
+  }
+
+  if( self->leaf[top] == 0 &&
+      (self->leaf[top] = calloc(1 << (PFNSET_LEAF_BITS - 6), 8)) == 0 )
+  {
+    msg_fatal("frame set: %s\n", strerror(errno));
+  }
+
+  word = &self->leaf[top][bit >> 6];
+  if( *word & (1ull << (bit & 63)) )
+  {
+    return 0;
+  }
+  *word |= 1ull << (bit & 63);
+  self->count += 1;
+  return 1;
+}
+
+/* ------------------------------------------------------------------------- *
+ * pfnset_dtor  --  release frame set
+ * ------------------------------------------------------------------------- */
+
+static void pfnset_dtor(pfnset_t *self)
+{
+  for( size_t i = 0; i < self->leaves; ++i )
+  {
+    free(self->leaf[i]);
+  }
+  free(self->leaf), self->leaf = 0;
+  self->leaves = 0;
+  self->count  = 0;
+}
+
+/* ------------------------------------------------------------------------- *
+ * deep mode state, frame sets are shared by all workers
+ * ------------------------------------------------------------------------- */
+
+static int             deep            = 0;  // --deep
+static int             deep_kpagecount = -1; // /proc/kpagecount
+static int             deep_nopfn      = 0;  // pagemap hides frame numbers
+static pthread_mutex_t deep_mutex      = PTHREAD_MUTEX_INITIALIZER;
+static pfnset_t        deep_frames     = PFNSET_INIT; // any captured process
+static pfnset_t        deep_shared     = PFNSET_INIT; // more than one process
+
+/* ------------------------------------------------------------------------- *
+ * deep_start  --  prepare for deep capture
+ * ------------------------------------------------------------------------- */
+
+static int deep_start(void)
+{
+  pfnset_dtor(&deep_frames);
+  pfnset_dtor(&deep_shared);
+  deep_nopfn = 0;
+
+  if( deep_kpagecount == -1 &&
+      (deep_kpagecount = open("/proc/kpagecount", O_RDONLY|O_CLOEXEC)) == -1 )
+  {
+    msg_error("/proc/kpagecount: %s (deep capture needs root)\n",
+              strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/* ------------------------------------------------------------------------- *
+ * deep_push_pfn  --  remember frame mapped by the current process
+ * ------------------------------------------------------------------------- */
+
+static void deep_push_pfn(snapwork_t *work, uint64_t pfn)
+{
+  if( work->pfns_count == work->pfns_alloc )
+  {
+    work->pfns_alloc = work->pfns_alloc ? work->pfns_alloc * 2 : 4096;
+    work->pfns = realloc(work->pfns, work->pfns_alloc * sizeof *work->pfns);
+    if( work->pfns == 0 )
+    {
+      msg_fatal("frame list: %s\n", strerror(errno));
+    }
+  }
+  work->pfns[work->pfns_count++] = pfn;
+}
+
+/* ------------------------------------------------------------------------- *
+ * deep_vma  --  count pages of mapping not mapped anywhere else
+ *
+ * Frames of resident pages are looked up from pagemap and their map
+ * counts from kpagecount. Runs of consecutive frames are resolved
+ * with a single kpagecount read.
+ * ------------------------------------------------------------------------- */
+
+static uint64_t deep_vma(snapwork_t *work, int pagemap,
+                         uint64_t head, uint64_t tail)
+{
+  uint64_t uss   = 0;
+  uint64_t psize = (uint64_t)sysconf(_SC_PAGESIZE);
+
+  if( work->pagemap == 0 )
+  {
+    work->pagemap = malloc(DEEP_CHUNK * sizeof *work->pagemap);
+    work->counts  = malloc(DEEP_CHUNK * sizeof *work->counts);
+    if( work->pagemap == 0 || work->counts == 0 )
+    {
+      msg_fatal("pagemap: %s\n", strerror(errno));
+    }
+  }
+
+  for( uint64_t addr = head; addr < tail; )
+  {
+    size_t  n  = (tail - addr) / psize;
+    ssize_t rc;
+
+    if( n > DEEP_CHUNK ) n = DEEP_CHUNK;
+
+    rc = pread(pagemap, work->pagemap, n * sizeof *work->pagemap,
+               addr / psize * sizeof *work->pagemap);
+    if( rc <= 0 )
+    {
+      break;
+    }
+    n = rc / sizeof *work->pagemap;
+
+    for( size_t i = 0; i < n; )
+    {
+      uint64_t pfn = work->pagemap[i] & PAGEMAP_PFN_MASK;
+      size_t   k   = i + 1;
+
+      if( !(work->pagemap[i] & PAGEMAP_PRESENT) )
+      {
+        ++i;
+        continue;
+      }
+      if( pfn == 0 )
+      {
+        deep_nopfn = 1;
+        ++i;
+        continue;
+      }
+
+      while( k < n && (work->pagemap[k] & PAGEMAP_PRESENT) &&
+             (work->pagemap[k] & PAGEMAP_PFN_MASK) == pfn + (k - i) )
+      {
+        ++k;
+      }
+
+      rc = pread(deep_kpagecount, work->counts,
+                 (k - i) * sizeof *work->counts, pfn * sizeof *work->counts);
+
+      /* on read errors no map counts are known -> no uss for the run */
+      size_t counted = (rc > 0) ? (size_t)rc / sizeof *work->counts : 0;
+
+      for( size_t j = 0; j < k - i; ++j )
+      {
+        if( j < counted && work->counts[j] == 1 )
+        {
+          ++uss;
+        }
+        deep_push_pfn(work, pfn + j);
+      }
+      i = k;
+    }
+    addr += n * psize;
+  }
+
+  return uss * psize / 1024;
+}
+
+/* ------------------------------------------------------------------------- *
+ * deep_compare_pfn_cb  --  qsort callback for ordering frames
+ * ------------------------------------------------------------------------- */
+
+static int deep_compare_pfn_cb(const void *a1, const void *a2)
+{
+  uint64_t p1 = *(const uint64_t *)a1;
+  uint64_t p2 = *(const uint64_t *)a2;
+  return (p1 > p2) - (p1 < p2);
+}
+
+/* ------------------------------------------------------------------------- *
+ * deep_merge  --  add frames of the current process to shared sets
+ * ------------------------------------------------------------------------- */
+
+static void deep_merge(snapwork_t *work)
+{
+  qsort(work->pfns, work->pfns_count, sizeof *work->pfns,
+        deep_compare_pfn_cb);
+
+  pthread_mutex_lock(&deep_mutex);
+  for( size_t i = 0; i < work->pfns_count; ++i )
+  {
+    if( i > 0 && work->pfns[i] == work->pfns[i-1] )
+    {
+      continue;
+    }
+    if( !pfnset_add(&deep_frames, work->pfns[i]) )
+    {
+      pfnset_add(&deep_shared, work->pfns[i]);
+    }
+  }
+  pthread_mutex_unlock(&deep_mutex);
+
+  work->pfns_count = 0;
+}
+
+/* ------------------------------------------------------------------------- *
+ * deep_annotate  --  copy smaps text adding Uss line for each mapping
+ * ------------------------------------------------------------------------- */
+
+static void deep_annotate(snapwork_t *work, snapjob_t *job,
+                          const char *text, capbuf_t *out)
+{
+  int      pagemap = -2; // opened when needed, -1 on failure
+  int      pending = 0;
+  uint64_t head = 0, tail = 0, rss = 0;
+
+  for( ;; )
+  {
+    const char *row = text;
+    const char *eol = strchr(text, '\n');
+    size_t      len = eol ? (size_t)(eol + 1 - row) : strlen(row);
+
+    /* - - - - - - - - - - - - - - - - - - - *
+     * end of mapping block -> add Uss line
+     * - - - - - - - - - - - - - - - - - - - */
+
+    if( pending && (*row == 0 || snapshot_is_mapping(row)) )
+    {
+      uint64_t uss = 0;
+      if( rss != 0 && pagemap == -2 )
+      {
+        pagemap = input_open(job->dirfd, job->where, "pagemap");
+      }
+      if( rss != 0 && pagemap >= 0 )
+      {
+        uss = deep_vma(work, pagemap, head, tail);
+      }
+      capbuf_fmt(out, "Uss:            %8"PRIu64" kB\n", uss);
+      pending = 0;
+    }
+
+    if( *row == 0 )
+    {
+      break;
+    }
+
+    if( snapshot_is_mapping(row) )
+    {
+      char *pos = 0;
+      head = strtoull(row, &pos, 16);
+      tail = strtoull(pos + 1, 0, 16);
+      rss  = 0;
+      pending = 1;
+    }
+    else if( !strncmp(row, "Rss:", 4) )
+    {
+      rss = strtoull(row + 4, 0, 10);
+    }
+
+    memcpy(capbuf_reserve(out, len), row, len);
+    out->size += len;
+    text += len;
+  }
+
+  if( pagemap >= 0 )
+  {
+    close(pagemap);
+  }
+
+  deep_merge(work);
+}
+
+/* ------------------------------------------------------------------------- *
+ * deep_finish  --  write system wide frame counts to capture trailer
+ * ------------------------------------------------------------------------- */
+
+static void deep_finish(void)
+{
+  uint64_t kb = (uint64_t)sysconf(_SC_PAGESIZE) / 1024;
+
+  if( deep_nopfn )
+  {
+    msg_warning("pagemap did not reveal frame numbers, "
+                "deep capture needs CAP_SYS_ADMIN\n");
+  }
+  output_info("Resident", "%"PRIu64" kB", deep_frames.count * kb);
+  output_info("Shared", "%"PRIu64" kB", deep_shared.count * kb);
+}
+
+/* ------------------------------------------------------------------------- *
+ * snapshot_encode  --  read smaps for one process into binary job record
+ * ------------------------------------------------------------------------- */
+
+static void snapshot_encode(snapwork_t *work, snapjob_t *job)
+{
+  capbuf_t  *rec   = &job->record;
+  snapvma_t *vma   = 0;
+  size_t     count = 0;
+  uint64_t   mask  = 0;
+  char      *pos;
+
+  statclock_t clock;
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * parse smaps text into mapping array
+   * - - - - - - - - - - - - - - - - - - - */
+
+  if( job->prefetched )
+  {
+    job->smaps_bytes = job->prefetch[PREFETCH_SMAPS].size;
+    pos = job->prefetch[PREFETCH_SMAPS].data;
+  }
+  else
+  {
+    work->smaps.size = 0;
+    snapjob_read_smaps(job, &work->smaps);
+    *capbuf_reserve(&work->smaps, 1) = 0;
+    pos = work->smaps.data;
+  }
+
+  statclock_start(&clock);
+
+  if( deep && job->detail == DETAIL_SMAPS )
+  {
+    work->deep.size = 0;
+    deep_annotate(work, job, pos, &work->deep);
+    *capbuf_reserve(&work->deep, 1) = 0;
+    pos = work->deep.data;
+  }
+
+  count = snapshot_parse_vmas(work, job, pos, &mask);
+
+  if( fold )
+  {
+    count = snapshot_fold(work, count, &mask);
+  }
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * process record: status values are
+   * stored only if present
+   * - - - - - - - - - - - - - - - - - - - */
+
+  {
+    uint64_t status[STATUS_FIELDS];
+    uint64_t present = 0;
+    unsigned bit     = 0;
+
+#define X(v) if( job->status.v ) { present |= 1ull << bit; status[bit] = strtoull(job->status.v, 0, 10); } ++bit;
+    PROC_PID_STATUS_FIELDS(X)
+#undef X
+
+    if( job->status.NSpid )
+    {
+      const char *last = strrchr(job->status.NSpid, ' ');
+      present |= 1ull << bit;
+      status[bit] = strtoull(last ? last + 1 : job->status.NSpid, 0, 10);
+    }
+    ++bit;
+
+    if( job->detail == DETAIL_MAPS )
+    {
+      present |= 1ull << bit;
+      status[bit] = 1;
+    }
+    ++bit;
+
+    capbuf_byte(rec, SMAPSBIN_TIME);
+    capbuf_varint(rec, (job->time - capture_started) / 1000);
+
+    capbuf_byte(rec, SMAPSBIN_PROCESS);
+    capbuf_varint(rec, job->pid);
+    capbuf_varint(rec, snapjob_intern(job, job->name));
+    capbuf_varint(rec, present);
+    for( size_t i = 0; i < STATUS_FIELDS; ++i )
+    {
+      if( present & (1ull << i) ) capbuf_varint(rec, status[i]);
+    }
+    capbuf_varint(rec, mask);
+  }
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * mapping records: addresses and values
+   * delta encoded against previous mapping
+   * - - - - - - - - - - - - - - - - - - - */
+
+  {
+    uint64_t tail = 0;
+    uint64_t prev[SMAPS_FIELDS];
+
+    memset(prev, 0, sizeof prev);
+
+    for( size_t k = 0; k < count; ++k )
+    {
+      vma = &work->vmas[k];
+
+      capbuf_byte(rec, SMAPSBIN_MAPPING);
+      capbuf_varint(rec, smapsbin_zigzag((int64_t)(vma->head - tail)));
+      capbuf_varint(rec, vma->tail - vma->head);
+      capbuf_varint(rec, vma->prot);
+      capbuf_varint(rec, vma->offs);
+      capbuf_varint(rec, vma->major);
+      capbuf_varint(rec, vma->minor);
+      capbuf_varint(rec, vma->inode);
+      capbuf_varint(rec, vma->path);
+
+      for( size_t i = 0; i < SMAPS_FIELDS; ++i )
+      {
+        if( mask & (1ull << i) )
+        {
+          capbuf_varint(rec, smapsbin_zigzag((int64_t)(vma->value[i] - prev[i])));
+          prev[i] = vma->value[i];
+        }
+      }
+      tail = vma->tail;
+    }
+  }
+
+  statclock_stop(&clock, STATS_CAPTURE);
+}
+
+/* ------------------------------------------------------------------------- *
+ * snapshot_capture  --  read /proc data for one process into job record
+ * ------------------------------------------------------------------------- */
+
+static void snapshot_capture(snapwork_t *work, snapjob_t *job)
+{
+  char exe[256];
+  char *name = NULL;
+  char *cmdline;
+  statclock_t clock;
+
+  statclock_start(&clock);
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * unchanged since previous capture ->
+   * just refer to it
+   * - - - - - - - - - - - - - - - - - - - */
+
+  if( job->unchanged )
+  {
+    if( binary )
+    {
+      capbuf_byte(&job->record, SMAPSBIN_UNCHANGED);
+      capbuf_varint(&job->record, job->pid);
+    }
+    else
+    {
+      capbuf_fmt(&job->record, "==> /proc/%d/%s <==\n#Unchanged: 1\n",
+                 job->pid, smaps);
+    }
+    job->deferred = 0;
+    statclock_stop(&clock, STATS_CAPTURE);
+    return;
+  }
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * out of time -> leave out of capture,
+   * data already prefetched is used
+   * - - - - - - - - - - - - - - - - - - - */
+
+  if( job->partial == PARTIAL_SKIPPED ||
+      (!job->prefetched && deadline_expired()) )
+  {
+    job->partial  = PARTIAL_SKIPPED;
+    job->deferred = 0;
+    statclock_stop(&clock, STATS_CAPTURE);
+    return;
+  }
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * /proc/pid/exe -> link to executable
+   * - - - - - - - - - - - - - - - - - - - */
+
+  /* kernel threads were timed when status was read */
+  if( !job->prefetched && job->detail != DETAIL_NONE )
+  {
+    job->time = clock_nsec(CLOCK_MONOTONIC);
+    snapjob_opendir(job);
+  }
+
+  int n = -1;
+  if( job->dirfd != -1 )
+  {
+    n = readlinkat(job->dirfd, "exe", exe, sizeof exe - 1);
+    stats_file("exe", n>0?n:0, 1);
+  }
+  exe[n>0?n:0] = 0;
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * /proc/pid/cmdline -> argv[] data
+   * - - - - - - - - - - - - - - - - - - - */
+
+  if( job->prefetched )
+  {
+    cmdline = job->prefetch[PREFETCH_CMDLINE].data;
+  }
+  else
+  {
+    input_file_at(job->dirfd, job->where, "cmdline",
+                  &work->cmdline_text, &work->cmdline_size);
+    cmdline = work->cmdline_text;
+  }
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * /proc/pid/status -> name, pid, ...
+   * - - - - - - - - - - - - - - - - - - - */
+
+  if( job->prefetched )
+  {
+    proc_pid_status_parse(&job->status, job->prefetch[PREFETCH_STATUS].data);
+  }
+  else if( job->status_text == 0 )
+  {
+    /* hybrid mode has parsed status already */
+    input_file_at(job->dirfd, job->where, "status",
+                  &job->status_text, &job->status_size);
+    proc_pid_status_parse(&job->status, job->status_text);
+  }
+
+  name = strip(cmdline);
+
+  if( name == NULL || *name == 0 )
+  {
+    name = strip(exe);
+  }
+  if( name == NULL || *name == 0 )
+  {
+    name = strip(job->status.Name);
+  }
+  if( name == NULL || *name == 0 )
+  {
+    name = "unknown";
+  }
+
+  job->name = strdup(name);
+
+  if( binary )
+  {
+    statclock_stop(&clock, STATS_CAPTURE);
+    snapshot_encode(work, job);
+    snapjob_closedir(job);
+    return;
+  }
+
+  /* records name the real /proc even when reading a test tree, as
+   * that is what the postprocessing tools look for */
+  capbuf_fmt(&job->record, "==> /proc/%d/%s <==\n", job->pid, smaps);
+  capbuf_fmt(&job->record, "#Name: %s\n", name);
+  capbuf_fmt(&job->record, "#Time: %.6f\n", job->time * 1e-9);
+
+#define X(v) if( job->status.v ) capbuf_fmt(&job->record, "#%s: %s\n",#v,job->status.v);
+  PROC_PID_STATUS_FIELDS(X)
+  X(NSpid)
+#undef X
+
+  if( job->detail == DETAIL_MAPS )
+  {
+    capbuf_fmt(&job->record, "#Brief: 1\n");
+  }
+
+  statclock_stop(&clock, STATS_CAPTURE);
+
+  if( (deep || fold || fields_mask) && job->detail == DETAIL_SMAPS )
+  {
+    capbuf_t *smaps_text = &job->prefetch[PREFETCH_SMAPS];
+
+    if( job->prefetched )
+    {
+      job->smaps_bytes = smaps_text->size;
+    }
+    else
+    {
+      smaps_text = &work->smaps;
+      smaps_text->size = 0;
+      snapjob_read_smaps(job, smaps_text);
+      *capbuf_reserve(smaps_text, 1) = 0;
+    }
+
+    statclock_start(&clock);
+    if( !fold && !fields_mask )
+    {
+      deep_annotate(work, job, smaps_text->data, &job->record);
+    }
+    else
+    {
+      char *text = smaps_text->data;
+
+      if( deep )
+      {
+        work->deep.size = 0;
+        deep_annotate(work, job, text, &work->deep);
+        *capbuf_reserve(&work->deep, 1) = 0;
+        text = work->deep.data;
+      }
+
+      if( fold )
+      {
+        snapshot_fold_text(work, job, text, &job->record);
+      }
+      else
+      {
+        fields_project(text, &job->record);
+      }
+    }
+    statclock_stop(&clock, STATS_CAPTURE);
+
+    /* annotated, folded or projected copy is in the record already */
+    job->prefetch[PREFETCH_SMAPS].size = 0;
+  }
+  else if( job->prefetched )
+  {
+    job->smaps_bytes = job->prefetch[PREFETCH_SMAPS].size;
+  }
+  else if( !job->deferred )
+  {
+    snapjob_read_smaps(job, &job->record);
+  }
+
+  if( !job->deferred )
+  {
+    snapjob_closedir(job);
+  }
+}
+
+/* ------------------------------------------------------------------------- *
+ * snapshot_emit  --  write job record to output & release it
+ * ------------------------------------------------------------------------- */
+
+static void snapshot_emit(snapjob_t *job, int first)
+{
+  statclock_t clock;
+
+  if( job->partial == PARTIAL_SKIPPED )
+  {
+    snapjob_dtor(job);
+    return;
+  }
+
+  check_kthreadd(&job->status);
+
+  statclock_start(&clock);
+
+  if( binary )
+  {
+    for( size_t i = 0; i < job->strids_count; ++i )
+    {
+      strtab_output(job->strids[i]);
+    }
+  }
+  else if( !first )
+  {
+    output_raw("\n",1);
+  }
+
+  if( job->deferred )
+  {
+    if( output_zerocopy )
+    {
+      output_writev(job->record.data, job->record.size);
+    }
+    else
+    {
+      output_raw(job->record.data, job->record.size);
+    }
+    statclock_stop(&clock, STATS_OUTPUT);
+
+    /* smaps is read straight to output */
+    statclock_start(&clock);
+    job->smaps_bytes = 0;
+    if( job->detail != DETAIL_NONE )
+    {
+      job->smaps_bytes = output_file(job->dirfd, job->where,
+                                     snapjob_maps_file(job));
+    }
+    job->smaps_nsec  = statclock_stop(&clock, STATS_SMAPS);
+  }
+  else
+  {
+    output_raw(job->record.data, job->record.size);
+
+    if( job->prefetched && !binary )
+    {
+      output_raw(job->prefetch[PREFETCH_SMAPS].data,
+                 job->prefetch[PREFETCH_SMAPS].size);
+    }
+    statclock_stop(&clock, STATS_OUTPUT);
+  }
+
+  if( !job->unchanged )
+  {
+    stats_slow_add(job->pid, job->smaps_nsec, job->smaps_bytes, job->name);
+  }
+
+  if (job->smaps_bytes == 0
+      && !job->unchanged
+      && !is_kthreadd(&job->status)
+      && !is_kernel_thread(&job->status))
+  {
+    msg_warning("`%s/%d/%s' is empty for process named '%s'!\n",
+                proc_root, job->pid, smaps, job->name);
+  }
+
+  snapjob_dtor(job);
+}
+
+/* ------------------------------------------------------------------------- *
+ * snappool_t  --  work queue shared by capture worker threads
+ * ------------------------------------------------------------------------- */
+
+typedef struct snappool_t
+{
+  pthread_mutex_t  mutex;
+  pthread_cond_t   ready;
+  snapjob_t       *jobs;
+  size_t           count;
+  size_t           next;  // next job to hand out to a worker
+} snappool_t;
+
+/* ------------------------------------------------------------------------- *
+ * snappool_worker  --  capture thread: take jobs until none are left
+ * ------------------------------------------------------------------------- */
+
+static void *snappool_worker(void *aptr)
+{
+  snappool_t *pool = aptr;
+  snapwork_t  work = SNAPWORK_INIT;
+
+  for( ;; )
+  {
+    snapjob_t *job   = 0;
+    size_t     bytes = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    if( pool->next < pool->count )
+    {
+      job = &pool->jobs[pool->next++];
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    if( job == 0 )
+    {
+      break;
+    }
+
+    snapshot_capture(&work, job);
+    bytes = job->smaps_bytes;
+
+    pthread_mutex_lock(&pool->mutex);
+    job->done = 1;
+    pthread_cond_broadcast(&pool->ready);
+    pthread_mutex_unlock(&pool->mutex);
+
+    gentle_pace(bytes);
+  }
+
+  snapwork_dtor(&work);
+  return 0;
+}
+
+/* ------------------------------------------------------------------------- *
+ * snapshot_parallel  --  capture using worker threads, emit in pid order
+ * ------------------------------------------------------------------------- */
+
+static void snapshot_parallel(snapjob_t *jobs, size_t count, int threads)
+{
+  snappool_t pool;
+  pthread_t *tids    = calloc(threads, sizeof *tids);
+  int        started = 0;
+
+  if( tids == 0 )
+  {
+    msg_warning("worker list: %s\n", strerror(errno));
+    threads = 0;
+  }
+
+  pthread_mutex_init(&pool.mutex, 0);
+  pthread_cond_init(&pool.ready, 0);
+  pool.jobs  = jobs;
+  pool.count = count;
+  pool.next  = 0;
+
+  while( started < threads )
+  {
+    int rc = pthread_create(&tids[started], 0, snappool_worker, &pool);
+    if( rc != 0 )
+    {
+      msg_warning("unable to start worker thread: %s\n", strerror(rc));
+      break;
+    }
+    ++started;
+  }
+
+  msg_progress("capturing %zu processes using %d workers\n", count, started);
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * If no threads could be created, the
+   * main thread does all of the work.
+   * - - - - - - - - - - - - - - - - - - - */
+
+  if( started == 0 )
+  {
+    snappool_worker(&pool);
+  }
+
+  for( size_t i = 0; i < count; ++i )
+  {
+    pthread_mutex_lock(&pool.mutex);
+    while( !jobs[i].done )
+    {
+      pthread_cond_wait(&pool.ready, &pool.mutex);
+    }
+    pthread_mutex_unlock(&pool.mutex);
+
+    snapshot_emit(&jobs[i], i == 0);
+  }
+
+  while( started > 0 )
+  {
+    pthread_join(tids[--started], 0);
+  }
+  free(tids);
+
+  pthread_cond_destroy(&pool.ready);
+  pthread_mutex_destroy(&pool.mutex);
+}
+
+/* ------------------------------------------------------------------------- *
+ * snapshot_sysinfo  --  copy system wide memory statistics to header
+ * ------------------------------------------------------------------------- */
+
+static const char *const sysinfo_files[] =
+{
+  "meminfo",
+  "vmstat",
+  "slabinfo",
+  "zoneinfo",
+  "buddyinfo",
+  0
+};
+
+static void snapshot_sysinfo(void)
+{
+  char   *text = 0;
+  size_t  size = 0;
+
+  /* by default only meminfo, needed for reconciling full captures */
+  if( !sysinfo && (select_active() || strcmp(smaps, "smaps")) )
+  {
+    return;
+  }
+
+  for( size_t i = 0; sysinfo_files[i]; ++i )
+  {
+    const char *name = sysinfo_files[i];
+
+    if( !sysinfo && strcmp(name, "meminfo") )
+    {
+      continue;
+    }
+
+    // slabinfo is readable only by root on most systems
+    if( faccessat(proc_fd, name, R_OK, 0) == -1 )
+    {
+      msg_progress("%s/%s: %s, skipped\n", proc_root, name, strerror(errno));
+      continue;
+    }
+
+    if( input_file_at(proc_fd, proc_root, name, &text, &size) == 0 )
+    {
+      continue;
+    }
+
+    for( char *pos = text; *pos; )
+    {
+      char *row = pos;
+
+      pos += strcspn(pos, "\n");
+      if( *pos ) *pos++ = 0;
+
+      if( *strip(row) )
+      {
+        output_info(name, "%s", row);
+      }
+    }
+  }
+
+  free(text);
+}
+
+/* ------------------------------------------------------------------------- *
+ * snapshot_partial  --  list processes left out due to deadlines
+ *
+ * Writes '##Partial' summary and '##Skipped' / '##Truncated' pid lists
+ * to the capture trailer. The signatures of such processes are cleared
+ * so that the next incremental capture reads them in full.
+ * ------------------------------------------------------------------------- */
+
+static void snapshot_partial(const snapjob_t *jobs, size_t count,
+                             procsig_t *sigs)
+{
+  static const char * const key[] = { 0, "Skipped", "Truncated" };
+
+  size_t found[3] = { 0, 0, 0 };
+
+  for( size_t i = 0; i < count; ++i )
+  {
+    found[jobs[i].partial] += 1;
+    if( jobs[i].partial != PARTIAL_NONE && sigs != 0 )
+    {
+      sigs[i].valid = 0;
+    }
+  }
+
+  if( found[PARTIAL_SKIPPED] + found[PARTIAL_TRUNCATED] == 0 )
+  {
+    return;
+  }
+
+  msg_warning("partial capture: %zu processes skipped, %zu truncated\n",
+              found[PARTIAL_SKIPPED], found[PARTIAL_TRUNCATED]);
+
+  output_info("Partial", "skipped %zu truncated %zu",
+              found[PARTIAL_SKIPPED], found[PARTIAL_TRUNCATED]);
+
+  for( int p = PARTIAL_SKIPPED; p <= PARTIAL_TRUNCATED; ++p )
+  {
+    char   *list = 0;
+    size_t  size = 0;
+    FILE   *file;
+
+    if( found[p] == 0 || (file = open_memstream(&list, &size)) == 0 )
+    {
+      continue;
+    }
+    for( size_t i = 0; i < count; ++i )
+    {
+      if( jobs[i].partial == p )
+      {
+        fprintf(file, "%s%d", ftell(file) ? " " : "", jobs[i].pid);
+      }
+    }
+    fclose(file);
+    output_info(key[p], "%s", list);
+    free(list);
+  }
+}
+
+/* ------------------------------------------------------------------------- *
+ * snapshot_stats  --  write capture statistics to output and stderr
+ * ------------------------------------------------------------------------- */
+
+static void snapshot_stats_line(const char *fmt, ...)
+{
+  char    text[256];
+  va_list va;
+
+  va_start(va, fmt);
+  vsnprintf(text, sizeof text, fmt, va);
+  va_end(va);
+
+  output_info("Stats", "%s", text);
+  fprintf(stderr, "Stats: %s\n", text);
+}
+
+static void snapshot_stats(uint64_t started)
+{
+  uint64_t window = clock_nsec(CLOCK_MONOTONIC) - started;
+
+  snapshot_stats_line("window %.6f", window * 1e-9);
+
+  for( int i = 0; i < STATS_PHASES; ++i )
+  {
+    snapshot_stats_line("phase %s wall %.6f cpu %.6f",
+                        stats_phase_name[i],
+                        stats_phase_wall[i] * 1e-9,
+                        stats_phase_cpu[i] * 1e-9);
+  }
+
+  for( int i = 0; i < STATS_FILES; ++i )
+  {
+    snapshot_stats_line("file %s bytes %"PRIu64" calls %"PRIu64,
+                        stats_file_name[i],
+                        stats_file_bytes[i],
+                        stats_file_calls[i]);
+  }
+
+  for( unsigned i = 0; i < stats_slow_count; ++i )
+  {
+    const statslow_t *slow = &stats_slow[i];
+
+    snapshot_stats_line("slow %d %.6f %zu %s",
+                        slow->pid, slow->nsec * 1e-9, slow->bytes, slow->name);
+  }
+}
+
+/* ------------------------------------------------------------------------- *
+ * snapshot_all  -- retrieve snapshot of information for all processes
+ * ------------------------------------------------------------------------- */
+
+static int snapshot_all(void)
+{
+  int        err   = -1;
+  snapjob_t *jobs  = 0;
+  size_t     count = 0;
+  uring_t    ring;
+  procsig_t *sigs  = 0;
+  size_t     unchanged = 0;
+  uint64_t   started   = 0;
+
+  statclock_t clock;
+
+  if( stats )
+  {
+    stats_reset();
+    started = clock_nsec(CLOCK_MONOTONIC);
+  }
+
+  gentle_reset();
+  strtab_reset();
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * smaps_rollup is not available in
+   * older kernels -> use full smaps
+   * - - - - - - - - - - - - - - - - - - - */
+
+  if( strcmp(smaps, "smaps") )
+  {
+    char path[256];
+    snprintf(path, sizeof path, "%s/self/%s", proc_root, smaps);
+    if( access(path, R_OK) == -1 )
+    {
+      msg_warning("%s: %s (capturing full smaps)\n", path, strerror(errno));
+      smaps = "smaps";
+    }
+  }
+
+  freeze_start();
+
+  if( deep && deep_start() == -1 )
+  {
+    goto cleanup;
+  }
+
+  statclock_start(&clock);
+  if( snapshot_enumerate(&jobs, &count) == -1 )
+  {
+    goto cleanup;
+  }
+  statclock_stop(&clock, STATS_ENUMERATE);
+
+  statclock_start(&clock);
+  snapshot_select(jobs, &count);
+  statclock_stop(&clock, STATS_SELECT);
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * incremental mode: signatures are taken
+   * for every capture, unchanged processes
+   * are skipped only when there is a base
+   * - - - - - - - - - - - - - - - - - - - */
+
+  if( incr_every > 1 )
+  {
+    if( (sigs = calloc(count ? count : 1, sizeof *sigs)) == 0 )
+    {
+      msg_fatal("process signatures: %s\n", strerror(errno));
+    }
+    for( size_t i = 0; i < count; ++i )
+    {
+      procsig_read(&sigs[i], proc_root, jobs[i].pid);
+      if( incr_base != 0 && procsig_unchanged(&sigs[i]) )
+      {
+        jobs[i].unchanged = 1;
+        ++unchanged;
+      }
+    }
+    msg_progress("%zu of %zu processes unchanged\n", unchanged, count);
+  }
+
+  if( hybrid )
+  {
+    statclock_start(&clock);
+    snapshot_hybrid(jobs, count);
+    statclock_stop(&clock, STATS_SELECT);
+  }
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * capture header
+   * - - - - - - - - - - - - - - - - - - - */
+
+  {
+    struct timespec ts;
+    struct tm       tm;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    gmtime_r(&ts.tv_sec, &tm);
+    capture_started = clock_nsec(CLOCK_MONOTONIC);
+
+    if( binary )
+    {
+      output_raw(SMAPSBIN_MAGIC, SMAPSBIN_MAGIC_SIZE);
+      output_varint(SMAPSBIN_VERSION);
+      output_fields(SMAPSBIN_FIELDS_STATUS, status_fields, STATUS_FIELDS);
+      output_fields(SMAPSBIN_FIELDS_MAPPING, smaps_fields, SMAPS_FIELDS);
+    }
+
+    if( sequence >= 0 )
+    {
+      output_info("Sequence", "%ld", sequence);
+    }
+    output_info("Time", "%04d-%02d-%02dT%02d:%02d:%02d.%06ldZ",
+                tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                tm.tm_hour, tm.tm_min, tm.tm_sec, ts.tv_nsec / 1000);
+    output_info("Processes", "%zu", count);
+    output_info("Started", "%.6f", capture_started * 1e-9);
+
+    for( size_t i = 0; i < freeze_count; ++i )
+    {
+      output_info("Frozen", "%s", freeze_group[i].path);
+    }
+
+    if( incr_base != 0 )
+    {
+      const char *base = strrchr(incr_base, '/');
+      output_info("Base", "%s", base ? base + 1 : incr_base);
+      output_info("BaseSequence", "%ld", incr_base_seq);
+    }
+
+    if( hybrid )
+    {
+      output_info("Hybrid", "%lu %u", hybrid_rss, hybrid_top);
+    }
+
+    if( fields_list != 0 )
+    {
+      output_info("Fields", "%s", fields_list);
+    }
+
+    if( trigger_kind != 0 )
+    {
+      output_info("Trigger", "%s %u %u", trigger_kind,
+                  trigger_stall, trigger_window);
+      output_info("Pressure", "%s", trigger_label);
+    }
+
+    snapshot_sysinfo();
+
+    if( !binary )
+    {
+      output_raw("\n", 1);
+    }
+  }
+
+  if( workers > 1 )
+  {
+    snapshot_parallel(jobs, count, workers);
+  }
+  else if( use_uring && uring_ctor(&ring, PREFETCH_BATCH * PREFETCH_FILES) == 0 )
+  {
+    snapwork_t work = SNAPWORK_INIT;
+
+    msg_progress("capturing %zu processes using io_uring\n", count);
+
+    for( size_t i = 0; i < count; i += PREFETCH_BATCH )
+    {
+      size_t n = count - i;
+
+      if( n > PREFETCH_BATCH ) n = PREFETCH_BATCH;
+
+      snapshot_prefetch(&ring, jobs + i, n);
+
+      for( size_t k = i; k < i + n; ++k )
+      {
+        snapshot_capture(&work, &jobs[k]);
+        snapshot_emit(&jobs[k], k == 0);
+        gentle_pace(jobs[k].smaps_bytes);
+      }
+    }
+    snapwork_dtor(&work);
+    uring_dtor(&ring);
+  }
+  else
+  {
+    snapwork_t work = SNAPWORK_INIT;
+
+    for( size_t i = 0; i < count; ++i )
+    {
+      /* text mode smaps data can go straight to output, unless
+       * reading it might need to be cut short */
+      jobs[i].deferred = (!binary && !deep && !fold && !fields_mask &&
+                          deadline_proc <= 0);
+      snapshot_capture(&work, &jobs[i]);
+      snapshot_emit(&jobs[i], i == 0);
+      gentle_pace(jobs[i].smaps_bytes);
+    }
+    snapwork_dtor(&work);
+  }
+
+  freeze_stop();
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * capture trailer
+   * - - - - - - - - - - - - - - - - - - - */
+
+  if( !binary && count != 0 )
+  {
+    output_raw("\n", 1);
+  }
+
+  output_info("Window", "%.6f",
+              (clock_nsec(CLOCK_MONOTONIC) - capture_started) * 1e-9);
+
+  snapshot_partial(jobs, count, sigs);
+
+  if( deep )
+  {
+    deep_finish();
+  }
+
+  if( fold )
+  {
+    fold_finish();
+  }
+
+  if( stats )
+  {
+    snapshot_stats(started);
+  }
+
+  if( binary )
+  {
+    output_byte(SMAPSBIN_END);
+  }
+
+  if( sigs != 0 )
+  {
+    free(procsig_prev);
+    procsig_prev = sigs, sigs = 0;
+    procsig_prev_count = count;
+  }
+
+  err = 0;
+
+  cleanup:
+
+  freeze_stop();
+
+  free(sigs);
+
+  output_space(1);
+
+  free(jobs);
+
+  return err;
+}
+
+/* ========================================================================= *
+ * Shared Memory Ring Output
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * Captures are written in binary format to an anonymous memory file,
+ * which is then copied to the next slot of the ring. The slot sequence
+ * tells readers when the slot contents are being replaced, see
+ * smapsring.h for the reader side.
+ * ------------------------------------------------------------------------- */
+
+static smapsring_header_t *shmring_head = 0;
+
+/* ------------------------------------------------------------------------- *
+ * shmring_open  --  create or reattach to shared memory ring
+ * ------------------------------------------------------------------------- */
+
+static void shmring_open(void)
+{
+  char   *path = 0;
+  int     fd   = -1;
+  void   *base = MAP_FAILED;
+  size_t  page = sysconf(_SC_PAGESIZE);
+  size_t  head = sizeof *shmring_head + ring * sizeof *shmring_head->slot;
+  size_t  size;
+
+  head = (head + page - 1) / page * page;
+  size = head + ring * shm_slot_size;
+
+  if( asprintf(&path, "%s%s", *shm_name == '/' ? "" : "/", shm_name) == -1 )
+  {
+    msg_fatal("%s: %s\n", shm_name, strerror(errno));
+  }
+
+  if( (fd = shm_open(path, O_RDWR|O_CREAT, 0644)) == -1 )
+  {
+    msg_fatal("%s: shm_open: %s\n", path, strerror(errno));
+  }
+  if( ftruncate(fd, size) == -1 )
+  {
+    msg_fatal("%s: ftruncate: %s\n", path, strerror(errno));
+  }
+  base = mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if( base == MAP_FAILED )
+  {
+    msg_fatal("%s: mmap: %s\n", path, strerror(errno));
+  }
+  close(fd);
+
+  shmring_head = base;
+
+  /* continue the sequence after restart if the geometry is the same,
+   * so that readers holding on to old captures notice the change */
+  if( memcmp(shmring_head->magic, SMAPSRING_MAGIC, SMAPSRING_MAGIC_SIZE) ||
+      shmring_head->version   != SMAPSRING_VERSION ||
+      shmring_head->slots     != ring ||
+      shmring_head->slot_size != shm_slot_size )
+  {
+    memset(shmring_head->magic, 0, SMAPSRING_MAGIC_SIZE);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    shmring_head->version   = SMAPSRING_VERSION;
+    shmring_head->slots     = ring;
+    shmring_head->slot_size = shm_slot_size;
+    shmring_head->published = 0;
+    for( unsigned i = 0; i < ring; ++i )
+    {
+      shmring_head->slot[i].seq    = 0;
+      shmring_head->slot[i].size   = 0;
+      shmring_head->slot[i].offset = head + i * shm_slot_size;
+    }
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(shmring_head->magic, SMAPSRING_MAGIC, SMAPSRING_MAGIC_SIZE);
+  }
+
+  msg_progress("%s: %u slots of %" PRIu64 " bytes\n", path, ring, shm_slot_size);
+  free(path);
+}
+
+/* ------------------------------------------------------------------------- *
+ * shmring_publish  --  copy capture from memory file to next ring slot
+ * ------------------------------------------------------------------------- */
+
+static int shmring_publish(int fd, size_t size)
+{
+  uint64_t          gen  = shmring_head->published;
+  smapsring_slot_t *slot = &shmring_head->slot[gen % shmring_head->slots];
+  char             *data = (char *)shmring_head + slot->offset;
+
+  if( size > shmring_head->slot_size )
+  {
+    msg_error("capture of %zu bytes does not fit in %" PRIu64 " byte slot"
+              " (see --shm-slot)\n", size, shmring_head->slot_size);
+    return -1;
+  }
+
+  /* odd sequence: readers must not trust the slot from now on */
+  __atomic_store_n(&slot->seq, 2 * gen + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  for( size_t done = 0; done < size; )
+  {
+    ssize_t got = pread(fd, data + done, size - done, done);
+
+    if( got <= 0 )
+    {
+      msg_error("capture copy: %s\n", got ? strerror(errno) : "short read");
+      return -1;
+    }
+    done += got;
+  }
+  slot->size = size;
+
+  __atomic_store_n(&slot->seq, 2 * gen + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&shmring_head->published, gen + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* ------------------------------------------------------------------------- *
+ * shmring_capture  --  take one capture into the shared memory ring
+ * ------------------------------------------------------------------------- */
+
+static int shmring_capture(unsigned seq)
+{
+  int         err = -1;
+  int         fd  = memfd_create(TOOL_NAME, MFD_CLOEXEC);
+  struct stat st;
+
+  if( fd == -1 )
+  {
+    msg_error("memfd_create: %s\n", strerror(errno));
+    goto cleanup;
+  }
+
+  output_attach(fd), fd = -1;
+
+  if( snapshot_all() != 0 )
+  {
+    goto cleanup;
+  }
+
+  output_space(1);
+
+  if( fstat(output_fd, &st) == -1 )
+  {
+    msg_error("memfd: %s\n", strerror(errno));
+    goto cleanup;
+  }
+
+  if( shmring_publish(output_fd, st.st_size) == -1 )
+  {
+    goto cleanup;
+  }
+
+  msg_progress("capture %u -> %s slot %" PRIu64 "\n", seq, shm_name,
+               (shmring_head->published - 1) % shmring_head->slots);
+  err = 0;
+
+  cleanup:
+
+  if( output_close() == -1 )
+  {
+    err = -1;
+  }
+  return err;
+}
+
+/* ========================================================================= *
+ * Pressure Triggered Captures
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * In trigger mode (see --trigger) the daemon loop does not run on a
+ * timer. Instead a PSI trigger is registered on /proc/pressure/memory
+ * and the loop waits in poll() until the kernel reports that tasks
+ * have been stalled on memory for the given time within the window.
+ * Each event is captured, labelled with the pressure averages read
+ * right after it, and then events are ignored for the cooldown period
+ * so that a long lasting squeeze does not fill the ring with captures.
+ * ------------------------------------------------------------------------- */
+
+static const char  trigger_path[] = "/proc/pressure/memory";
+static int         trigger_fd     = -1;
+static uint64_t    trigger_quiet  = 0; // CLOCK_MONOTONIC end of cooldown
+
+/* ------------------------------------------------------------------------- *
+ * trigger_parse  --  parse --trigger option value
+ * ------------------------------------------------------------------------- */
+
+static void trigger_parse(const char *spec)
+{
+  char *end = 0;
+  int   len = strcspn(spec, ",");
+
+  if( len == 4 && !strncmp(spec, "some", 4) )
+  {
+    trigger_kind = "some";
+  }
+  else if( len == 4 && !strncmp(spec, "full", 4) )
+  {
+    trigger_kind = "full";
+  }
+  else
+  {
+    msg_fatal("invalid trigger: '%s' (some or full expected)\n", spec);
+  }
+
+  if( spec[len] != ',' )
+  {
+    msg_fatal("invalid trigger: '%s' (stall and window missing)\n", spec);
+  }
+  trigger_stall = strtoul(spec + len + 1, &end, 10);
+  if( *end == ',' )
+  {
+    trigger_window = strtoul(end + 1, &end, 10);
+  }
+  if( *end == ',' )
+  {
+    trigger_cooldown = strtod(end + 1, &end);
+  }
+
+  if( *end != 0 || trigger_stall == 0 || trigger_window == 0 ||
+      trigger_stall > trigger_window || trigger_cooldown < 0 )
+  {
+    msg_fatal("invalid trigger: '%s'\n", spec);
+  }
+}
+
+/* ------------------------------------------------------------------------- *
+ * trigger_open  --  register memory pressure trigger
+ * ------------------------------------------------------------------------- */
+
+static int trigger_open(void)
+{
+  char spec[64];
+  int  len;
+
+  if( (trigger_fd = open(trigger_path, O_RDWR|O_NONBLOCK|O_CLOEXEC)) == -1 )
+  {
+    msg_error("%s: %s\n", trigger_path, strerror(errno));
+    return -1;
+  }
+
+  /* the kernel wants microseconds & the terminating nul */
+  len = snprintf(spec, sizeof spec, "%s %u %u", trigger_kind,
+                 trigger_stall * 1000, trigger_window * 1000);
+
+  if( write(trigger_fd, spec, len + 1) == -1 )
+  {
+    msg_error("%s: '%s': %s\n", trigger_path, spec, strerror(errno));
+    if( errno == EINVAL )
+    {
+      msg_error("(window must be 500 to 10000 ms, and a multiple of"
+                " 2000 ms for unprivileged users)\n");
+    }
+    close(trigger_fd), trigger_fd = -1;
+    return -1;
+  }
+
+  msg_progress("waiting for %s memory pressure of %u ms in %u ms\n",
+               trigger_kind, trigger_stall, trigger_window);
+  return 0;
+}
+
+/* ------------------------------------------------------------------------- *
+ * trigger_close  --  unregister memory pressure trigger
+ * ------------------------------------------------------------------------- */
+
+static void trigger_close(void)
+{
+  if( trigger_fd != -1 )
+  {
+    close(trigger_fd), trigger_fd = -1;
+  }
+}
+
+/* ------------------------------------------------------------------------- *
+ * trigger_label_update  --  store current pressure values for capture
+ *
+ * "some avg10=.. total=..\nfull avg10=.. total=..\n" becomes a single
+ * line with the entries separated by "; ".
+ * ------------------------------------------------------------------------- */
+
+static void trigger_label_update(void)
+{
+  char    text[256];
+  ssize_t len = pread(trigger_fd, text, sizeof text - 1, 0);
+
+  if( len <= 0 )
+  {
+    snprintf(trigger_label, sizeof trigger_label, "unknown");
+    return;
+  }
+  while( len > 0 && text[len - 1] == '\n' )
+  {
+    --len;
+  }
+  text[len] = 0;
+
+  char *out = trigger_label;
+  char *end = trigger_label + sizeof trigger_label - 1;
+
+  for( const char *pos = text; *pos && out < end; ++pos )
+  {
+    if( *pos != '\n' )
+    {
+      *out++ = *pos;
+    }
+    else if( end - out > 2 )
+    {
+      *out++ = ';', *out++ = ' ';
+    }
+  }
+  *out = 0;
+}
+
+/* ------------------------------------------------------------------------- *
+ * trigger_wait  --  wait for memory pressure event outside cooldown
+ *
+ * Returns 0 when a capture should be taken or termination was
+ * requested, -1 if the trigger is lost.
+ * ------------------------------------------------------------------------- */
+
+static int trigger_wait(void)
+{
+  struct pollfd pfd = { .fd = trigger_fd, .events = POLLPRI };
+
+  while( !terminate )
+  {
+    int rc = poll(&pfd, 1, -1);
+
+    if( rc == -1 )
+    {
+      if( errno == EINTR )
+      {
+        continue;
+      }
+      msg_error("%s: poll: %s\n", trigger_path, strerror(errno));
+      return -1;
+    }
+
+    if( pfd.revents & POLLERR )
+    {
+      msg_error("%s: trigger lost\n", trigger_path);
+      return -1;
+    }
+
+    if( !(pfd.revents & POLLPRI) )
+    {
+      continue;
+    }
+
+    uint64_t now = clock_nsec(CLOCK_MONOTONIC);
+
+    if( now < trigger_quiet )
+    {
+      msg_progress("memory pressure event during cooldown, ignored\n");
+      continue;
+    }
+    trigger_quiet = now + (uint64_t)(trigger_cooldown * 1e9);
+
+    trigger_label_update();
+    msg_progress("memory pressure: %s\n", trigger_label);
+    break;
+  }
+  return 0;
+}
+
+/* ========================================================================= *
+ * Daemon Mode
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * daemon_terminate_cb  --  signal handler for stopping daemon mode
+ * ------------------------------------------------------------------------- */
+
+static void daemon_terminate_cb(int sig)
+{
+  terminate = 1;
+}
+
+/* ------------------------------------------------------------------------- *
+ * daemon_catch_signals  --  make termination signals stop resident modes
+ *
+ * No SA_RESTART, so that blocking waits return when signaled.
+ * ------------------------------------------------------------------------- */
+
+static void daemon_catch_signals(void)
+{
+  struct sigaction sa;
+
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = daemon_terminate_cb;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT,  &sa, 0);
+  sigaction(SIGTERM, &sa, 0);
+  sigaction(SIGHUP,  &sa, 0);
+}
+
+/* ------------------------------------------------------------------------- *
+ * daemon_ring_path  --  capture file path for given ring slot
+ * ------------------------------------------------------------------------- */
+
+static char *daemon_ring_path(unsigned slot)
+{
+  const char *base = strrchr(outfile, '/');
+  const char *ext  = strrchr(base ? base : outfile, '.');
+  char       *path = 0;
+
+  if( ext == 0 || ext == base + 1 || ext == outfile )
+  {
+    ext = outfile + strlen(outfile);
+  }
+
+  if( asprintf(&path, "%.*s-%03u%s", (int)(ext - outfile), outfile,
+               slot, ext) == -1 )
+  {
+    msg_fatal("%s: %s\n", outfile, strerror(errno));
+  }
+  return path;
+}
+
+/* ------------------------------------------------------------------------- *
+ * daemon_oldest_slot  --  find ring slot to continue from after restart
+ * ------------------------------------------------------------------------- */
+
+static unsigned daemon_oldest_slot(void)
+{
+  unsigned slot = 0;
+  time_t   when = 0;
+
+  for( unsigned i = 0; i < ring; ++i )
+  {
+    char       *path = daemon_ring_path(i);
+    struct stat st;
+    int         rc   = stat(path, &st);
+
+    free(path);
+
+    if( rc == -1 )
+    {
+      /* unused slot -> use it */
+      return i;
+    }
+    if( i == 0 || st.st_mtime < when )
+    {
+      slot = i, when = st.st_mtime;
+    }
+  }
+  return slot;
+}
+
+/* ------------------------------------------------------------------------- *
+ * snapshot_daemon  --  take captures periodically into ring of files
+ * ------------------------------------------------------------------------- */
+
+static int snapshot_daemon(void)
+{
+  int             err  = 0;
+  unsigned        slot = shm_name ? 0 : daemon_oldest_slot();
+  struct timespec next;
+  char           *last = 0; // previous successful capture
+
+  daemon_catch_signals();
+
+  if( trigger_kind != 0 && trigger_open() == -1 )
+  {
+    return -1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+
+  for( unsigned seq = 0; !terminate && (captures == 0 || seq < captures); ++seq )
+  {
+    /* - - - - - - - - - - - - - - - - - - - *
+     * in trigger mode, wait for pressure
+     * - - - - - - - - - - - - - - - - - - - */
+
+    if( trigger_kind != 0 )
+    {
+      if( trigger_wait() == -1 )
+      {
+        err = -1;
+        break;
+      }
+      if( terminate )
+      {
+        break;
+      }
+    }
+
+    /* - - - - - - - - - - - - - - - - - - - *
+     * wait until next capture is due, skip
+     * the ticks missed due to slow captures
+     * - - - - - - - - - - - - - - - - - - - */
+
+    else if( seq != 0 )
+    {
+      struct timespec now;
+
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      do
+      {
+        next.tv_sec  += (time_t)interval;
+        next.tv_nsec += (long)((interval - (time_t)interval) * 1e9);
+        if( next.tv_nsec >= 1000000000 )
+        {
+          next.tv_sec  += 1;
+          next.tv_nsec -= 1000000000;
+        }
+      } while( next.tv_sec < now.tv_sec ||
+               (next.tv_sec == now.tv_sec && next.tv_nsec < now.tv_nsec) );
+
+      while( !terminate &&
+             clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, 0) != 0 )
+      {
+      }
+      if( terminate )
+      {
+        break;
+      }
+    }
+
+    if( shm_name )
+    {
+      sequence = seq;
+      if( shmring_capture(seq) == -1 )
+      {
+        err = -1;
+      }
+      continue;
+    }
+
+    /* - - - - - - - - - - - - - - - - - - - *
+     * capture to temporary file & rename
+     * over the oldest one in the ring
+     * - - - - - - - - - - - - - - - - - - - */
+
+    char *path = daemon_ring_path(slot);
+    char *temp = 0;
+
+    if( asprintf(&temp, "%s.tmp", path) == -1 )
+    {
+      msg_fatal("%s: %s\n", path, strerror(errno));
+    }
+
+    /* in incremental mode, refer to the previous capture unless
+     * it is time for a full one */
+    incr_base = 0;
+    if( incr_every > 1 && last != 0 && seq % incr_every != 0 )
+    {
+      incr_base     = last;
+      incr_base_seq = seq - 1;
+    }
+
+    int ok = 0;
+
+    if( output_open(temp) == -1 )
+    {
+      err = -1;
+    }
+    else
+    {
+      sequence = seq;
+
+      ok = (snapshot_all() == 0);
+
+      if( output_close() == -1 )
+      {
+        ok = 0;
+      }
+      else if( rename(temp, path) == -1 )
+      {
+        msg_error("%s: rename: %s\n", path, strerror(errno));
+        ok = 0;
+      }
+      else
+      {
+        msg_progress("capture %u -> %s%s\n", seq, path,
+                     incr_base ? " (incremental)" : "");
+      }
+      if( !ok )
+      {
+        err = -1;
+      }
+    }
+
+    /* the next incremental capture needs an intact predecessor */
+    free(last), last = 0;
+    if( ok )
+    {
+      last = path, path = 0;
+    }
+
+    free(temp);
+    free(path);
+
+    slot = (slot + 1) % ring;
+  }
+
+  free(last);
+  incr_base = 0;
+
+  trigger_close();
+
+  return err;
+}
+
+/* ========================================================================= *
+ * Snapshot Service
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * In serve mode the tool stays resident and answers requests made over
+ * a unix domain socket. Each connection carries one request line, and
+ * the reply is the capture data, after which the connection is closed.
+ *
+ * Captures are first taken into an anonymous memory file and then sent
+ * to the client, so that a slow or vanished client can not stall or
+ * break the capture itself. The last full capture is kept around and
+ * can be shared by clients that accept slightly older data.
+ * ------------------------------------------------------------------------- */
+
+#define SERVE_REQUEST_MAX  1024 // longest accepted request line
+#define SERVE_TIMEOUT      10   // seconds allowed for client io
+
+static const char *serve_path       = 0;  // --serve socket path
+static int         serve_cache_fd   = -1; // last full capture
+static uint64_t    serve_cache_time = 0;  // CLOCK_MONOTONIC at its start
+
+/* ------------------------------------------------------------------------- *
+ * serve_capture  --  take capture into memory file, return fd or -1
+ * ------------------------------------------------------------------------- */
+
+static int serve_capture(void)
+{
+  int fd  = memfd_create(TOOL_NAME, MFD_CLOEXEC);
+  int out = -1;
+  int err = -1;
+
+  if( fd == -1 || (out = dup(fd)) == -1 )
+  {
+    msg_error("capture file: %s\n", strerror(errno));
+    goto cleanup;
+  }
+
+  /* output_close() closes the duplicate, flushing any compression
+   * trailer, while the data stays reachable via fd */
+  output_attach(out);
+  err = snapshot_all();
+  if( output_close() == -1 )
+  {
+    err = -1;
+  }
+
+  cleanup:
+
+  if( err && fd != -1 )
+  {
+    close(fd), fd = -1;
+  }
+  return fd;
+}
+
+/* ------------------------------------------------------------------------- *
+ * serve_send  --  copy whole capture file to client
+ * ------------------------------------------------------------------------- */
+
+static void serve_send(int client, int fd)
+{
+  struct stat st;
+  off_t       offs = 0;
+
+  if( fstat(fd, &st) == -1 )
+  {
+    msg_error("capture file: %s\n", strerror(errno));
+    return;
+  }
+
+  while( offs < st.st_size )
+  {
+    ssize_t rc = sendfile(client, fd, &offs, st.st_size - offs);
+
+    if( rc == -1 && errno == EINTR && !terminate )
+    {
+      continue;
+    }
+    if( rc <= 0 )
+    {
+      /* EAGAIN here means the send timeout expired */
+      msg_warning("client: %s\n", rc ? strerror(errno) : "short write");
+      break;
+    }
+  }
+}
+
+/* ------------------------------------------------------------------------- *
+ * serve_error  --  report failed request to client
+ * ------------------------------------------------------------------------- */
+
+static void serve_error(int client, const char *fmt, ...)
+{
+  char    why[200];
+  char    text[256];
+  int     len;
+  va_list va;
+
+  va_start(va, fmt);
+  vsnprintf(why, sizeof why, fmt, va);
+  va_end(va);
+
+  msg_warning("request failed: %s\n", why);
+
+  len = snprintf(text, sizeof text, "##Error: %s\n", why);
+  if( send(client, text, len, MSG_NOSIGNAL) == -1 )
+  {
+    msg_warning("client: %s\n", strerror(errno));
+  }
+}
+
+/* ------------------------------------------------------------------------- *
+ * serve_request  --  handle one request line
+ *
+ *   capture [<max-age>]        all selected processes, reusing the
+ *                              previous capture if not older than
+ *                              given seconds
+ *   rollup <pid>[,<pid>...]    smaps_rollup of given processes
+ *   cgroup <path>              processes in given cgroup
+ * ------------------------------------------------------------------------- */
+
+static void serve_request(int client, char *line)
+{
+  char       *pos = line;
+  const char *cmd = token(&pos, -1);
+  const char *arg = strip(pos);
+
+  if( !strcmp(cmd, "capture") )
+  {
+    uint64_t now = clock_nsec(CLOCK_MONOTONIC);
+    double   age = 0;
+    char    *end = 0;
+
+    if( *arg && ((age = strtod(arg, &end)) < 0 || *end != 0) )
+    {
+      serve_error(client, "invalid max age: '%s'", arg);
+      return;
+    }
+
+    if( serve_cache_fd == -1 || now - serve_cache_time > age * 1e9 )
+    {
+      int fd = serve_capture();
+
+      if( fd == -1 )
+      {
+        serve_error(client, "capture failed");
+        return;
+      }
+      if( serve_cache_fd != -1 )
+      {
+        close(serve_cache_fd);
+      }
+      serve_cache_fd   = fd;
+      serve_cache_time = now;
+    }
+    else
+    {
+      msg_progress("reusing capture taken %.3f s ago\n",
+                   (now - serve_cache_time) * 1e-9);
+    }
+    serve_send(client, serve_cache_fd);
+    return;
+  }
+
+  if( strcmp(cmd, "rollup") && strcmp(cmd, "cgroup") )
+  {
+    serve_error(client, "unknown request: '%s'", cmd);
+    return;
+  }
+  if( *arg == 0 )
+  {
+    serve_error(client, "%s: argument missing", cmd);
+    return;
+  }
+
+  /* - - - - - - - - - - - - - - - - - - - *
+   * the request replaces the command line
+   * selection for the duration of capture
+   * - - - - - - - - - - - - - - - - - - - */
+
+  pidset_t     save_pid     = select_pid;
+  pidset_t     save_tree    = select_tree;
+  const char **save_cgroup  = select_cgroup;
+  size_t       save_cgroups = select_cgroups;
+  int          save_match   = select_match;
+  const char  *save_smaps   = smaps;
+  int          fd           = -1;
+
+  select_pid     = (pidset_t)PIDSET_INIT;
+  select_tree    = (pidset_t)PIDSET_INIT;
+  select_cgroup  = 0;
+  select_cgroups = 0;
+  select_match   = 0;
+
+  if( *cmd == 'r' )
+  {
+    if( deep || hybrid )
+    {
+      serve_error(client, "rollup not available in deep or"
+                  " hybrid mode");
+      goto cleanup;
+    }
+    if( pidset_parse(&select_pid, arg) == -1 )
+    {
+      serve_error(client, "invalid pid list: '%s'", arg);
+      goto cleanup;
+    }
+    smaps = "smaps_rollup";
+  }
+  else
+  {
+    select_cgroup  = &arg;
+    select_cgroups = 1;
+  }
+
+  if( (fd = serve_capture()) == -1 )
+  {
+    serve_error(client, "capture failed");
+    goto cleanup;
+  }
+  serve_send(client, fd);
+
+  cleanup:
+
+  if( fd != -1 )
+  {
+    close(fd);
+  }
+  pidset_dtor(&select_pid);
+
+  select_pid     = save_pid;
+  select_tree    = save_tree;
+  select_cgroup  = save_cgroup;
+  select_cgroups = save_cgroups;
+  select_match   = save_match;
+  smaps          = save_smaps;
+}
+
+/* ------------------------------------------------------------------------- *
+ * serve_read_request  --  read request line from client
+ * ------------------------------------------------------------------------- */
+
+static int serve_read_request(int client, char *line, size_t size)
+{
+  size_t used = 0;
+
+  while( used < size - 1 )
+  {
+    ssize_t rc = recv(client, line + used, size - 1 - used, 0);
+
+    if( rc == -1 && errno == EINTR && !terminate )
+    {
+      continue;
+    }
+    if( rc <= 0 )
+    {
+      break;
+    }
+    used += rc;
+    if( memchr(line + used - rc, '\n', rc) )
+    {
+      break;
+    }
+  }
+  line[used] = 0;
+  line[strcspn(line, "\n")] = 0;
+
+  return used ? 0 : -1;
+}
+
+/* ------------------------------------------------------------------------- *
+ * snapshot_serve  --  answer capture requests until terminated
+ * ------------------------------------------------------------------------- */
+
+static int snapshot_serve(void)
+{
+  int                err  = -1;
+  int                sock = -1;
+  struct sockaddr_un addr;
+  struct stat        st;
+  mode_t             mask;
+
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  if( strlen(serve_path) >= sizeof addr.sun_path )
+  {
+    msg_error("%s: socket path too long\n", serve_path);
+    goto cleanup;
+  }
+  strcpy(addr.sun_path, serve_path);
+
+  if( (sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) == -1 )
+  {
+    msg_error("socket: %s\n", strerror(errno));
+    goto cleanup;
+  }
+
+  /* remove stale socket left behind by earlier instance */
+  if( lstat(serve_path, &st) == 0 && S_ISSOCK(st.st_mode) )
+  {
+    unlink(serve_path);
+  }
+
+  /* access is controlled by socket permissions: owner only */
+  mask = umask(077);
+  if( bind(sock, (struct sockaddr *)&addr, sizeof addr) == -1 )
+  {
+    msg_error("%s: bind: %s\n", serve_path, strerror(errno));
+    umask(mask);
+    goto cleanup;
+  }
+  umask(mask);
+
+  if( listen(sock, 16) == -1 )
+  {
+    msg_error("%s: listen: %s\n", serve_path, strerror(errno));
+    goto cleanup;
+  }
+
+  daemon_catch_signals();
+  signal(SIGPIPE, SIG_IGN);
+
+  msg_progress("serving requests on %s\n", serve_path);
+
+  err = 0;
+  while( !terminate )
+  {
+    struct timeval tmo = { SERVE_TIMEOUT, 0 };
+    char           line[SERVE_REQUEST_MAX];
+    int            client = accept4(sock, 0, 0, SOCK_CLOEXEC);
+
+    if( client == -1 )
+    {
+      if( errno == EINTR || errno == ECONNABORTED )
+      {
+        continue;
+      }
+      msg_error("%s: accept: %s\n", serve_path, strerror(errno));
+      err = -1;
+      break;
+    }
+
+    /* requests are served one at a time, do not let a client that
+     * stops reading or writing hold up the others */
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tmo, sizeof tmo);
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &tmo, sizeof tmo);
+
+    if( serve_read_request(client, line, sizeof line) == 0 )
+    {
+      msg_progress("request: %s\n", line);
+      serve_request(client, line);
+    }
+    close(client);
+  }
+
+  unlink(serve_path);
+
+  cleanup:
+
+  if( sock != -1 )
+  {
+    close(sock);
+  }
+  if( serve_cache_fd != -1 )
+  {
+    close(serve_cache_fd), serve_cache_fd = -1;
+  }
+  return err;
 }
 
-static void check_kthreadd(const proc_pid_status_t *status)
+/* ========================================================================= *
+ * Process Watch
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * In watch mode a single process is sampled at a high rate. The smaps
+ * file is opened once and re-read with pread() at offset zero, which
+ * makes the kernel regenerate the data, and the few values needed are
+ * picked up without copying or allocating anything. Each sample is
+ * written as one line:
+ *
+ *   <CLOCK_MONOTONIC seconds> <Pss> <Rss> <Anonymous> <Swap>
+ *
+ * with the values in kB. If smaps_rollup is not available, the values
+ * of all mappings in smaps are summed up instead.
+ * ------------------------------------------------------------------------- */
+
+typedef struct watchval_t
 {
-  if (kthreadd_pid)
-    return;
-  if (status->Pid == NULL)
-    return;
-  if (is_kthreadd(status))
-    kthreadd_pid = strdup(status->Pid);
-}
+  uint64_t pss, rss, anon, swap;
+} watchval_t;
 
 /* ------------------------------------------------------------------------- *
- * snapshot_all  -- retrieve snapshot of information for one process
+ * watch_parse  --  sum up sample values from smaps or smaps_rollup text
  * ------------------------------------------------------------------------- */
 
-static int snapshot_all(void)
+static void watch_parse(const char *pos, const char *end, watchval_t *val)
 {
-  char   *status_text = 0;
-  size_t  status_size = 0;
-  char   *cmdline_text = 0;
-  size_t  cmdline_size = 0;
+  memset(val, 0, sizeof *val);
+
+  while( pos < end )
+  {
+    const char *eol = memchr(pos, '\n', end - pos);
+    uint64_t   *dst = 0;
 
-  static const char root[] = "/proc";
+    if( eol == 0 )
+    {
+      eol = end;
+    }
 
-  int  err = -1;
-  DIR *dir = 0;
-  int  cnt = 0;
+    /* only the keys that are exactly these, not Pss_Anon, SwapPss, ... */
+    switch( *pos )
+    {
+    case 'P':
+      if( !strncmp(pos, "Pss:", 4) ) dst = &val->pss, pos += 4;
+      break;
+    case 'R':
+      if( !strncmp(pos, "Rss:", 4) ) dst = &val->rss, pos += 4;
+      break;
+    case 'A':
+      if( !strncmp(pos, "Anonymous:", 10) ) dst = &val->anon, pos += 10;
+      break;
+    case 'S':
+      if( !strncmp(pos, "Swap:", 5) ) dst = &val->swap, pos += 5;
+      break;
+    }
 
-  struct dirent *de;
+    if( dst != 0 )
+    {
+      uint64_t num = 0;
 
-  if( (dir = opendir(root)) == 0 )
-  {
-    perror(root);
-    goto cleanup;
+      while( pos < eol && *pos == ' ' ) ++pos;
+      while( pos < eol && isdigit(uc(*pos)) ) num = num * 10 + (*pos++ - '0');
+      *dst += num;
+    }
+    pos = eol + 1;
   }
+}
+
+/* ------------------------------------------------------------------------- *
+ * watch_read  --  re-read already open smaps file from the start
+ *
+ * Returns number of bytes read, zero if the process is gone, or -1 on
+ * errors. The buffer is grown only if the data does not fit in it.
+ * ------------------------------------------------------------------------- */
 
-  while( (de = readdir(dir)) != 0 )
+static ssize_t watch_read(int fd, capbuf_t *buf)
+{
+  for( ;; )
   {
-    if( '1' <= de->d_name[0] && de->d_name[0] <= '9' )
+    size_t  used = 0;
+    ssize_t rc;
+
+    buf->size = 0;
+    capbuf_reserve(buf, RXBUFF);
+
+    /* smaps may need several reads, but all from the same offset
+     * sequence starting from zero */
+    while( (rc = pread(fd, buf->data + used, buf->alloc - used, used)) > 0 )
+    {
+      used += rc;
+      if( used == buf->alloc )
+      {
+        break;
+      }
+    }
+
+    if( rc == -1 )
     {
-      char exe[256];
-      char path[256];
-      proc_pid_status_t status;
-      size_t smaps_bytes;
-      char *name = NULL;
+      if( errno == EINTR && !terminate )
+      {
+        continue;
+      }
+      return (errno == ESRCH) ? 0 : -1;
+    }
 
-      /* - - - - - - - - - - - - - - - - - - - *
-       * /proc/pid/exe -> link to executable
-       * - - - - - - - - - - - - - - - - - - - */
+    if( used < buf->alloc )
+    {
+      buf->size = used;
+      return (ssize_t)used;
+    }
 
-      snprintf(path, sizeof path, "%s/%s/%s", root, de->d_name,"exe");
-      int n = readlink(path, exe, sizeof exe - 1);
-      exe[n>0?n:0] = 0;
+    /* did not fit -> grow & retry */
+    buf->size = used;
+    capbuf_reserve(buf, buf->alloc);
+  }
+}
 
-      /* - - - - - - - - - - - - - - - - - - - *
-       * /proc/pid/cmdline -> argv[] data
-       * - - - - - - - - - - - - - - - - - - - */
+/* ------------------------------------------------------------------------- *
+ * snapshot_watch  --  sample one process until terminated
+ * ------------------------------------------------------------------------- */
 
-      snprintf(path, sizeof path, "%s/%s/%s", root, de->d_name,"cmdline");
-      input_file(path, &cmdline_text, &cmdline_size);
+static int snapshot_watch(void)
+{
+  int             err    = -1;
+  int             fd     = -1;
+  capbuf_t        buf    = CAPBUF_INIT;
+  double          period = (interval > 0) ? interval : 0.1;
+  uint64_t        flushed;
+  struct timespec next;
+  char            path[256];
 
-      /* - - - - - - - - - - - - - - - - - - - *
-       * /proc/pid/status -> name, pid, ...
-       * - - - - - - - - - - - - - - - - - - - */
+  /* - - - - - - - - - - - - - - - - - - - *
+   * prefer the kernel summed up values
+   * - - - - - - - - - - - - - - - - - - - */
 
-      snprintf(path, sizeof path, "%s/%s/%s", root, de->d_name,"status");
-      input_file(path, &status_text, &status_size);
-      proc_pid_status_parse(&status, status_text);
+  snprintf(path, sizeof path, "%s/%d/smaps_rollup", proc_root, watch_pid);
+  if( (fd = open(path, O_RDONLY|O_CLOEXEC)) == -1 && errno == ENOENT )
+  {
+    snprintf(path, sizeof path, "%s/%d/smaps", proc_root, watch_pid);
+    fd = open(path, O_RDONLY|O_CLOEXEC);
+  }
+  if( fd == -1 )
+  {
+    msg_error("%s: %s\n", path, strerror(errno));
+    goto cleanup;
+  }
 
-      check_kthreadd(&status);
+  daemon_catch_signals();
 
-      if( cnt++ != 0 )
-      {
-        output_raw("\n",1);
-      }
+  output_ensure_open();
+  output_info("Watch", "%d %s", watch_pid, path);
+  output_info("Interval", "%g", period);
+  output_info("Columns", "time pss rss anonymous swap");
 
-      snprintf(path, sizeof path, "%s/%s/smaps", root, de->d_name);
-      output_fmt("==> %s <==\n", path);
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  flushed = clock_nsec(CLOCK_MONOTONIC);
 
-      name = strip(cmdline_text);
+  for( unsigned seq = 0; !terminate && (captures == 0 || seq < captures); ++seq )
+  {
+    watchval_t val;
+    uint64_t   now;
+    ssize_t    size;
+    char       line[128];
+    int        len;
 
-      if( name == NULL || *name == 0 )
+    if( seq != 0 )
+    {
+      next.tv_sec  += (time_t)period;
+      next.tv_nsec += (long)((period - (time_t)period) * 1e9);
+      if( next.tv_nsec >= 1000000000 )
       {
-        name = strip(exe);
+        next.tv_sec  += 1;
+        next.tv_nsec -= 1000000000;
       }
-      if( name == NULL || *name == 0 )
+      while( !terminate &&
+             clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, 0) != 0 )
       {
-        name = strip(status.Name);
       }
-      if( name == NULL || *name == 0 )
+      if( terminate )
       {
-        name = "unknown";
+        break;
       }
+    }
 
-      output_fmt("#Name: %s\n", name);
-
-#define X(v) if( status.v ) output_fmt("#%s: %s\n",#v,status.v);
-      X(Pid)
-      X(PPid)
-      X(Threads)
-      X(FDSize)
-      X(VmPeak)
-      X(VmSize)
-      X(VmLck)
-      X(VmHWM)
-      X(VmRSS)
-      X(VmData)
-      X(VmStk)
-      X(VmExe)
-      X(VmLib)
-      X(VmPTE)
-#undef X
+    now = clock_nsec(CLOCK_MONOTONIC);
 
-      smaps_bytes = output_file(path);
-      if (smaps_bytes == 0
-          && !is_kthreadd(&status)
-          && !is_kernel_thread(&status))
+    if( (size = watch_read(fd, &buf)) <= 0 )
+    {
+      if( size == 0 && seq == 0 )
+      {
+        msg_error("%s: no data, kernel thread?\n", path);
+        goto cleanup;
+      }
+      if( size == 0 )
       {
-        msg_warning("`%s' is empty for process named '%s'!\n", path, name);
+        msg_progress("%d: process exited\n", watch_pid);
+        break;
       }
+      msg_error("%s: %s\n", path, strerror(errno));
+      goto cleanup;
     }
-  }
 
-  err = 0;
+    watch_parse(buf.data, buf.data + size, &val);
 
-  cleanup:
+    len = snprintf(line, sizeof line,
+                   "%.6f %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64"\n",
+                   now * 1e-9, val.pss, val.rss, val.anon, val.swap);
+    output_raw(line, len);
 
-  if( dir != 0 ) closedir(dir);
+    /* keep the output reasonably live without a write per sample */
+    if( now - flushed >= 1000000000 )
+    {
+      output_space(1);
+      flushed = now;
+    }
+  }
 
-  output_space(1);
+  err = 0;
 
-  free(cmdline_text);
-  free(status_text);
+  cleanup:
+  if( fd != -1 )
+  {
+    close(fd);
+  }
+  capbuf_dtor(&buf);
 
+  if( output_close() == -1 )
+  {
+    err = -1;
+  }
   return err;
 }
 
@@ -834,6 +6815,7 @@ int main(int ac, char **av)
       outfile = par;
       break;
     case opt_realtime:
+      realtime = 1;
       if( geteuid() == 0 )
       {
         msg_progress("Attempting to adjust priority/scheduling.\n");
@@ -845,10 +6827,337 @@ int main(int ac, char **av)
         exit(1);
       }
       break;
+    case opt_rollup:
+      smaps = "smaps_rollup";
+      break;
+    case opt_sysinfo:
+      sysinfo = 1;
+      break;
+    case opt_interval:
+      interval = strtod(par, 0);
+      if( interval <= 0 )
+      {
+        msg_fatal("invalid interval: '%s'\n", par);
+      }
+      break;
+    case opt_trigger:
+      trigger_parse(par);
+      break;
+    case opt_count:
+      captures = strtoul(par, 0, 0);
+      break;
+    case opt_ring:
+      ring = strtoul(par, 0, 0);
+      if( ring < 1 )
+      {
+        msg_fatal("invalid ring size: '%s'\n", par);
+      }
+      break;
+    case opt_format:
+      if( !strcmp(par, "binary") )
+      {
+        binary = 1;
+      }
+      else if( strcmp(par, "text") )
+      {
+        msg_fatal("unknown capture format: '%s'\n", par);
+      }
+      break;
+    case opt_uring:
+      use_uring = 1;
+      break;
+    case opt_compress:
+      if( !strcmp(par, "gzip") )
+      {
+        compression = COMPRESS_GZIP;
+      }
+#ifdef HAVE_ZSTD
+      else if( !strcmp(par, "zstd") )
+      {
+        compression = COMPRESS_ZSTD;
+      }
+#endif
+      else
+      {
+        msg_fatal("unsupported compression method: '%s'\n", par);
+      }
+      break;
+    case opt_pid:
+      if( pidset_parse(&select_pid, par) == -1 )
+      {
+        msg_fatal("invalid pid list: '%s'\n", par);
+      }
+      break;
+    case opt_match:
+      if( select_match )
+      {
+        regfree(&select_regex);
+      }
+      if( (select_match = regcomp(&select_regex, par, REG_EXTENDED|REG_NOSUB)) != 0 )
+      {
+        char err[256];
+        regerror(select_match, &select_regex, err, sizeof err);
+        msg_fatal("invalid regex '%s': %s\n", par, err);
+      }
+      select_match = 1;
+      break;
+    case opt_cgroup:
+      select_cgroup = realloc(select_cgroup,
+                              (select_cgroups + 1) * sizeof *select_cgroup);
+      if( select_cgroup == 0 )
+      {
+        msg_fatal("cgroup list: %s\n", strerror(errno));
+      }
+      select_cgroup[select_cgroups++] = par;
+      break;
+    case opt_tree:
+      if( strtol(par, 0, 10) <= 0 )
+      {
+        msg_fatal("invalid pid: '%s'\n", par);
+      }
+      pidset_add(&select_tree, strtol(par, 0, 10));
+      break;
+    case opt_incremental:
+      incr_every = strtoul(par, 0, 0);
+      break;
+    case opt_deep:
+      deep = 1;
+      break;
+    case opt_fold:
+      fold = 1;
+      break;
+    case opt_fields:
+      fields_select(par);
+      break;
+    case opt_watch:
+      if( (watch_pid = strtol(par, 0, 10)) <= 0 )
+      {
+        msg_fatal("invalid pid: '%s'\n", par);
+      }
+      break;
+    case opt_freeze:
+      freeze = 1;
+      break;
+    case opt_hybrid:
+      {
+        char *end = par;
+
+        hybrid = 1;
+        hybrid_rss = strtoul(par, &end, 10);
+        if( *end == ',' )
+        {
+          hybrid_top = strtoul(end + 1, &end, 10);
+        }
+        if( end == par || *end != 0 )
+        {
+          msg_fatal("invalid hybrid limits: '%s'\n", par);
+        }
+      }
+      break;
+    case opt_deadline:
+      {
+        char *end = par;
+
+        deadline = strtod(par, &end);
+        if( *end == ',' )
+        {
+          deadline_proc = strtod(end + 1, &end);
+        }
+        if( end == par || *end != 0 || deadline < 0 || deadline_proc < 0 )
+        {
+          msg_fatal("invalid deadline: '%s'\n", par);
+        }
+      }
+      break;
+    case opt_gentle:
+      gentle = 1;
+      break;
+    case opt_cpus:
+      gentle_cpus = par;
+      break;
+    case opt_byte_rate:
+      gentle_byte_rate = parse_bytes(par, "byte rate");
+      break;
+    case opt_proc_rate:
+      gentle_proc_rate = strtod(par, 0);
+      break;
+    case opt_shm:
+      shm_name = par;
+      break;
+    case opt_proc_root:
+      proc_root = par;
+      break;
+    case opt_serve:
+      serve_path = par;
+      break;
+    case opt_shm_slot:
+      shm_slot_size = parse_bytes(par, "slot size");
+      if( shm_slot_size < 4096 )
+      {
+        msg_fatal("slot size must be at least 4k\n");
+      }
+      break;
+    case opt_stats:
+      stats = 1;
+      stats_slowest = strtoul(par, 0, 0);
+      break;
+    case opt_jobs:
+      {
+        char *end = par;
+        long  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        long  n    = strtol(par, &end, 10);
+
+        if( end == par || *end != 0 || n < 0 )
+        {
+          msg_fatal("invalid worker count: '%s'\n", par);
+        }
+        if( cpus < 1 )
+        {
+          cpus = 1;
+        }
+        if( n == 0 )
+        {
+          n = cpus;
+        }
+        else if( n > cpus * 4 )
+        {
+          msg_warning("%ld workers is too many, using %ld\n", n, cpus * 4);
+          n = cpus * 4;
+        }
+        workers = (int)n;
+      }
+      break;
     }
   }
 
   argvec_delete(args);
 
-  return snapshot_all() ? EXIT_FAILURE : EXIT_SUCCESS;
+  if( compression != COMPRESS_NONE )
+  {
+    /* compressed data must go through the output buffer */
+    output_zerocopy = 0;
+  }
+
+  if( shm_name )
+  {
+    if( compression != COMPRESS_NONE || outfile != 0 )
+    {
+      msg_fatal("shared memory ring output can't be combined with"
+                " output file or compression\n");
+    }
+    if( incr_every > 1 )
+    {
+      msg_fatal("incremental captures need output files\n");
+    }
+    binary = 1;
+    shmring_open();
+  }
+
+  if( trigger_kind != 0 && interval > 0 )
+  {
+    msg_fatal("pressure triggered and periodic captures are mutually"
+              " exclusive\n");
+  }
+
+  if( incr_every > 1 )
+  {
+    if( interval <= 0 && trigger_kind == 0 )
+    {
+      msg_fatal("incremental captures are available only in daemon mode\n");
+    }
+    if( ring < incr_every )
+    {
+      msg_fatal("ring must hold at least %u captures in incremental mode\n",
+                incr_every);
+    }
+  }
+
+  if( deep && strcmp(proc_root, "/proc") )
+  {
+    msg_fatal("deep capture needs the real /proc\n");
+  }
+
+  if( deep && strcmp(smaps, "smaps") )
+  {
+    msg_fatal("deep capture needs per mapping smaps data\n");
+  }
+
+  if( fold && strcmp(smaps, "smaps") )
+  {
+    msg_fatal("fold mode needs per mapping smaps data\n");
+  }
+
+  if( hybrid && strcmp(smaps, "smaps") )
+  {
+    msg_fatal("hybrid capture needs per mapping smaps data\n");
+  }
+
+  if( gentle && realtime )
+  {
+    msg_fatal("gentle and realtime modes are mutually exclusive\n");
+  }
+
+  if( gentle )
+  {
+    use_minimum_priority();
+  }
+
+  if( gentle || gentle_cpus )
+  {
+    use_gentle_cpus();
+  }
+
+  if( freeze )
+  {
+    if( select_cgroups == 0 )
+    {
+      msg_fatal("cgroups to freeze must be given with --cgroup\n");
+    }
+    /* do not leave processes frozen on msg_fatal() etc */
+    atexit(freeze_stop);
+  }
+
+  if( serve_path )
+  {
+    if( interval > 0 || trigger_kind || shm_name || outfile || incr_every > 1 )
+    {
+      msg_fatal("serve mode can't be combined with daemon mode,"
+                " shared memory or output file\n");
+    }
+    return snapshot_serve() ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  if( watch_pid )
+  {
+    if( binary || shm_name || trigger_kind || incr_every > 1 )
+    {
+      msg_fatal("watch mode writes text samples, it can't be combined with"
+                " binary format, shared memory, triggers or incremental"
+                " captures\n");
+    }
+    return snapshot_watch() ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  if( interval > 0 || trigger_kind != 0 )
+  {
+    if( outfile == 0 && shm_name == 0 )
+    {
+      msg_fatal("output path must be specified for daemon mode\n");
+    }
+    return snapshot_daemon() ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  if( shm_name )
+  {
+    return shmring_capture(0) ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  int err = snapshot_all();
+
+  if( output_close() == -1 )
+  {
+    err = -1;
+  }
+
+  return err ? EXIT_FAILURE : EXIT_SUCCESS;
 }